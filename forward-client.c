@@ -1,5 +1,10 @@
 #include "swaylock.h"
 
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include "log.h"
 #include "assert.h"
 #include "color-management-v1-server-protocol.h"
@@ -39,6 +44,103 @@ const struct wl_shm_listener shm_listener = {
 	.format = wl_shm_handle_format,
 };
 
+static void drm_handle_device(void *data, struct wl_drm *wl_drm, const char *name) {
+	struct forward_state *forward = data;
+	free(forward->drm_device);
+	forward->drm_device = strdup(name);
+}
+
+static void drm_handle_format(void *data, struct wl_drm *wl_drm, uint32_t format) {
+	struct forward_state *forward = data;
+	add_one_element((void **)&forward->drm_formats, sizeof(uint32_t), &forward->drm_formats_len);
+	forward->drm_formats[forward->drm_formats_len - 1] = format;
+}
+
+static void drm_handle_authenticated(void *data, struct wl_drm *wl_drm) {
+	/* never requested */
+}
+
+static void drm_handle_capabilities(void *data, struct wl_drm *wl_drm, uint32_t value) {
+	/* create_prime_buffer is offered regardless, see bind_drm() */
+}
+
+const struct wl_drm_listener drm_listener = {
+	.device = drm_handle_device,
+	.format = drm_handle_format,
+	.authenticated = drm_handle_authenticated,
+	.capabilities = drm_handle_capabilities,
+};
+
+/* Return the path of the render node of the same GPU as `device`, or NULL */
+static char *find_render_node(dev_t device) {
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/drm",
+		major(device), minor(device));
+	DIR *dir = opendir(path);
+	if (!dir) {
+		return NULL;
+	}
+	char *node = NULL;
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		if (strncmp(entry->d_name, "renderD", strlen("renderD")) == 0) {
+			size_t len = strlen("/dev/dri/") + strlen(entry->d_name) + 1;
+			node = malloc(len);
+			if (node) {
+				snprintf(node, len, "/dev/dri/%s", entry->d_name);
+			}
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+void resolve_drm_render_node(struct forward_state *forward) {
+	/* Clients of the nested wl_drm get a render node, so that they never
+	 * need to authenticate */
+	dev_t device = 0;
+	if (forward->drm_device) {
+		struct stat st;
+		if (stat(forward->drm_device, &st) == 0 && S_ISCHR(st.st_mode)) {
+			device = st.st_rdev;
+		}
+	} else if (forward->default_feedback.current.main_device) {
+		device = forward->default_feedback.current.main_device;
+	}
+	if (device) {
+		forward->drm_render_node = find_render_node(device);
+	}
+	if (!forward->drm_render_node && forward->drm_device) {
+		/* e.g., if sysfs is not mounted; the upstream name can only be used
+		 * as is if it is a render node, since plugins are told they need
+		 * no authentication */
+		const char *name = strrchr(forward->drm_device, '/');
+		name = name ? name + 1 : forward->drm_device;
+		if (strncmp(name, "renderD", strlen("renderD")) == 0) {
+			forward->drm_render_node = strdup(forward->drm_device);
+		}
+	}
+	if (forward->drm_render_node) {
+		swaylock_log(LOG_DEBUG, "Offering DRM device %s to plugins",
+			forward->drm_render_node);
+	} else if (forward->drm_device) {
+		swaylock_log(LOG_INFO, "No render node found for DRM device %s; "
+			"not offering wl_drm to plugins", forward->drm_device);
+	}
+}
+
+static void presentation_handle_clock_id(void *data,
+		struct wp_presentation *wp_presentation, uint32_t clk_id) {
+	struct forward_state *forward = data;
+	forward->presentation_clock_id = clk_id;
+	forward->presentation_clock_id_done = true;
+}
+
+const struct wp_presentation_listener presentation_listener = {
+	.clock_id = presentation_handle_clock_id,
+};
+
 static void linux_dmabuf_handle_format(void *data, struct zwp_linux_dmabuf_v1 *linux_dmabuf,
 		uint32_t format) {
 	/* ignore, can be reconstructed from modifier list */
@@ -61,82 +163,83 @@ const struct zwp_linux_dmabuf_v1_listener linux_dmabuf_listener = {
 static void dmabuf_feedback_done(void *data,
 		struct zwp_linux_dmabuf_feedback_v1 *zwp_linux_dmabuf_feedback_v1) {
 	/* cleanup outdated tranches */
-	struct forward_state *forward = data;
-	for (size_t i = 0; i < forward->current.tranches_len; i++) {
-		wl_array_release(&forward->current.tranches[i].indices);
+	struct dmabuf_feedback_receiver *receiver = data;
+	for (size_t i = 0; i < receiver->current.tranches_len; i++) {
+		wl_array_release(&receiver->current.tranches[i].indices);
 	}
-	free(forward->current.tranches);
-	if (forward->current.table_fd != -1) {
-		close(forward->current.table_fd);
+	free(receiver->current.tranches);
+	if (receiver->current.table_fd != -1) {
+		close(receiver->current.table_fd);
 	}
 
-	forward->current = forward->pending;
+	receiver->current = receiver->pending;
+	receiver->done = true;
 
 	/* reset pending, keeping last main_device/table_fd values */
-	forward->pending.tranches = NULL;
-	forward->pending.tranches_len = 0;
-	if (forward->current.table_fd != -1) {
-		forward->pending.table_fd = dup(forward->current.table_fd);
-		if (!set_cloexec(forward->pending.table_fd)) {
+	receiver->pending.tranches = NULL;
+	receiver->pending.tranches_len = 0;
+	if (receiver->current.table_fd != -1) {
+		receiver->pending.table_fd = dup(receiver->current.table_fd);
+		if (!set_cloexec(receiver->pending.table_fd)) {
 			swaylock_log(LOG_ERROR, "Failed to set cloexec for dmabuf fd");
 		}
 	}
 
 	/* notify all the client's feedback objects */
 	struct wl_resource *resource;
-	wl_resource_for_each(resource, &forward->feedback_instances) {
-		send_dmabuf_feedback_data(resource, &forward->current);
+	wl_resource_for_each(resource, &receiver->instances) {
+		send_dmabuf_feedback_data(resource, &receiver->current);
 	}
 }
 static void dmabuf_feedback_format_table(void *data,
 		struct zwp_linux_dmabuf_feedback_v1 *zwp_linux_dmabuf_feedback_v1,
 		int32_t fd, uint32_t size) {
-	struct forward_state *forward = data;
-	if (forward->pending.table_fd != -1) {
-		close(forward->pending.table_fd);
+	struct dmabuf_feedback_receiver *receiver = data;
+	if (receiver->pending.table_fd != -1) {
+		close(receiver->pending.table_fd);
 	}
-	forward->pending.table_fd  = fd;
-	forward->pending.table_fd_size = size;
+	receiver->pending.table_fd  = fd;
+	receiver->pending.table_fd_size = size;
 }
 static void dmabuf_feedback_main_device(void *data,
 		struct zwp_linux_dmabuf_feedback_v1 *zwp_linux_dmabuf_feedback_v1,
 		struct wl_array *device) {
-	struct forward_state *forward = data;
-	memcpy(&forward->pending.main_device, device->data, sizeof(forward->pending.main_device));
+	struct dmabuf_feedback_receiver *receiver = data;
+	memcpy(&receiver->pending.main_device, device->data, sizeof(receiver->pending.main_device));
 
 }
 static void dmabuf_feedback_tranche_done(void *data,
 										 struct zwp_linux_dmabuf_feedback_v1 *zwp_linux_dmabuf_feedback_v1) {
-	struct forward_state *forward = data;
-	add_one_element((void**)&forward->pending.tranches, sizeof(struct feedback_tranche), &forward->pending.tranches_len);
+	struct dmabuf_feedback_receiver *receiver = data;
+	add_one_element((void**)&receiver->pending.tranches, sizeof(struct feedback_tranche), &receiver->pending.tranches_len);
 
-	forward->pending.tranches[forward->pending.tranches_len - 1] = forward->pending_tranche;
+	receiver->pending.tranches[receiver->pending.tranches_len - 1] = receiver->pending_tranche;
 	/* reset the pending tranche state */
-	memset(&forward->pending_tranche.tranche_device, 0, sizeof(dev_t));
-	wl_array_init(&forward->pending_tranche.indices);
-	forward->pending_tranche.flags = 0;
+	memset(&receiver->pending_tranche.tranche_device, 0, sizeof(dev_t));
+	wl_array_init(&receiver->pending_tranche.indices);
+	receiver->pending_tranche.flags = 0;
 }
 
 static void dmabuf_feedback_tranche_target_device(void *data,
 		struct zwp_linux_dmabuf_feedback_v1 *zwp_linux_dmabuf_feedback_v1,
 		struct wl_array *device) {
-	struct forward_state *forward = data;
-	memcpy(&forward->pending_tranche.tranche_device, device->data, sizeof(forward->pending_tranche.tranche_device));
+	struct dmabuf_feedback_receiver *receiver = data;
+	memcpy(&receiver->pending_tranche.tranche_device, device->data, sizeof(receiver->pending_tranche.tranche_device));
 }
 
 static void dmabuf_feedback_tranche_formats(void *data,
 		struct zwp_linux_dmabuf_feedback_v1 *zwp_linux_dmabuf_feedback_v1,
 		struct wl_array *indices) {
-	struct forward_state *forward = data;
-	if (wl_array_copy(&forward->pending_tranche.indices, indices) == -1) {
+	struct dmabuf_feedback_receiver *receiver = data;
+	if (wl_array_copy(&receiver->pending_tranche.indices, indices) == -1) {
 		swaylock_log(LOG_ERROR, "failed to copy tranche format list");
 	}
 }
 static void dmabuf_feedback_tranche_flags(void *data,
 		struct zwp_linux_dmabuf_feedback_v1 *zwp_linux_dmabuf_feedback_v1,
 		uint32_t flags) {
-	struct forward_state *forward = data;
-	forward->pending_tranche.flags = flags;
+	struct dmabuf_feedback_receiver *receiver = data;
+	receiver->pending_tranche.flags = flags;
 }
 
 const struct zwp_linux_dmabuf_feedback_v1_listener dmabuf_feedback_listener = {
@@ -149,6 +252,38 @@ const struct zwp_linux_dmabuf_feedback_v1_listener dmabuf_feedback_listener = {
 	.tranche_flags = dmabuf_feedback_tranche_flags,
 };
 
+void init_dmabuf_feedback_receiver(struct dmabuf_feedback_receiver *receiver) {
+	memset(receiver, 0, sizeof(*receiver));
+	receiver->current.table_fd = -1;
+	receiver->pending.table_fd = -1;
+	wl_array_init(&receiver->pending_tranche.indices);
+	wl_list_init(&receiver->instances);
+}
+
+static void release_dmabuf_feedback_state(struct dmabuf_feedback_state *state) {
+	for (size_t i = 0; i < state->tranches_len; i++) {
+		wl_array_release(&state->tranches[i].indices);
+	}
+	free(state->tranches);
+	if (state->table_fd != -1) {
+		close(state->table_fd);
+	}
+}
+
+void finish_dmabuf_feedback_receiver(struct dmabuf_feedback_receiver *receiver,
+		struct dmabuf_feedback_receiver *fallback) {
+	release_dmabuf_feedback_state(&receiver->current);
+	release_dmabuf_feedback_state(&receiver->pending);
+	wl_array_release(&receiver->pending_tranche.indices);
+	/* the resources unlink themselves when destroyed, so must stay in a list */
+	struct wl_resource *resource, *tmp;
+	wl_resource_for_each_safe(resource, tmp, &receiver->instances) {
+		wl_resource_set_user_data(resource, NULL);
+		wl_list_remove(wl_resource_get_link(resource));
+		wl_list_insert(&fallback->instances, wl_resource_get_link(resource));
+	}
+}
+
 
 static void color_supported_intent(void *data,
 		struct wp_color_manager_v1 *wp_color_manager_v1, uint32_t render_intent) {
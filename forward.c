@@ -1,20 +1,38 @@
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS
+#include "config.h"
 #include "swaylock.h"
 
 #include "log.h"
 #include "loop.h"
+#include "region.h"
 
 #include <wayland-client-core.h>
 #include <wayland-client-protocol.h>
 #include <wayland-server-core.h>
 #include <wayland-server-protocol.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#if HAVE_LIBDRM
+#include <xf86drm.h>
+#endif
 
 #include "color-management-v1-server-protocol.h"
 #include "color-representation-v1-server-protocol.h"
+#include "commit-timing-v1-server-protocol.h"
 #include "ext-session-lock-v1-client-protocol.h"
+#include "fifo-v1-server-protocol.h"
 #include "fractional-scale-v1-server-protocol.h"
 #include "linux-dmabuf-unstable-v1-server-protocol.h"
+#include "linux-drm-syncobj-v1-server-protocol.h"
+#include "presentation-time-server-protocol.h"
+#include "single-pixel-buffer-v1-server-protocol.h"
 #include "viewporter-server-protocol.h"
 #include "wayland-drm-server-protocol.h"
 #include "wlr-layer-shell-unstable-v1-server-protocol.h"
@@ -24,9 +42,15 @@ static const struct wl_surface_interface surface_impl;
 static const struct wl_buffer_interface buffer_impl;
 static const struct wl_shm_pool_interface shm_pool_impl;
 static const struct wl_compositor_interface compositor_impl;
+static const struct wl_region_interface region_impl;
 static const struct zwp_linux_buffer_params_v1_interface linux_dmabuf_params_impl;
 static const struct zwp_linux_dmabuf_feedback_v1_interface linux_dmabuf_feedback_v1_impl;
 static const struct wp_viewport_interface viewport_impl;
+static const struct wp_presentation_interface presentation_impl;
+static const struct wp_fifo_v1_interface fifo_impl;
+static const struct wp_commit_timer_v1_interface commit_timer_impl;
+static const struct wp_linux_drm_syncobj_surface_v1_interface syncobj_surface_impl;
+static const struct wp_linux_drm_syncobj_timeline_v1_interface syncobj_timeline_impl;
 static const struct wp_fractional_scale_v1_interface fractional_scale_impl;
 static const struct wp_image_description_creator_icc_v1_interface desc_creator_icc_impl;
 static const struct wp_image_description_creator_params_v1_interface desc_creator_params_impl;
@@ -34,14 +58,293 @@ static const struct wp_color_management_surface_v1_interface color_surface_impl;
 static const struct wp_image_description_v1_interface image_desc_impl;
 static const struct wp_color_representation_surface_v1_interface color_rep_surface_impl;
 static void delete_image_desc_if_unreferenced(struct forward_image_desc* desc);
+static void clear_sync_point(struct syncobj_point *point);
+
+/* The implicit modifier, as in drm_fourcc.h */
+#define DRM_FORMAT_MOD_INVALID 0x00ffffffffffffffULL
+
+/* Buffers and params are allocated in groups of this size */
+#define FORWARD_OBJECTS_PER_CHUNK 16
+/* In debug mode, the allocation count is logged after this many commits */
+#define FORWARD_ALLOC_REPORT_INTERVAL 600
+
+struct forward_shm_pool {
+	struct forward_state *forward;
+	/* upstream pool; null with --shadow-buffers */
+	struct wl_shm_pool *pool;
+	/* with --shadow-buffers, the pool is mapped locally instead; the fd is
+	 * kept while the resource exists, to remap on resize */
+	int fd;
+	void *data;
+	size_t size;
+	/* the resource and each shadowed buffer hold a reference */
+	int refs;
+	/* a copy from the mapping faulted, as the plugin shrank the file */
+	bool sigbus;
+};
+
+/* An imported drm syncobj timeline */
+struct forward_timeline {
+	struct forward_state *forward;
+	struct wp_linux_drm_syncobj_timeline_v1 *timeline;
+	/* the same syncobj, imported on forward_state::drm_fd */
+	uint32_t handle;
+	/* the resource and each point set on a surface or buffer hold a
+	 * reference */
+	int refs;
+};
+
+struct forward_presentation_feedback {
+	struct forward_state *forward;
+	/* null if the plugin disconnected */
+	struct wl_resource *resource;
+	/* upstream feedback, once the commit has been forwarded */
+	struct wp_presentation_feedback *feedback;
+	/* used to map upstream sync_output events to the plugin's wl_outputs */
+	struct swaylock_state *state;
+	/* in forward_surface::pending_feedbacks or queued_feedbacks, until
+	 * forwarded upstream */
+	struct wl_list link;
+};
+
+struct forward_region {
+	struct forward_state *forward;
+	struct region_ops ops;
+};
+
+/* A plugin wl_subsurface, forwarded as a subsurface of the parent's
+ * upstream surface */
+struct forward_subsurface {
+	struct wl_resource *resource;
+	struct forward_surface *surface;
+	/* null if the parent surface was destroyed */
+	struct forward_surface *parent;
+	/* in the parent's forward_surface::subsurfaces */
+	struct wl_list link;
+	/* kept to apply once the upstream subsurface is created */
+	int32_t x, y;
+	bool sync;
+
+	struct wl_surface *upstream;
+	/* null until the parent has an upstream surface */
+	struct wl_subsurface *upstream_subsurface;
+	/* the viewport exists if the viewporter does; the rest are made on demand */
+	struct wp_viewport *viewport;
+	struct wp_color_representation_surface_v1 *color_rep_surface;
+	struct wp_color_management_surface_v1 *color_surface;
+	struct wp_linux_drm_syncobj_surface_v1 *syncobj_surface;
+	struct wp_fifo_v1 *fifo;
+	struct wp_commit_timer_v1 *commit_timer;
+};
+
+/* The upstream objects that the state of a plugin surface is applied to:
+ * those of the swaylock surface, or those of a forward_subsurface */
+struct upstream_objects {
+	struct wl_surface *surface;
+	struct wp_viewport **viewport;
+	struct wp_color_representation_surface_v1 **color_rep_surface;
+	struct wp_color_management_surface_v1 **color_surface;
+	struct wp_linux_drm_syncobj_surface_v1 **syncobj_surface;
+	struct wp_fifo_v1 **fifo;
+	struct wp_commit_timer_v1 **commit_timer;
+};
+
+/* Returns false if the surface has no role yet, and so no upstream surface */
+static bool get_upstream(struct forward_surface *surface, struct upstream_objects *up) {
+	struct forward_subsurface *sub = surface->subsurface;
+	struct swaylock_surface *sw_surf = surface->sway_surface;
+	if (sub) {
+		*up = (struct upstream_objects){
+			.surface = sub->upstream,
+			.viewport = &sub->viewport,
+			.color_rep_surface = &sub->color_rep_surface,
+			.color_surface = &sub->color_surface,
+			.syncobj_surface = &sub->syncobj_surface,
+			.fifo = &sub->fifo,
+			.commit_timer = &sub->commit_timer,
+		};
+		return true;
+	} else if (sw_surf) {
+		*up = (struct upstream_objects){
+			.surface = sw_surf->surface,
+			.viewport = &sw_surf->viewport,
+			.color_rep_surface = &sw_surf->color_rep_surface,
+			.color_surface = &sw_surf->color_surface,
+			.syncobj_surface = &sw_surf->syncobj_surface,
+			.fifo = &sw_surf->fifo,
+			.commit_timer = &sw_surf->commit_timer,
+		};
+		return true;
+	}
+	return false;
+}
+
+/* --mirror: are other outputs showing this plugin surface */
+static bool has_mirrors(struct forward_surface *surface) {
+	return surface->sway_surface && !wl_list_empty(&surface->sway_surface->mirrors);
+}
+
+static bool has_upstream(struct forward_surface *surface) {
+	return surface->sway_surface || surface->subsurface;
+}
+
+static void destroy_forward_subsurface(struct forward_subsurface *sub) {
+	wl_resource_set_user_data(sub->resource, NULL);
+	sub->surface->subsurface = NULL;
+	wl_list_remove(&sub->link);
+	if (sub->viewport) {
+		wp_viewport_destroy(sub->viewport);
+	}
+	if (sub->color_rep_surface) {
+		wp_color_representation_surface_v1_destroy(sub->color_rep_surface);
+	}
+	if (sub->color_surface) {
+		wp_color_management_surface_v1_destroy(sub->color_surface);
+	}
+	if (sub->syncobj_surface) {
+		wp_linux_drm_syncobj_surface_v1_destroy(sub->syncobj_surface);
+	}
+	if (sub->fifo) {
+		wp_fifo_v1_destroy(sub->fifo);
+	}
+	if (sub->commit_timer) {
+		wp_commit_timer_v1_destroy(sub->commit_timer);
+	}
+	if (sub->upstream_subsurface) {
+		wl_subsurface_destroy(sub->upstream_subsurface);
+	}
+	wl_surface_destroy(sub->upstream);
+	free(sub);
+}
 
 struct forward_params {
+	struct forward_state *forward;
 	struct zwp_linux_buffer_params_v1* params;
 	struct wl_resource *resource;
 	int32_t width;
 	int32_t height;
 };
 
+static void count_allocation(struct forward_state *forward) {
+	forward->allocations++;
+}
+
+/* slab_alloc(), counting the allocation if the slab had to grow */
+static void *forward_slab_alloc(struct forward_state *forward, struct slab *slab) {
+	size_t chunks = slab->chunk_count;
+	void *object = slab_alloc(slab);
+	if (slab->chunk_count != chunks) {
+		count_allocation(forward);
+	}
+	return object;
+}
+
+/* region_add(), counting the allocation if the region had to grow */
+static void add_damage(struct forward_surface *surface, struct region *region,
+		int32_t x, int32_t y, int32_t width, int32_t height) {
+	size_t capacity = region->capacity;
+	region_add(region, x, y, width, height, surface->state->max_damage_rects);
+	if (region->capacity != capacity) {
+		count_allocation(surface->state);
+	}
+}
+
+/* Make room for `len` region operations, counting the allocation if needed */
+static bool reserve_region_ops(struct forward_state *forward, struct region_ops *ops,
+		size_t len) {
+	if (len <= ops->capacity) {
+		return true;
+	}
+	size_t capacity = ops->capacity ? ops->capacity : 4;
+	while (capacity < len) {
+		capacity *= 2;
+	}
+	struct region_op *data = realloc(ops->ops, capacity * sizeof(struct region_op));
+	if (!data) {
+		return false;
+	}
+	count_allocation(forward);
+	ops->ops = data;
+	ops->capacity = capacity;
+	return true;
+}
+
+static bool is_shm_format_supported(struct forward_state *forward, uint32_t format) {
+	for (size_t i = 0; i < forward->shm_formats_len; i++) {
+		if (forward->shm_formats[i] == format) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Bytes per pixel of common single-plane shm formats, or 0 if unknown; damage
+ * in buffers of unknown formats is copied as whole rows */
+static uint32_t shm_format_bpp(uint32_t format) {
+	switch (format) {
+	case WL_SHM_FORMAT_ARGB8888:
+	case WL_SHM_FORMAT_XRGB8888:
+	case WL_SHM_FORMAT_ABGR8888:
+	case WL_SHM_FORMAT_XBGR8888:
+	case WL_SHM_FORMAT_RGBA8888:
+	case WL_SHM_FORMAT_RGBX8888:
+	case WL_SHM_FORMAT_BGRA8888:
+	case WL_SHM_FORMAT_BGRX8888:
+	case WL_SHM_FORMAT_ARGB2101010:
+	case WL_SHM_FORMAT_XRGB2101010:
+	case WL_SHM_FORMAT_ABGR2101010:
+	case WL_SHM_FORMAT_XBGR2101010:
+		return 4;
+	case WL_SHM_FORMAT_RGB888:
+	case WL_SHM_FORMAT_BGR888:
+		return 3;
+	case WL_SHM_FORMAT_RGB565:
+	case WL_SHM_FORMAT_BGR565:
+		return 2;
+	case WL_SHM_FORMAT_ABGR16161616F:
+	case WL_SHM_FORMAT_XBGR16161616F:
+		return 8;
+	default:
+		return 0;
+	}
+}
+
+static void unref_shm_pool(struct forward_shm_pool *pool) {
+	if (--pool->refs > 0) {
+		return;
+	}
+	if (pool->pool) {
+		wl_shm_pool_destroy(pool->pool);
+	}
+	if (pool->data) {
+		munmap(pool->data, pool->size);
+	}
+	free(pool);
+}
+
+static void destroy_forward_buffer(struct forward_buffer *buffer) {
+	clear_sync_point(&buffer->release);
+	if (buffer->buffer) {
+		wl_buffer_destroy(buffer->buffer);
+	}
+	if (buffer->shm_pool) {
+		unref_shm_pool(buffer->shm_pool);
+	}
+	slab_free(&buffer->forward->buffer_slab, buffer);
+}
+
+void init_forward_state(struct forward_state *forward) {
+	forward->drm_fd = -1;
+	init_dmabuf_feedback_receiver(&forward->default_feedback);
+	wl_list_init(&forward->color_feedback_resources);
+	slab_init(&forward->buffer_slab, sizeof(struct forward_buffer),
+		FORWARD_OBJECTS_PER_CHUNK);
+	slab_init(&forward->params_slab, sizeof(struct forward_params),
+		FORWARD_OBJECTS_PER_CHUNK);
+	slab_init(&forward->feedback_slab, sizeof(struct forward_presentation_feedback),
+		FORWARD_OBJECTS_PER_CHUNK);
+}
+
 static bool does_transform_transpose_size(int32_t transform) {
 	switch (transform) {
 	default:
@@ -54,7 +357,78 @@ static bool does_transform_transpose_size(int32_t transform) {
 	case WL_OUTPUT_TRANSFORM_270:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		return false;
+		return true;
+	}
+}
+
+/*
+ * Convert a rectangle in surface coordinates to buffer coordinates, using the
+ * committed viewport, buffer scale and buffer transform; the result is
+ * rounded outward and clipped to the buffer.
+ */
+static struct region_rect surface_to_buffer_damage(
+		const struct forward_surface *surface, const struct region_rect *rect) {
+	const struct surface_state *state = &surface->committed;
+	int32_t scale = state->buffer_scale > 0 ? state->buffer_scale : 1;
+	bool transpose = does_transform_transpose_size(state->buffer_transform);
+	/* size of the buffer after the transform is applied, in buffer pixels */
+	double tw = transpose ? surface->committed_buffer_height : surface->committed_buffer_width;
+	double th = transpose ? surface->committed_buffer_width : surface->committed_buffer_height;
+
+	double x1 = rect->x, y1 = rect->y;
+	double x2 = x1 + rect->width, y2 = y1 + rect->height;
+
+	wl_fixed_t n = wl_fixed_from_int(-1);
+	bool viewport_src_on = state->viewport_source_w != n;
+	bool viewport_dst_on = state->viewport_dest_width != -1;
+	if (viewport_src_on || viewport_dst_on) {
+		double src_x = 0, src_y = 0, src_w = tw / scale, src_h = th / scale;
+		if (viewport_src_on) {
+			src_x = wl_fixed_to_double(state->viewport_source_x);
+			src_y = wl_fixed_to_double(state->viewport_source_y);
+			src_w = wl_fixed_to_double(state->viewport_source_w);
+			src_h = wl_fixed_to_double(state->viewport_source_h);
+		}
+		double dst_w = viewport_dst_on ? state->viewport_dest_width : src_w;
+		double dst_h = viewport_dst_on ? state->viewport_dest_height : src_h;
+		if (dst_w > 0 && dst_h > 0) {
+			x1 = src_x + x1 * src_w / dst_w;
+			x2 = src_x + x2 * src_w / dst_w;
+			y1 = src_y + y1 * src_h / dst_h;
+			y2 = src_y + y2 * src_h / dst_h;
+		}
+	}
+
+	x1 = fmax(floor(x1 * scale), 0);
+	y1 = fmax(floor(y1 * scale), 0);
+	x2 = fmin(ceil(x2 * scale), tw);
+	y2 = fmin(ceil(y2 * scale), th);
+	if (x2 <= x1 || y2 <= y1) {
+		return (struct region_rect){0};
+	}
+	int32_t x = x1, y = y1, w = x2 - x1, h = y2 - y1;
+	int32_t width = tw, height = th;
+
+	/* The buffer holds the surface contents with the transform applied;
+	 * map the box in the same way */
+	switch (state->buffer_transform) {
+	default:
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+		return (struct region_rect){ x, y, w, h };
+	case WL_OUTPUT_TRANSFORM_90:
+		return (struct region_rect){ y, width - x - w, h, w };
+	case WL_OUTPUT_TRANSFORM_180:
+		return (struct region_rect){ width - x - w, height - y - h, w, h };
+	case WL_OUTPUT_TRANSFORM_270:
+		return (struct region_rect){ height - y - h, x, h, w };
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		return (struct region_rect){ width - x - w, y, w, h };
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		return (struct region_rect){ y, x, h, w };
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		return (struct region_rect){ x, height - y - h, w, h };
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		return (struct region_rect){ height - y - h, width - x - w, h, w };
 	}
 }
 
@@ -72,6 +446,17 @@ static void nested_surface_attach(struct wl_client *client,
 		assert(wl_resource_instance_of(buffer, &wl_buffer_interface, &buffer_impl));
 		f_buffer = wl_resource_get_user_data(buffer);
 	}
+	if (wl_resource_get_version(resource) >= WL_SURFACE_OFFSET_SINCE_VERSION) {
+		if (x != 0 || y != 0) {
+			wl_resource_post_error(resource, WL_SURFACE_ERROR_INVALID_OFFSET,
+				"non-zero attach offset, use wl_surface.offset instead");
+			return;
+		}
+	} else {
+		surface->pending.offset_x = x;
+		surface->pending.offset_y = y;
+	}
+	surface->buffer_attached = f_buffer != NULL;
 
 	if (surface->pending.attachment == f_buffer) {
 		/* no change */
@@ -84,12 +469,13 @@ static void nested_surface_attach(struct wl_client *client,
 		/* Remove old buffer if no links to it left */
 		if (old_buf->resource == NULL && wl_list_empty(&old_buf->pending_surfaces)) {
 			assert(wl_list_empty(&old_buf->committed_surfaces));
-			wl_buffer_destroy(old_buf->buffer);
-			free(old_buf);
+			destroy_forward_buffer(old_buf);
 		}
 	}
 
-	wl_list_insert(&f_buffer->pending_surfaces, &surface->pending.attachment_link);
+	if (f_buffer) {
+		wl_list_insert(&f_buffer->pending_surfaces, &surface->pending.attachment_link);
+	}
 	surface->pending.attachment = f_buffer;
 }
 static void nested_surface_damage(struct wl_client *client,
@@ -98,15 +484,9 @@ static void nested_surface_damage(struct wl_client *client,
 	assert(wl_resource_instance_of(resource, &wl_surface_interface, &surface_impl));
 	struct forward_surface *surface = wl_resource_get_user_data(resource);
 
-	struct damage_record *new_damage = realloc(surface->old_damage, sizeof(struct damage_record) * (surface->old_damage_len + 1));
-	if (new_damage) {
-		surface->old_damage = new_damage;
-		surface->old_damage[surface->old_damage_len].x = x;
-		surface->old_damage[surface->old_damage_len].y = y;
-		surface->old_damage[surface->old_damage_len].w = width;
-		surface->old_damage[surface->old_damage_len].h = height;
-		surface->old_damage_len++;
-	}
+	/* converted to buffer damage on commit, once the scale, transform and
+	 * viewport that apply are known */
+	add_damage(surface, &surface->surface_damage, x, y, width, height);
 }
 
 static void frame_callback_handle_resource_destroy(struct wl_resource *resource) {
@@ -131,164 +511,852 @@ static void nested_surface_frame(struct wl_client *client,
 	struct wl_list *link = wl_resource_get_link(callback_resource);
 	wl_list_insert(&surface->frame_callbacks, link);
 }
+/* Replay the committed opaque region onto an upstream surface; an empty
+ * list unsets the region, like the initial state */
+static void set_upstream_opaque_region(struct forward_surface *surface,
+		struct wl_surface *upstream) {
+	struct wl_region *region = NULL;
+	if (surface->committed_opaque.len > 0) {
+		region = wl_compositor_create_region(surface->state->compositor);
+		for (size_t i = 0; i < surface->committed_opaque.len; i++) {
+			const struct region_op *op = &surface->committed_opaque.ops[i];
+			if (op->subtract) {
+				wl_region_subtract(region, op->x, op->y, op->width, op->height);
+			} else {
+				wl_region_add(region, op->x, op->y, op->width, op->height);
+			}
+		}
+	}
+	wl_surface_set_opaque_region(upstream, region);
+	if (region) {
+		wl_region_destroy(region);
+	}
+}
 static void nested_surface_set_opaque_region(struct wl_client *client,
 		struct wl_resource *resource, struct wl_resource *region) {
-	// do nothing, swaylock doesn't need to know about regions
+	assert(wl_resource_instance_of(resource, &wl_surface_interface, &surface_impl));
+	struct forward_surface *surface = wl_resource_get_user_data(resource);
+	/* the region is copied, as it may be changed or destroyed before commit */
+	surface->pending_opaque.len = 0;
+	if (region) {
+		assert(wl_resource_instance_of(region, &wl_region_interface, &region_impl));
+		const struct forward_region *source = wl_resource_get_user_data(region);
+		if (!reserve_region_ops(surface->state, &surface->pending_opaque, source->ops.len)) {
+			wl_client_post_no_memory(client);
+			return;
+		}
+		memcpy(surface->pending_opaque.ops, source->ops.ops,
+			source->ops.len * sizeof(struct region_op));
+		surface->pending_opaque.len = source->ops.len;
+	}
+	surface->opaque_changed = true;
 }
 static void nested_surface_set_input_region(struct wl_client *client,
 		struct wl_resource *resource, struct wl_resource *region) {
-	// do nothing, swaylock doesn't need to know about regions
+	// do nothing; input on the lock surface goes to swaylock, not the plugin
 }
 
 void add_serial_pair(struct forward_surface *surf, uint32_t upstream_serial,
 		uint32_t downstream_serial, uint32_t width, uint32_t height, bool local_only) {
-	surf->serial_table = realloc(surf->serial_table, sizeof(struct serial_pair) * (surf->serial_table_len + 1));
-	assert(surf->serial_table);
+	/* Callers hold back configures while the ring is full, as dropping an
+	 * entry would make a valid ack_configure from the plugin fail */
+	assert(surf->serial_ring_len < SERIAL_RING_CAPACITY);
 
-	surf->serial_table[surf->serial_table_len] = (struct serial_pair) {
+	size_t i = (surf->serial_ring_start + surf->serial_ring_len) % SERIAL_RING_CAPACITY;
+	surf->serial_ring[i] = (struct serial_pair) {
 		.plugin_serial = downstream_serial,
 		.upstream_serial = upstream_serial,
 		.config_width = width,
 		.config_height = height,
 		.local_only = local_only,
 	};
-	surf->serial_table_len++;
+	surf->serial_ring_len++;
 }
 
-static void bg_frame_handle_done(void *data, struct wl_callback *callback,
-		uint32_t time) {
-	(void)time;
-	struct forward_surface *surface = data;
+bool take_serial_pair(struct forward_surface *surf, uint32_t plugin_serial,
+		struct serial_pair *entry) {
+	/* Plugins normally ack the oldest or newest outstanding configure, and
+	 * every entry scanned past is discarded on success, so this is cheap */
+	for (size_t k = 0; k < surf->serial_ring_len; k++) {
+		size_t i = (surf->serial_ring_start + k) % SERIAL_RING_CAPACITY;
+		if (surf->serial_ring[i].plugin_serial == plugin_serial) {
+			*entry = surf->serial_ring[i];
+			/* once a serial is used, discard both it and serials older than it */
+			surf->serial_ring_start = (i + 1) % SERIAL_RING_CAPACITY;
+			surf->serial_ring_len -= k + 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+static int64_t monotonic_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool shadow_present(struct forward_surface *surface);
+static void finish_upstream_commit(struct forward_surface *surface);
+static void present_upstream(struct forward_surface *surface);
+static void flush_deferred_commit(struct forward_surface *surface);
+static void queue_presentation_feedback(struct forward_surface *surface);
+static void forward_queued_feedback(struct forward_surface *surface);
+static void discard_presentation_feedback(struct wl_list *feedbacks);
+
+static int frame_interval_ms(struct forward_surface *surface) {
+	return surface->sway_surface ? surface->sway_surface->min_frame_interval_ms : 0;
+}
+
+/* Pacing timers may fire up to this fraction of the interval late */
+#define FRAME_PACING_SLACK_DIVISOR 8
+
+static void release_frame_callbacks(struct forward_surface *surface) {
+	int64_t now = monotonic_ms();
+	surface->last_frame_done_ms = now;
+	/* the compositor's timestamp, advanced by however long the callbacks
+	 * were held back */
+	uint32_t time = surface->frame_done_time +
+		(uint32_t)(now - surface->frame_done_received_ms);
 
 	// Trigger all frame callbacks for the background
 	struct wl_resource *plugin_cb, *tmp;
 	wl_resource_for_each_safe(plugin_cb, tmp, &surface->frame_callbacks) {
-		wl_callback_send_done(plugin_cb, 0);
+		wl_callback_send_done(plugin_cb, time);
 		wl_resource_destroy(plugin_cb);
 	}
+}
+
+static void frame_timer_handle_expiry(void *data) {
+	struct forward_surface *surface = data;
+	surface->frame_timer = NULL;
+	release_frame_callbacks(surface);
+}
+
+static void bg_frame_handle_done(void *data, struct wl_callback *callback,
+		uint32_t time) {
+	struct forward_surface *surface = data;
 	wl_callback_destroy(callback);
+
+	surface->upstream_frame = NULL;
+	if (surface->mailbox_deferred && !surface->deferred_commit_timer) {
+		/* With --mailbox, the last frame was shown, so forward the
+		 * latest plugin commit */
+		surface->mailbox_deferred = false;
+		if (!surface->inert && has_upstream(surface) && !surface->shadow_deferred) {
+			present_upstream(surface);
+		}
+	}
+
+	if (surface->frame_timer) {
+		/* callbacks are already being held back */
+		return;
+	}
+	surface->frame_done_time = time;
+	surface->frame_done_received_ms = monotonic_ms();
+	int interval = frame_interval_ms(surface);
+	int64_t wait = surface->last_frame_done_ms + interval - monotonic_ms();
+	if (interval <= 0 || wait <= 0) {
+		release_frame_callbacks(surface);
+		return;
+	}
+	/* With --max-fps, hold the plugin's callbacks back until the
+	 * interval since the last ones has passed */
+	surface->frame_timer = loop_add_timer_slack(surface->state->eventloop,
+		(int)wait, interval / FRAME_PACING_SLACK_DIVISOR,
+		frame_timer_handle_expiry, surface);
+	if (!surface->frame_timer) {
+		release_frame_callbacks(surface);
+	}
 }
 
 static const struct wl_callback_listener bg_frame_listener = {
 	.done = bg_frame_handle_done,
 };
 
-static void nested_surface_commit(struct wl_client *client,
-		struct wl_resource *resource) {
-	assert(wl_resource_instance_of(resource, &wl_surface_interface, &surface_impl));
-	struct forward_surface *surface = wl_resource_get_user_data(resource);
-	if (surface->inert) {
-		return;
+/*
+ * fifo-v1 and commit-timing-v1 requests apply to the plugin's next commit.
+ * If that is merged with later ones before being forwarded (by --max-fps or
+ * --shadow-buffers), the merged commit waits on the fifo barrier if any of
+ * them did, and targets the latest timestamp.
+ */
+static void merge_commit_timing(struct forward_surface *surface) {
+	struct commit_timing_state *pending = &surface->pending_timing;
+	struct commit_timing_state *unsent = &surface->unsent_timing;
+	unsent->fifo_barrier |= pending->fifo_barrier;
+	unsent->fifo_wait |= pending->fifo_wait;
+	if (pending->has_timestamp) {
+		unsent->has_timestamp = true;
+		unsent->tv_sec_hi = pending->tv_sec_hi;
+		unsent->tv_sec_lo = pending->tv_sec_lo;
+		unsent->tv_nsec = pending->tv_nsec;
 	}
+	*pending = (struct commit_timing_state){0};
+}
 
-	if (!surface->sway_surface) {
-		/* Clients can create and commit to any number of wl_surfaces; however,
-		 * these have no impact until the surface is given a role. Ignore these
-		 * commits. */
+/* Apply the plugin's fifo and commit timer requests to the upstream commit
+ * about to be made */
+static void forward_commit_timing(struct forward_surface *surface) {
+	struct commit_timing_state *timing = &surface->unsent_timing;
+	struct swaylock_surface *sw_surf = surface->sway_surface;
+	struct upstream_objects up;
+	get_upstream(surface, &up);
+	if (sw_surf && sw_surf->has_pending_ack_conf) {
+		/* A commit answering a configure is never held back, as the
+		 * compositor may be waiting for it to finish locking; the barrier
+		 * is still set, so later commits can wait on it. */
+		timing->fifo_wait = false;
+		timing->has_timestamp = false;
+	}
+
+	struct forward_state *forward = surface->state;
+	if ((timing->fifo_barrier || timing->fifo_wait) && !*up.fifo) {
+		*up.fifo = wp_fifo_manager_v1_get_fifo(forward->fifo_manager,
+			up.surface);
+	}
+	if (timing->fifo_barrier) {
+		wp_fifo_v1_set_barrier(*up.fifo);
+	}
+	if (timing->fifo_wait) {
+		wp_fifo_v1_wait_barrier(*up.fifo);
+	}
+	if (timing->has_timestamp) {
+		if (!*up.commit_timer) {
+			*up.commit_timer = wp_commit_timing_manager_v1_get_timer(
+				forward->commit_timing_manager, up.surface);
+		}
+		wp_commit_timer_v1_set_timestamp(*up.commit_timer,
+			timing->tv_sec_hi, timing->tv_sec_lo, timing->tv_nsec);
+	}
+	*timing = (struct commit_timing_state){0};
+}
+
+/* Import a plugin's syncobj fd locally; fails if it is not a drm syncobj.
+ * The nested wp_linux_drm_syncobj_manager_v1 is only offered with libdrm,
+ * and with forward_state::drm_fd open */
+static bool import_local_syncobj(struct forward_state *forward, int fd,
+		uint32_t *handle) {
+#if HAVE_LIBDRM
+	return drmSyncobjFDToHandle(forward->drm_fd, fd, handle) == 0;
+#else
+	return false;
+#endif
+}
+
+static void destroy_local_syncobj(struct forward_state *forward, uint32_t handle) {
+#if HAVE_LIBDRM
+	drmSyncobjDestroy(forward->drm_fd, handle);
+#endif
+}
+
+/* Signal a point which the compositor was given but will never signal */
+static void signal_sync_point(struct syncobj_point *point) {
+#if HAVE_LIBDRM
+	struct forward_timeline *timeline = point->timeline;
+	uint64_t value = ((uint64_t)point->point_hi << 32) | point->point_lo;
+	if (drmSyncobjTimelineSignal(timeline->forward->drm_fd,
+			&timeline->handle, &value, 1) != 0) {
+		swaylock_log_errno(LOG_ERROR, "Failed to signal plugin release point");
+	}
+#endif
+}
+
+static void unref_timeline(struct forward_timeline *timeline) {
+	if (--timeline->refs > 0) {
 		return;
 	}
+	wp_linux_drm_syncobj_timeline_v1_destroy(timeline->timeline);
+	destroy_local_syncobj(timeline->forward, timeline->handle);
+	free(timeline);
+}
 
-	if (!surface->has_been_configured) {
-		/* send initial configure */
-		struct swaylock_bg_client *bg_client = surface->sway_surface->client ?
-			surface->sway_surface->client : surface->sway_surface->state->server.main_client;
-		uint32_t plugin_serial = bg_client->serial++;
+static void clear_sync_point(struct syncobj_point *point) {
+	if (point->timeline) {
+		unref_timeline(point->timeline);
+	}
+	*point = (struct syncobj_point){0};
+}
 
-		uint32_t config_width = surface->sway_surface->width, config_height = surface->sway_surface->height;
-		if (config_width == 0 || config_height == 0) {
-			swaylock_log(LOG_ERROR, "committing nested surface before main surface dimensions known");
+/*
+ * Check the drm syncobj points against the buffer of the commit being made,
+ * as the compositor would; returns false if a protocol error was posted.
+ */
+static bool check_sync_points(struct forward_surface *surface, bool buffer_attached) {
+	struct syncobj_point *acquire = &surface->pending_acquire;
+	struct syncobj_point *release = &surface->pending_release;
+	if (!surface->syncobj_surface) {
+		return true;
+	}
+	if (buffer_attached) {
+		if (!surface->pending.attachment->dmabuf) {
+			wl_resource_post_error(surface->syncobj_surface,
+				WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_UNSUPPORTED_BUFFER,
+				"explicit synchronization needs a dmabuf");
+			return false;
 		}
-
-		// When committing a plugin surface for the first time,
-		// if the upstream surface is also new, then forward the configure;
-		// but if the upsteam surface was configured long ago, then
-		// keep the configure local
-		if (!surface->sway_surface->used_first_configure) {
-			add_serial_pair(surface, surface->sway_surface->first_configure_serial, plugin_serial,
-				config_width, config_height, false);
-			surface->sway_surface->used_first_configure = true;
-		} else if (surface->sway_surface->has_newer_serial) {
-			/* In this case, the swaylock surface has received
-			 * unacknowledged configures that the previous client
-			 * for the surface did not acknowledge. Since we are
-			 * giving this client an up to date size, acknowledge
-			 * the corresponding configure when the client finally
-			 * responds. */
-			add_serial_pair(surface, surface->sway_surface->newest_serial, plugin_serial,
-				config_width, config_height, false);
-		} else {
-			/* Swallow plugin's configure event -- all upstream configures
-			 * were acknowledged by past clients */
-			add_serial_pair(surface, 0, plugin_serial, config_width, config_height, true);
+		if (!acquire->timeline) {
+			wl_resource_post_error(surface->syncobj_surface,
+				WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_NO_ACQUIRE_POINT,
+				"no acquire point set");
+			return false;
 		}
-		zwlr_layer_surface_v1_send_configure(surface->layer_surface, plugin_serial,
-			config_width, config_height);
-
-		surface->has_been_configured = true;
+		if (!release->timeline) {
+			wl_resource_post_error(surface->syncobj_surface,
+				WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_NO_RELEASE_POINT,
+				"no release point set");
+			return false;
+		}
+		uint64_t acquire_point = ((uint64_t)acquire->point_hi << 32) | acquire->point_lo;
+		uint64_t release_point = ((uint64_t)release->point_hi << 32) | release->point_lo;
+		if (acquire->timeline == release->timeline && release_point <= acquire_point) {
+			wl_resource_post_error(surface->syncobj_surface,
+				WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_CONFLICTING_POINTS,
+				"release point must come after acquire point");
+			return false;
+		}
+	} else if (acquire->timeline || release->timeline) {
+		wl_resource_post_error(surface->syncobj_surface,
+			WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_NO_BUFFER,
+			"sync points set without attaching a buffer");
+		return false;
+	}
+	if (surface->inert || !has_upstream(surface)) {
+		/* the commit will not be forwarded */
+		clear_sync_point(acquire);
+		clear_sync_point(release);
+	}
+	return true;
+}
 
-		// todo: handle unmap/remap logic -- is it an error to attach a buffer
-		// after unmapping?
-		assert(!surface->pending.attachment);
-		/* The first commit should not be forwarded, because the main swaylock
-		 * process already made such a commit in order to receive its
-		 * own configure event. Thus, return here. */
+/* Set the plugin's points on the upstream surface, for the buffer just
+ * attached to it */
+static void forward_sync_points(struct forward_surface *surface) {
+	if (!surface->pending_acquire.timeline) {
 		return;
 	}
+	struct upstream_objects up;
+	get_upstream(surface, &up);
+	if (!*up.syncobj_surface) {
+		*up.syncobj_surface = wp_linux_drm_syncobj_manager_v1_get_surface(
+			surface->state->syncobj_manager, up.surface);
+	}
+	wp_linux_drm_syncobj_surface_v1_set_acquire_point(*up.syncobj_surface,
+		surface->pending_acquire.timeline->timeline,
+		surface->pending_acquire.point_hi, surface->pending_acquire.point_lo);
+	wp_linux_drm_syncobj_surface_v1_set_release_point(*up.syncobj_surface,
+		surface->pending_release.timeline->timeline,
+		surface->pending_release.point_hi, surface->pending_release.point_lo);
+	clear_sync_point(&surface->pending_acquire);
+	/* the buffer keeps the release point until the compositor is done */
+	struct forward_buffer *buffer = surface->pending.attachment;
+	clear_sync_point(&buffer->release);
+	buffer->release = surface->pending_release;
+	surface->pending_release = (struct syncobj_point){0};
+	surface->release_point_unsent = true;
+}
 
-	if (surface->committed.attachment == NULL && surface->pending.attachment == NULL) {
-		/* In this scenario, no buffer has been attached yet; there is no point in making
-		 * a second or further commit without a buffer, so don't bother committing anything.
-		 * (Note: other than the buffer, the surface state has nothing that risks dangling
-		 * if it neglects to commit, and there is no attached buffer.) */
+/*
+ * Retry an upstream commit that was held back until a synchronized
+ * subsurface had made its own, and likewise for that surface's parent.
+ */
+static void resume_held_parent(struct forward_surface *parent) {
+	while (parent && parent->shadow_deferred) {
+		parent->shadow_deferred = false;
+		if (parent->inert || !has_upstream(parent)) {
+			return;
+		}
+		present_upstream(parent);
+		if (parent->shadow_deferred || !parent->subsurface ||
+				!parent->subsurface->sync) {
+			return;
+		}
+		parent = parent->subsurface->parent;
+	}
+}
+
+static void shadow_buffer_handle_release(void *data, struct wl_buffer *wl_buffer) {
+	struct shadow_buffer *shadow = data;
+	shadow->busy = false;
+
+	struct forward_surface *surface = shadow->surface;
+	if (!surface->shadow_deferred) {
 		return;
 	}
-	if (surface->committed.attachment != NULL && surface->pending.attachment == NULL) {
-		/* Good wallpaper clients should never unmap their surfaces. Kill it. */
-		wl_resource_post_error(resource, 1000, "The wallpaper program should not unmap any layer shell surface");
+	surface->shadow_deferred = false;
+	if (surface->inert || !has_upstream(surface)) {
 		return;
 	}
+	present_upstream(surface);
+	if (!surface->shadow_deferred && surface->subsurface &&
+			surface->subsurface->sync) {
+		resume_held_parent(surface->subsurface->parent);
+	}
+}
 
-	// todo: every buffer needs surface backreferences for auto-cleanup
-	// issue: figuring out details of this auto-cleanup
-	// (one approach: use a forward_buffer object holding the upstream,
-	// with a linked list of downstream users -- the plugin's wl_buffer
-	// itself, but also all surfaces linked via commits. Only delete upstream
-	// wl_buffer when all references are dead.)
+static const struct wl_buffer_listener shadow_buffer_listener = {
+	.release = shadow_buffer_handle_release,
+};
 
-	// integrate details, and commit/send updated data only, here
+static void finish_shadow_buffer(struct shadow_buffer *shadow) {
+	if (shadow->buffer) {
+		wl_buffer_destroy(shadow->buffer);
+	}
+	if (shadow->data) {
+		munmap(shadow->data, shadow->size);
+	}
+	shadow->buffer = NULL;
+	shadow->data = NULL;
+	shadow->size = 0;
+	shadow->width = shadow->height = shadow->stride = 0;
+	shadow->busy = false;
+	region_clear(&shadow->stale);
+}
 
-	struct swaylock_surface *sw_surf = surface->sway_surface;
-	struct wl_surface *background = sw_surf->surface;
+/* (Re)create a shadow buffer with the same layout as the plugin buffer */
+static bool create_shadow_buffer(struct forward_surface *surface,
+		struct shadow_buffer *shadow, const struct forward_buffer *source) {
+	finish_shadow_buffer(shadow);
 
-	/* Apply changes */
-	if (surface->committed.buffer_scale != surface->pending.buffer_scale) {
-		wl_surface_set_buffer_scale(background, surface->pending.buffer_scale);
-		surface->committed.buffer_scale = surface->pending.buffer_scale;
+	size_t size = (size_t)source->stride * source->height;
+	int fd = anonymous_shm_open();
+	if (fd == -1) {
+		swaylock_log_errno(LOG_ERROR, "Failed to create shadow buffer");
+		return false;
 	}
-	if (surface->committed.buffer_transform != surface->pending.buffer_transform) {
-		wl_surface_set_buffer_transform(background, surface->pending.buffer_transform);
-		surface->committed.buffer_transform = surface->pending.buffer_transform;
+	if (ftruncate(fd, size) < 0) {
+		swaylock_log_errno(LOG_ERROR, "Failed to size shadow buffer");
+		close(fd);
+		return false;
 	}
-	if (surface->committed.viewport_dest_width != surface->pending.viewport_dest_width ||
-			surface->committed.viewport_dest_height != surface->pending.viewport_dest_height) {
-		assert(sw_surf->viewport);
-		wp_viewport_set_destination(sw_surf->viewport, surface->pending.viewport_dest_width,
-			surface->pending.viewport_dest_height);
-		surface->committed.viewport_dest_width = surface->pending.viewport_dest_width;
-		surface->committed.viewport_dest_height = surface->pending.viewport_dest_height;
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		swaylock_log_errno(LOG_ERROR, "Failed to map shadow buffer");
+		close(fd);
+		return false;
 	}
-	if (surface->committed.viewport_source_x != surface->pending.viewport_source_x ||
+	struct wl_shm_pool *pool = wl_shm_create_pool(surface->state->shm, fd, size);
+	shadow->buffer = wl_shm_pool_create_buffer(pool, 0, source->width,
+		source->height, source->stride, source->format);
+	wl_buffer_add_listener(shadow->buffer, &shadow_buffer_listener, shadow);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+	count_allocation(surface->state);
+
+	shadow->data = data;
+	shadow->size = size;
+	shadow->width = source->width;
+	shadow->height = source->height;
+	shadow->stride = source->stride;
+	shadow->format = source->format;
+	/* the new buffer has no contents yet */
+	add_damage(surface, &shadow->stale, 0, 0, shadow->width, shadow->height);
+	return true;
+}
+
+/*
+ * The plugin may shrink the file behind a mapped pool at any time, after
+ * which reading past its new end raises SIGBUS. As with libwayland's
+ * wl_shm_buffer_begin_access(), a fault inside the pool being copied from
+ * replaces the mapping with zero pages, so the copy can complete.
+ */
+static _Thread_local struct forward_shm_pool *shm_access_pool;
+static struct sigaction prev_sigbus_action;
+
+static void reraise_sigbus(void) {
+	sigaction(SIGBUS, &prev_sigbus_action, NULL);
+	raise(SIGBUS);
+}
+
+static void shm_sigbus_handler(int signum, siginfo_t *info, void *context) {
+	struct forward_shm_pool *pool = shm_access_pool;
+	char *addr = info->si_addr;
+	if (!pool || addr < (char *)pool->data || addr >= (char *)pool->data + pool->size) {
+		reraise_sigbus();
+		return;
+	}
+	pool->sigbus = true;
+	if (mmap(pool->data, pool->size, PROT_READ,
+			MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0) == MAP_FAILED) {
+		reraise_sigbus();
+	}
+}
+
+/* Only called from the thread dispatching the nested server */
+static void install_sigbus_handler(void) {
+	static bool installed = false;
+	if (installed) {
+		return;
+	}
+	struct sigaction sa = {0};
+	sa.sa_sigaction = shm_sigbus_handler;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGBUS, &sa, &prev_sigbus_action);
+	installed = true;
+}
+
+/* Copy the parts of the plugin buffer that the shadow buffer lacks; returns
+ * false if the plugin shrank the pool, leaving zeros in the copy */
+static bool copy_shadow_damage(struct shadow_buffer *shadow,
+		const struct forward_buffer *source) {
+	const uint8_t *src = (const uint8_t *)source->shm_pool->data + source->offset;
+	uint8_t *dst = shadow->data;
+	uint32_t bpp = shm_format_bpp(source->format);
+	shm_access_pool = source->shm_pool;
+	for (size_t i = 0; i < shadow->stale.len; i++) {
+		const struct region_rect *rect = &shadow->stale.rects[i];
+		int32_t x2 = rect->x + rect->width, y2 = rect->y + rect->height;
+		x2 = x2 < shadow->width ? x2 : shadow->width;
+		y2 = y2 < shadow->height ? y2 : shadow->height;
+		if (x2 <= rect->x || y2 <= rect->y) {
+			continue;
+		}
+		size_t start = (size_t)rect->x * bpp;
+		size_t len = (size_t)(x2 - rect->x) * bpp;
+		for (int32_t y = rect->y; y < y2; y++) {
+			size_t row = (size_t)y * shadow->stride;
+			memcpy(dst + row + start, src + row + start, len);
+		}
+	}
+	shm_access_pool = NULL;
+	region_clear(&shadow->stale);
+	return !source->shm_pool->sigbus;
+}
+
+/*
+ * Copy the committed plugin buffer into a free shadow buffer and attach it
+ * upstream, with the damage accumulated since the last upstream commit.
+ * Returns false if all shadow buffers are still held by the compositor; the
+ * upstream commit is then made when one is released.
+ */
+static bool shadow_present(struct forward_surface *surface) {
+	struct shadow_buffer *shadow = NULL;
+	for (size_t i = 0; i < SHADOW_BUFFER_COUNT; i++) {
+		if (!surface->shadow[i].busy) {
+			shadow = &surface->shadow[i];
+			break;
+		}
+	}
+	if (!shadow) {
+		surface->shadow_deferred = true;
+		return false;
+	}
+
+	struct forward_buffer *source = surface->committed.attachment;
+	if (source != BUFFER_UNREACHABLE) {
+		assert(source->shm_pool);
+		if (!shadow->buffer || shadow->width != (int32_t)source->width ||
+				shadow->height != (int32_t)source->height ||
+				shadow->stride != source->stride || shadow->format != source->format) {
+			create_shadow_buffer(surface, shadow, source);
+		}
+		if (shadow->buffer && !copy_shadow_damage(shadow, source) &&
+				source->resource) {
+			wl_resource_post_error(source->resource, WL_SHM_ERROR_INVALID_FD,
+				"error accessing SHM buffer");
+		}
+		/* Everything needed has been copied, so the plugin may reuse it */
+		if (source->resource) {
+			wl_buffer_send_release(source->resource);
+		}
+	}
+
+	if (shadow->buffer) {
+		struct upstream_objects up;
+		get_upstream(surface, &up);
+		struct wl_surface *background = up.surface;
+		wl_surface_attach(background, shadow->buffer, 0, 0);
+		shadow->busy = true;
+		surface->shown_shadow = shadow;
+		bool mirrored = has_mirrors(surface);
+		for (size_t i = 0; i < surface->buffer_damage.len; i++) {
+			const struct region_rect *rect = &surface->buffer_damage.rects[i];
+			wl_surface_damage_buffer(background, rect->x, rect->y,
+				rect->width, rect->height);
+			if (mirrored) {
+				add_damage(surface, &surface->mirror_damage, rect->x, rect->y,
+					rect->width, rect->height);
+			}
+		}
+	}
+	region_clear(&surface->buffer_damage);
+	surface->shadow_dirty = false;
+	return true;
+}
+
+/*
+ * The cached state of synchronized subsurfaces is applied with the parent's
+ * upstream commit, so their own held back commits must be made first.
+ * Returns false if one is still waiting for a free shadow buffer.
+ */
+static bool flush_sync_subsurfaces(struct forward_surface *surface) {
+	bool ready = true;
+	struct forward_subsurface *sub;
+	wl_list_for_each(sub, &surface->subsurfaces, link) {
+		if (!sub->sync) {
+			continue;
+		}
+		struct forward_surface *child = sub->surface;
+		if (child->deferred_commit_timer || child->mailbox_deferred) {
+			flush_deferred_commit(child);
+		}
+		if (child->shadow_deferred && !child->inert) {
+			ready = false;
+		}
+	}
+	return ready;
+}
+
+/* Copy to a shadow buffer if needed, and commit the upstream surface */
+static void present_upstream(struct forward_surface *surface) {
+	if (!flush_sync_subsurfaces(surface)) {
+		/* made once the subsurface's shadow buffer is released */
+		surface->shadow_deferred = true;
+		return;
+	}
+	if (surface->shadow_active && surface->shadow_dirty && !shadow_present(surface)) {
+		/* The compositor still holds every shadow buffer; the latest plugin
+		 * contents will be copied and committed when one is released. */
+		return;
+	}
+	finish_upstream_commit(surface);
+}
+
+/*
+ * With --max-fps, how long to wait before making the upstream commit for a
+ * plugin commit. Plugins that use frame callbacks are paced by those instead,
+ * and commits acknowledging a configure are never held back.
+ */
+static int64_t commit_delay_ms(struct forward_surface *surface) {
+	int interval = frame_interval_ms(surface);
+	if (interval <= 0 || !wl_list_empty(&surface->frame_callbacks) ||
+			surface->sway_surface->has_pending_ack_conf) {
+		return 0;
+	}
+	return surface->last_upstream_commit_ms + interval - monotonic_ms();
+}
+
+/*
+ * With --mailbox, upstream commits wait until the compositor has shown the
+ * previous one, as signalled by its frame callback; plugin commits made in
+ * the meantime are merged. Commits acknowledging a configure are never held.
+ */
+static bool mailbox_holds_commit(struct forward_surface *surface) {
+	/* synchronized subsurfaces are shown with, and paced by, their parent */
+	if (surface->subsurface && surface->subsurface->sync) {
+		return false;
+	}
+	return surface->state->mailbox && surface->upstream_frame &&
+		!(surface->sway_surface && surface->sway_surface->has_pending_ack_conf);
+}
+
+static void deferred_commit_handle_expiry(void *data) {
+	struct forward_surface *surface = data;
+	surface->deferred_commit_timer = NULL;
+	if (mailbox_holds_commit(surface)) {
+		surface->mailbox_deferred = true;
+		return;
+	}
+	if (surface->inert || !has_upstream(surface) || surface->shadow_deferred) {
+		return;
+	}
+	present_upstream(surface);
+}
+
+/* Make an upstream commit held back by --max-fps or --mailbox right away */
+static void flush_deferred_commit(struct forward_surface *surface) {
+	if (surface->deferred_commit_timer) {
+		loop_remove_timer(surface->state->eventloop, surface->deferred_commit_timer);
+		surface->deferred_commit_timer = NULL;
+	}
+	surface->mailbox_deferred = false;
+	if (surface->inert || !has_upstream(surface) || surface->shadow_deferred) {
+		return;
+	}
+	present_upstream(surface);
+}
+
+/* Compute the size of the surface from its committed state; returns false if
+ * a protocol error was posted */
+static bool committed_surface_size(struct forward_surface *surface,
+		struct wl_resource *resource, uint32_t *width, uint32_t *height) {
+	wl_fixed_t n = wl_fixed_from_int(-1);
+	bool viewport_dst_on = surface->committed.viewport_dest_width != -1;
+	bool viewport_src_on = surface->committed.viewport_source_w != n;
+	if (viewport_dst_on) {
+		*width = surface->committed.viewport_dest_width;
+		*height = surface->committed.viewport_dest_height;
+	} else if (viewport_src_on) {
+		*width = wl_fixed_to_int(surface->committed.viewport_source_w);
+		*height = wl_fixed_to_int(surface->committed.viewport_source_h);
+		if (wl_fixed_from_int(*width) != surface->committed.viewport_source_w ||
+			wl_fixed_from_int(*height) != surface->committed.viewport_source_h) {
+			wl_resource_post_error(surface->viewport, WP_VIEWPORT_ERROR_BAD_SIZE, "width/height not integral");
+			return false;
+		}
+		// TODO: technically, should also validate that the viewport dimensions fall inside the
+		// (transformed) buffer bounding box
+	} else {
+		if (surface->committed_buffer_width % surface->committed.buffer_scale != 0 ||
+			surface->committed_buffer_height % surface->committed.buffer_scale != 0) {
+			wl_resource_post_error(resource, WL_SURFACE_ERROR_INVALID_SIZE, "buffer dimensions not divisible by scale");
+			return false;
+		}
+		*width = surface->committed_buffer_width / surface->committed.buffer_scale;
+		*height = surface->committed_buffer_height / surface->committed.buffer_scale;
+		if (does_transform_transpose_size(surface->committed.buffer_transform)) {
+			uint32_t tmp = *width;
+			*width = *height;
+			*height = tmp;
+		}
+	}
+	return true;
+}
+
+static void nested_surface_commit(struct wl_client *client,
+		struct wl_resource *resource) {
+	assert(wl_resource_instance_of(resource, &wl_surface_interface, &surface_impl));
+	struct forward_surface *surface = wl_resource_get_user_data(resource);
+	bool buffer_attached = surface->buffer_attached &&
+		surface->pending.attachment != BUFFER_COMMITTED;
+	surface->buffer_attached = false;
+	if (!check_sync_points(surface, buffer_attached)) {
+		return;
+	}
+	queue_presentation_feedback(surface);
+	merge_commit_timing(surface);
+	if (surface->inert) {
+		return;
+	}
+
+	if (!has_upstream(surface)) {
+		/* Clients can create and commit to any number of wl_surfaces; however,
+		 * these have no impact until the surface is given a role. Ignore these
+		 * commits. */
+		return;
+	}
+
+	if (!surface->subsurface && !surface->has_been_configured) {
+		if (surface->pending.attachment) {
+			/* e.g., a toplevel was recreated, and a buffer attached
+			 * without waiting for the new configure */
+			wl_resource_post_error(resource, 1000, "The wallpaper program attached a buffer before the first configure");
+			return;
+		}
+		/* send initial configure */
+		struct swaylock_bg_client *bg_client = surface->sway_surface->client ?
+			surface->sway_surface->client : surface->sway_surface->state->server.main_client;
+		uint32_t plugin_serial = bg_client->serial++;
+
+		uint32_t config_width = surface->sway_surface->width, config_height = surface->sway_surface->height;
+		if (config_width == 0 || config_height == 0) {
+			swaylock_log(LOG_ERROR, "committing nested surface before main surface dimensions known");
+		}
+
+		// When committing a plugin surface for the first time,
+		// if the upstream surface is also new, then forward the configure;
+		// but if the upsteam surface was configured long ago, then
+		// keep the configure local
+		if (!surface->sway_surface->used_first_configure) {
+			add_serial_pair(surface, surface->sway_surface->first_configure_serial, plugin_serial,
+				config_width, config_height, false);
+			surface->sway_surface->used_first_configure = true;
+		} else if (surface->sway_surface->has_newer_serial) {
+			/* In this case, the swaylock surface has received
+			 * unacknowledged configures that the previous client
+			 * for the surface did not acknowledge. Since we are
+			 * giving this client an up to date size, acknowledge
+			 * the corresponding configure when the client finally
+			 * responds. */
+			add_serial_pair(surface, surface->sway_surface->newest_serial, plugin_serial,
+				config_width, config_height, false);
+		} else {
+			/* Swallow plugin's configure event -- all upstream configures
+			 * were acknowledged by past clients */
+			add_serial_pair(surface, 0, plugin_serial, config_width, config_height, true);
+		}
+		send_plugin_configure(surface, plugin_serial, config_width, config_height);
+
+		surface->has_been_configured = true;
+
+		/* The first commit should not be forwarded, because the main swaylock
+		 * process already made such a commit in order to receive its
+		 * own configure event. Thus, return here. */
+		return;
+	}
+
+	if (surface->committed.attachment == NULL && surface->pending.attachment == NULL) {
+		/* In this scenario, no buffer has been attached yet; there is no point in making
+		 * a second or further commit without a buffer, so don't bother committing anything.
+		 * (Note: other than the buffer, the surface state has nothing that risks dangling
+		 * if it neglects to commit, and there is no attached buffer.) */
+		return;
+	}
+	if (surface->committed.attachment != NULL && surface->pending.attachment == NULL &&
+			!surface->subsurface) {
+		/* Good wallpaper clients should never unmap their surfaces. Kill it. */
+		wl_resource_post_error(resource, 1000, "The wallpaper program should not unmap any layer shell surface");
+		return;
+	}
+
+	// todo: every buffer needs surface backreferences for auto-cleanup
+	// issue: figuring out details of this auto-cleanup
+	// (one approach: use a forward_buffer object holding the upstream,
+	// with a linked list of downstream users -- the plugin's wl_buffer
+	// itself, but also all surfaces linked via commits. Only delete upstream
+	// wl_buffer when all references are dead.)
+
+	// integrate details, and commit/send updated data only, here
+
+	/* null for subsurfaces */
+	struct swaylock_surface *sw_surf = surface->sway_surface;
+	struct upstream_objects up;
+	get_upstream(surface, &up);
+	struct wl_surface *background = up.surface;
+
+	/* Apply changes */
+	if (surface->opaque_changed) {
+		/* pending_opaque is refilled by the next set_opaque_region before
+		 * being read again, so the storage can be swapped */
+		struct region_ops committed = surface->committed_opaque;
+		surface->committed_opaque = surface->pending_opaque;
+		surface->pending_opaque = committed;
+		set_upstream_opaque_region(surface, background);
+		surface->opaque_changed = false;
+		surface->mirror_state_changed = true;
+	}
+	if (surface->committed.buffer_scale != surface->pending.buffer_scale) {
+		wl_surface_set_buffer_scale(background, surface->pending.buffer_scale);
+		surface->committed.buffer_scale = surface->pending.buffer_scale;
+		surface->mirror_state_changed = true;
+	}
+	if (surface->committed.buffer_transform != surface->pending.buffer_transform) {
+		wl_surface_set_buffer_transform(background, surface->pending.buffer_transform);
+		surface->committed.buffer_transform = surface->pending.buffer_transform;
+		surface->mirror_state_changed = true;
+	}
+	if (surface->committed.viewport_dest_width != surface->pending.viewport_dest_width ||
+			surface->committed.viewport_dest_height != surface->pending.viewport_dest_height) {
+		assert(*up.viewport);
+		wp_viewport_set_destination(*up.viewport, surface->pending.viewport_dest_width,
+			surface->pending.viewport_dest_height);
+		surface->committed.viewport_dest_width = surface->pending.viewport_dest_width;
+		surface->committed.viewport_dest_height = surface->pending.viewport_dest_height;
+		surface->mirror_state_changed = true;
+	}
+	if (surface->committed.viewport_source_x != surface->pending.viewport_source_x ||
 			surface->committed.viewport_source_y != surface->pending.viewport_source_y ||
 			surface->committed.viewport_source_w != surface->pending.viewport_source_w ||
 			surface->committed.viewport_source_h != surface->pending.viewport_source_h) {
-		assert(sw_surf->viewport);
-		wp_viewport_set_source(sw_surf->viewport,
+		assert(*up.viewport);
+		wp_viewport_set_source(*up.viewport,
 			surface->committed.viewport_source_x, surface->committed.viewport_source_y,
 			surface->committed.viewport_source_w, surface->committed.viewport_source_h);
 		surface->committed.viewport_source_x = surface->pending.viewport_source_x;
 		surface->committed.viewport_source_y = surface->pending.viewport_source_y;
 		surface->committed.viewport_source_w = surface->pending.viewport_source_w;
 		surface->committed.viewport_source_h = surface->pending.viewport_source_h;
+		surface->mirror_state_changed = true;
 	}
 
 	if (surface->committed.has_alpha_mode != surface->pending.has_alpha_mode ||
@@ -298,24 +1366,25 @@ static void nested_surface_commit(struct wl_client *client,
 			surface->committed.has_coef_range != surface->pending.has_coef_range ||
 			surface->committed.coefficients != surface->pending.coefficients ||
 			surface->committed.range != surface->pending.range) {
-		assert(sw_surf->color_rep_surface);
 		// There is no way to reset color representation parameters to default
 		// other than unsetting and recreating the surface. To simplify the logic,
 		// recreate the color rep surface on every change.
-		wp_color_representation_surface_v1_destroy(sw_surf->color_rep_surface);
-		sw_surf->color_rep_surface = wp_color_representation_manager_v1_get_surface(
-			sw_surf->state->forward.color_representation, sw_surf->surface);
+		if (*up.color_rep_surface) {
+			wp_color_representation_surface_v1_destroy(*up.color_rep_surface);
+		}
+		*up.color_rep_surface = wp_color_representation_manager_v1_get_surface(
+			surface->state->color_representation, background);
 		if (surface->pending.has_alpha_mode) {
 			wp_color_representation_surface_v1_set_alpha_mode(
-				sw_surf->color_rep_surface, surface->pending.alpha_mode);
+				*up.color_rep_surface, surface->pending.alpha_mode);
 		}
 		if (surface->pending.has_chroma_location) {
 			wp_color_representation_surface_v1_set_chroma_location(
-				sw_surf->color_rep_surface, surface->pending.chroma_location);
+				*up.color_rep_surface, surface->pending.chroma_location);
 		}
 		if (surface->pending.has_coef_range) {
 			wp_color_representation_surface_v1_set_coefficients_and_range(
-				sw_surf->color_rep_surface, surface->pending.coefficients,
+				*up.color_rep_surface, surface->pending.coefficients,
 				surface->pending.range);
 		}
 		surface->committed.has_alpha_mode = surface->pending.has_alpha_mode;
@@ -325,17 +1394,21 @@ static void nested_surface_commit(struct wl_client *client,
 		surface->committed.has_coef_range = surface->pending.has_coef_range;
 		surface->committed.coefficients = surface->pending.coefficients;
 		surface->committed.range = surface->pending.range;
+		surface->mirror_state_changed = true;
 	}
 
 	if (surface->committed.image_desc != surface->pending.image_desc ||
 		surface->committed.render_intent != surface->pending.render_intent) {
-		assert(sw_surf->color_surface);
+		if (!*up.color_surface) {
+			*up.color_surface = wp_color_manager_v1_get_surface(
+				surface->state->color_management, background);
+		}
 		if (!surface->pending.image_desc) {
 			wp_color_management_surface_v1_unset_image_description(
-				sw_surf->color_surface);
+				*up.color_surface);
 		} else {
 			wp_color_management_surface_v1_set_image_description(
-				sw_surf->color_surface, surface->pending.image_desc->description,
+				*up.color_surface, surface->pending.image_desc->description,
 				surface->pending.render_intent);
 		}
 		if (surface->committed.image_desc != surface->pending.image_desc) {
@@ -353,71 +1426,84 @@ static void nested_surface_commit(struct wl_client *client,
 			}
 		}
 		surface->committed.render_intent = surface->pending.render_intent;
+		surface->mirror_state_changed = true;
 	}
 
 	// The protocol does not make this fully explicit, but the buffer should
 	// be attached _each time_ that any damage is sent alongside it, even if
 	// the buffer is the same. This is also necessary to ensure that the
 	// appropriate release events are sent
-	if (surface->pending.attachment != BUFFER_COMMITTED) {
+	// With explicit synchronization, each upstream attach needs new sync
+	// points, so only attach when the plugin did (or unmapped a subsurface).
+	if (surface->pending.attachment != BUFFER_COMMITTED &&
+			(buffer_attached || !*up.syncobj_surface || !surface->pending.attachment)) {
 		/* unlink the committed attachment */
 		if (surface->committed.attachment != NULL && surface->committed.attachment != BUFFER_UNREACHABLE) {
 			assert(surface->committed.attachment->resource != NULL);
+			struct syncobj_point *release = &surface->committed.attachment->release;
+			if (surface->release_point_unsent && release->timeline) {
+				/* The deferred commit this one is merged into had its
+				 * points replaced upstream; the compositor will never
+				 * signal its release point */
+				signal_sync_point(release);
+				clear_sync_point(release);
+			}
 			wl_list_remove(&surface->committed.attachment_link);
+			struct forward_buffer *replaced = surface->committed.attachment;
+			if (replaced != surface->pending.attachment &&
+					(replaced->shm_pool ? surface->shadow_dirty :
+					(surface->deferred_commit_timer != NULL || surface->mailbox_deferred ||
+					surface->shadow_deferred))) {
+				/* Replaced before it was copied, or attached upstream
+				 * but never committed; it will not be read */
+				wl_buffer_send_release(replaced->resource);
+			}
 		}
 
-		/* See above: null attachments are either bad wallpaper program behavior or need no commit */
-		assert(surface->pending.attachment != NULL);
+		/* See above: null attachments are either bad wallpaper program behavior,
+		 * need no commit, or unmap a subsurface */
+		if (surface->pending.attachment == NULL) {
+			wl_surface_attach(background, NULL, 0, 0);
+			surface->committed.attachment = NULL;
+			surface->shadow_active = false;
+			surface->shadow_dirty = false;
+			surface->shadow_deferred = false;
+		} else {
+			struct forward_buffer *upstream_buffer = surface->pending.attachment;
+			/* an upstream surface of version 5 or later takes offsets
+			 * through wl_surface::offset, even from older plugins */
+			int32_t offset_x = 0, offset_y = 0;
+			if (wl_surface_get_version(background) < WL_SURFACE_OFFSET_SINCE_VERSION) {
+				offset_x = surface->pending.offset_x;
+				offset_y = surface->pending.offset_y;
+			}
+			if (upstream_buffer->shm_pool) {
+				/* attached upstream by shadow_present() */
+				surface->shadow_active = true;
+				surface->shadow_dirty = true;
+			} else {
+				wl_surface_attach(background, upstream_buffer->buffer,
+					offset_x, offset_y);
+				forward_sync_points(surface);
+				surface->shadow_active = false;
+				surface->shadow_dirty = false;
+				surface->shadow_deferred = false;
+			}
+			surface->committed.attachment = surface->pending.attachment;
 
-		struct forward_buffer *upstream_buffer = surface->pending.attachment;
-		int32_t offset_x =  wl_resource_get_version(resource) >= 5 ? 0 : surface->pending.offset_x;
-		int32_t offset_y =  wl_resource_get_version(resource) >= 5 ? 0 : surface->pending.offset_y;
-		wl_surface_attach(background,
-			upstream_buffer ? upstream_buffer->buffer : NULL,
-			offset_x, offset_y);
-		if (wl_resource_get_version(resource) < 5) {
-			surface->committed.offset_x = surface->pending.offset_x;
-			surface->committed.offset_y = surface->pending.offset_y;
+			surface->committed_buffer_width = upstream_buffer->width;
+			surface->committed_buffer_height = upstream_buffer->height;
+			wl_list_insert(&upstream_buffer->committed_surfaces, &surface->committed.attachment_link);
 		}
-		surface->committed.attachment = surface->pending.attachment;
-
-		surface->committed_buffer_width = upstream_buffer->width;
-		surface->committed_buffer_height = upstream_buffer->height;
-		wl_list_insert(&upstream_buffer->committed_surfaces, &surface->committed.attachment_link);
 	}
 
-	wl_fixed_t n = wl_fixed_from_int(-1);
-	bool viewport_dst_on = surface->committed.viewport_dest_width != -1;
-	bool viewport_src_on = surface->committed.viewport_source_w != n;
-	uint32_t output_width, output_height;
-	if (viewport_dst_on) {
-		output_width = surface->committed.viewport_dest_width;
-		output_height = surface->committed.viewport_dest_height;
-	} else if (viewport_src_on) {
-		output_width = wl_fixed_to_int(surface->committed.viewport_source_w);
-		output_height = wl_fixed_to_int(surface->committed.viewport_source_h);
-		if (wl_fixed_from_int(output_width) != surface->committed.viewport_source_w ||
-			wl_fixed_from_int(output_height) != surface->committed.viewport_source_h) {
-			wl_resource_post_error(surface->viewport, WP_VIEWPORT_ERROR_BAD_SIZE, "width/height not integral");
-			return;
-		}
-		// TODO: technically, should also validate that the viewport dimensions fall inside the
-		// (transformed) buffer bounding box
-	} else {
-		if (surface->committed_buffer_width % surface->committed.buffer_scale != 0 ||
-			surface->committed_buffer_height % surface->committed.buffer_scale != 0) {
-			wl_resource_post_error(resource, WL_SURFACE_ERROR_INVALID_SIZE, "buffer dimensions not divisible by scale");
-			return;
-		}
-		output_width = surface->committed_buffer_width / surface->committed.buffer_scale;
-		output_height = surface->committed_buffer_height / surface->committed.buffer_scale;
-		if (does_transform_transpose_size(surface->committed.buffer_transform)) {
-			uint32_t tmp = output_width;
-			output_width = output_height;
-			output_height = tmp;
-		}
+	uint32_t output_width = 0, output_height = 0;
+	if (surface->committed.attachment &&
+			!committed_surface_size(surface, resource, &output_width, &output_height)) {
+		return;
 	}
-	if (output_width != surface->last_acked_width || output_height != surface->last_acked_height) {
+	if (!surface->subsurface && (output_width != surface->last_acked_width ||
+			output_height != surface->last_acked_height)) {
 		swaylock_log(LOG_ERROR, "Wallpaper program committed surface at size %d x %d, which does not exactly match last acknowledged W x H = %d x %d",
 			output_width, output_height, surface->last_acked_width, surface->last_acked_height);
 		wl_resource_post_error(resource, 1000, "The wallpaper program should exactly match the configure width/height");
@@ -426,80 +1512,277 @@ static void nested_surface_commit(struct wl_client *client,
 
 	// TODO: verify that on scale or attachment change, the resulting size exactly matches the output
 
-	/* If there was an offset change, but no buffer value change */
-	if ((surface->committed.offset_x != surface->pending.offset_x ||
-			surface->committed.offset_y != surface->pending.offset_y) && wl_resource_get_version(resource) >= 5) {
+	/* Offsets move the buffer relative to its current position, so each
+	 * one is forwarded once */
+	if ((surface->pending.offset_x != 0 || surface->pending.offset_y != 0) &&
+			wl_surface_get_version(background) >= WL_SURFACE_OFFSET_SINCE_VERSION) {
 		wl_surface_offset(background, surface->pending.offset_x, surface->pending.offset_y);
-		surface->committed.offset_x = surface->pending.offset_x;
-		surface->committed.offset_y = surface->pending.offset_y;
-	}
-
-	/* apply and clear damage */
-	for (size_t i = 0; i < surface->buffer_damage_len; i++) {
-		wl_surface_damage_buffer(background, surface->buffer_damage[i].x,
-			surface->buffer_damage[i].y,
-			surface->buffer_damage[i].w,
-			surface->buffer_damage[i].h);
-	}
-	for (size_t i = 0; i < surface->old_damage_len; i++) {
-		wl_surface_damage(background, surface->old_damage[i].x,
-			surface->old_damage[i].y,
-			surface->old_damage[i].w,
-			surface->old_damage[i].h);
-	}
-
-	free(surface->buffer_damage);
-	surface->buffer_damage = NULL;
-	surface->buffer_damage_len = 0;
-
-	free(surface->old_damage);
-	surface->old_damage = NULL;
-	surface->old_damage_len = 0;
-
-	/* Finally, commit updates to corresponding upstream background surface */
-	if (surface->committed.attachment) {
-		// permit subsurface drawing
-		surface->sway_surface->has_buffer = true;
 	}
-
-	if (!wl_list_empty(&surface->frame_callbacks)) {
-		/* plugin has requested frame callbacks, so make a request now */
-		struct wl_callback *callback = wl_surface_frame(background);
-		wl_callback_add_listener(callback, &bg_frame_listener, surface);
+	surface->pending.offset_x = 0;
+	surface->pending.offset_y = 0;
+
+	/* apply and clear damage; everything is sent as buffer damage */
+	for (size_t i = 0; i < surface->surface_damage.len; i++) {
+		struct region_rect rect = surface_to_buffer_damage(surface,
+			&surface->surface_damage.rects[i]);
+		add_damage(surface, &surface->buffer_damage, rect.x, rect.y,
+			rect.width, rect.height);
 	}
-
-	if (sw_surf->has_pending_ack_conf) {
-		/* Submit this right before the commit, to avoid race conditions
-		 * between injected commits from the swaylock rendering and
-		 * the gap between ack and commit from the plugin */
-		ext_session_lock_surface_v1_ack_configure(sw_surf->ext_session_lock_surface_v1, sw_surf->pending_upstream_serial);
-		sw_surf->has_pending_ack_conf = false;
-		if (sw_surf->pending_upstream_serial == sw_surf->newest_serial) {
-			sw_surf->has_newer_serial = false;
+	region_clear(&surface->surface_damage);
+	if (surface->shadow_active) {
+		/* kept until the next upstream commit, and recorded as missing
+		 * from every shadow buffer */
+		for (size_t i = 0; i < surface->buffer_damage.len; i++) {
+			const struct region_rect *rect = &surface->buffer_damage.rects[i];
+			for (size_t j = 0; j < SHADOW_BUFFER_COUNT; j++) {
+				add_damage(surface, &surface->shadow[j].stale, rect->x, rect->y,
+					rect->width, rect->height);
+			}
+			surface->shadow_dirty = true;
+		}
+	} else {
+		bool mirrored = has_mirrors(surface);
+		for (size_t i = 0; i < surface->buffer_damage.len; i++) {
+			const struct region_rect *rect = &surface->buffer_damage.rects[i];
+			wl_surface_damage_buffer(background, rect->x, rect->y,
+				rect->width, rect->height);
+			if (mirrored) {
+				add_damage(surface, &surface->mirror_damage, rect->x, rect->y,
+					rect->width, rect->height);
+			}
 		}
+		region_clear(&surface->buffer_damage);
 	}
 
-	if (sw_surf->client_submission_timer) {
+	if (sw_surf && sw_surf->client_submission_timer) {
 		/* Disarm timer, indicating that plugin have responded on time
 		 * for this output. */
 		loop_remove_timer(sw_surf->state->eventloop, sw_surf->client_submission_timer);
 		sw_surf->client_submission_timer = NULL;
 	}
 
-	wl_surface_commit(background);
+	struct forward_state *forward = surface->state;
+	if (++forward->commits_since_report >= FORWARD_ALLOC_REPORT_INTERVAL) {
+		/* Once all surfaces are mapped, this should stay at zero */
+		swaylock_log(LOG_DEBUG, "Forwarding: %llu allocations in the last %u commits",
+			(unsigned long long)forward->allocations, forward->commits_since_report);
+		forward->allocations = 0;
+		forward->commits_since_report = 0;
+	}
+
+	if (surface->shadow_deferred) {
+		/* an upstream commit will be made once a shadow buffer is free */
+		return;
+	}
+	if (mailbox_holds_commit(surface)) {
+		/* Later plugin commits before the frame callback arrives are
+		 * merged into the same upstream commit */
+		surface->mailbox_deferred = true;
+		return;
+	}
+	int64_t delay = commit_delay_ms(surface);
+	if (delay > 0) {
+		/* Later plugin commits before the timer fires are merged into
+		 * the same upstream commit */
+		if (!surface->deferred_commit_timer) {
+			int interval = frame_interval_ms(surface);
+			surface->deferred_commit_timer = loop_add_timer_slack(forward->eventloop,
+				(int)delay, interval / FRAME_PACING_SLACK_DIVISOR,
+				deferred_commit_handle_expiry, surface);
+		}
+		if (surface->deferred_commit_timer) {
+			return;
+		}
+	} else if (surface->deferred_commit_timer) {
+		loop_remove_timer(forward->eventloop, surface->deferred_commit_timer);
+		surface->deferred_commit_timer = NULL;
+	}
+	present_upstream(surface);
 }
 
-static void nested_surface_set_buffer_transform(struct wl_client *client,
-		struct wl_resource *resource, int32_t transform) {
-	assert(wl_resource_instance_of(resource, &wl_surface_interface, &surface_impl));
-	struct forward_surface *surface = wl_resource_get_user_data(resource);
-	surface->pending.buffer_transform = transform;
-	// TODO: validate that the transform is valid;
+/* The upstream buffer holding the committed plugin contents, if any */
+static struct wl_buffer *shown_upstream_buffer(struct forward_surface *surface) {
+	if (surface->shadow_active) {
+		return surface->shown_shadow ? surface->shown_shadow->buffer : NULL;
+	}
+	if (surface->committed.attachment == NULL ||
+			surface->committed.attachment == BUFFER_UNREACHABLE) {
+		return NULL;
+	}
+	return surface->committed.attachment->buffer;
 }
-static void nested_surface_set_buffer_scale(struct wl_client *client,
-		struct wl_resource *resource, int32_t scale) {
-	assert(wl_resource_instance_of(resource, &wl_surface_interface, &surface_impl));
-	struct forward_surface *surface = wl_resource_get_user_data(resource);
+
+/* Give a mirroring output the committed state of the plugin surface */
+static void apply_mirror_state(struct forward_surface *surface,
+		struct swaylock_surface *mirror) {
+	struct wl_surface *background = mirror->surface;
+	set_upstream_opaque_region(surface, background);
+	wl_surface_set_buffer_scale(background, surface->committed.buffer_scale);
+	wl_surface_set_buffer_transform(background, surface->committed.buffer_transform);
+	if (mirror->viewport) {
+		wp_viewport_set_source(mirror->viewport,
+			surface->committed.viewport_source_x, surface->committed.viewport_source_y,
+			surface->committed.viewport_source_w, surface->committed.viewport_source_h);
+		wp_viewport_set_destination(mirror->viewport, surface->committed.viewport_dest_width,
+			surface->committed.viewport_dest_height);
+	}
+
+	/* As for the plugin surface, recreate the color representation
+	 * surface to reset its parameters */
+	if (mirror->color_rep_surface) {
+		wp_color_representation_surface_v1_destroy(mirror->color_rep_surface);
+		mirror->color_rep_surface = NULL;
+	}
+	if (surface->committed.has_alpha_mode || surface->committed.has_chroma_location ||
+			surface->committed.has_coef_range) {
+		mirror->color_rep_surface = wp_color_representation_manager_v1_get_surface(
+			surface->state->color_representation, background);
+		if (surface->committed.has_alpha_mode) {
+			wp_color_representation_surface_v1_set_alpha_mode(
+				mirror->color_rep_surface, surface->committed.alpha_mode);
+		}
+		if (surface->committed.has_chroma_location) {
+			wp_color_representation_surface_v1_set_chroma_location(
+				mirror->color_rep_surface, surface->committed.chroma_location);
+		}
+		if (surface->committed.has_coef_range) {
+			wp_color_representation_surface_v1_set_coefficients_and_range(
+				mirror->color_rep_surface, surface->committed.coefficients,
+				surface->committed.range);
+		}
+	}
+
+	if (surface->committed.image_desc) {
+		if (!mirror->color_surface) {
+			mirror->color_surface = wp_color_manager_v1_get_surface(
+				surface->state->color_management, background);
+		}
+		wp_color_management_surface_v1_set_image_description(mirror->color_surface,
+			surface->committed.image_desc->description, surface->committed.render_intent);
+	} else if (mirror->color_surface) {
+		wp_color_management_surface_v1_unset_image_description(mirror->color_surface);
+	}
+}
+
+/* Attach the upstream buffer of the plugin surface to a mirroring output,
+ * with the damage of the last upstream commit, and commit it */
+static void present_mirror(struct forward_surface *surface,
+		struct swaylock_surface *mirror) {
+	struct wl_buffer *buffer = shown_upstream_buffer(surface);
+	if (!buffer || mirror->width != surface->last_acked_width ||
+			mirror->height != surface->last_acked_height) {
+		/* Nothing to show yet, or the outputs no longer match, and the
+		 * mirror is about to be offered as an output of its own */
+		return;
+	}
+	if (mirror->mirror_stale || surface->mirror_state_changed) {
+		apply_mirror_state(surface, mirror);
+	}
+	wl_surface_attach(mirror->surface, buffer, 0, 0);
+	if (mirror->mirror_stale) {
+		wl_surface_damage_buffer(mirror->surface, 0, 0, INT32_MAX, INT32_MAX);
+		mirror->mirror_stale = false;
+	} else {
+		for (size_t i = 0; i < surface->mirror_damage.len; i++) {
+			const struct region_rect *rect = &surface->mirror_damage.rects[i];
+			wl_surface_damage_buffer(mirror->surface, rect->x, rect->y,
+				rect->width, rect->height);
+		}
+	}
+	if (mirror->has_newer_serial) {
+		/* The mirror has the size of the plugin's last configure */
+		ext_session_lock_surface_v1_ack_configure(mirror->ext_session_lock_surface_v1,
+			mirror->newest_serial);
+		mirror->has_newer_serial = false;
+	}
+	if (mirror->client_submission_timer) {
+		loop_remove_timer(mirror->state->eventloop, mirror->client_submission_timer);
+		mirror->client_submission_timer = NULL;
+	}
+	mirror->has_buffer = true;
+	wl_surface_commit(mirror->surface);
+}
+
+/* --mirror: repeat the upstream commit just made on the mirroring outputs.
+ * The compositor releases the shared upstream buffer once no surface uses
+ * it, so the plugin's buffer is only released after all of them are done. */
+static void commit_mirrors(struct forward_surface *surface) {
+	struct swaylock_surface *mirror;
+	wl_list_for_each(mirror, &surface->sway_surface->mirrors, mirror_link) {
+		present_mirror(surface, mirror);
+	}
+	region_clear(&surface->mirror_damage);
+	surface->mirror_state_changed = false;
+}
+
+void refresh_mirror(struct swaylock_surface *mirror) {
+	mirror->mirror_stale = true;
+	struct forward_surface *surface = mirror->mirror_of->plugin_surface;
+	if (!surface || surface->inert || surface->deferred_commit_timer ||
+			surface->mailbox_deferred || surface->shadow_deferred) {
+		/* An upstream commit which is held back attaches a buffer the
+		 * plugin may get back before it is committed; the mirror is
+		 * instead shown when that commit is made */
+		return;
+	}
+	present_mirror(surface, mirror);
+}
+
+/* Finally, commit updates to corresponding upstream background surface */
+static void finish_upstream_commit(struct forward_surface *surface) {
+	/* null for subsurfaces */
+	struct swaylock_surface *sw_surf = surface->sway_surface;
+	struct upstream_objects up;
+	get_upstream(surface, &up);
+	struct wl_surface *background = up.surface;
+
+	if (sw_surf && surface->committed.attachment) {
+		// permit subsurface drawing
+		sw_surf->has_buffer = true;
+	}
+
+	if (!surface->upstream_frame && (!wl_list_empty(&surface->frame_callbacks) ||
+			surface->state->mailbox)) {
+		/* plugin has requested frame callbacks (or --mailbox needs to
+		 * know when this commit is shown), so make a request now; while
+		 * one is outstanding, its arrival releases the newer callbacks */
+		surface->upstream_frame = wl_surface_frame(background);
+		wl_callback_add_listener(surface->upstream_frame, &bg_frame_listener, surface);
+	}
+
+	forward_commit_timing(surface);
+
+	if (sw_surf && sw_surf->has_pending_ack_conf) {
+		/* Submit this right before the commit, to avoid race conditions
+		 * between injected commits from the swaylock rendering and
+		 * the gap between ack and commit from the plugin */
+		ext_session_lock_surface_v1_ack_configure(sw_surf->ext_session_lock_surface_v1, sw_surf->pending_upstream_serial);
+		sw_surf->has_pending_ack_conf = false;
+		if (sw_surf->pending_upstream_serial == sw_surf->newest_serial) {
+			sw_surf->has_newer_serial = false;
+		}
+	}
+
+	forward_queued_feedback(surface);
+	wl_surface_commit(background);
+	if (sw_surf) {
+		commit_mirrors(surface);
+	}
+	surface->release_point_unsent = false;
+	surface->last_upstream_commit_ms = monotonic_ms();
+}
+
+static void nested_surface_set_buffer_transform(struct wl_client *client,
+		struct wl_resource *resource, int32_t transform) {
+	assert(wl_resource_instance_of(resource, &wl_surface_interface, &surface_impl));
+	struct forward_surface *surface = wl_resource_get_user_data(resource);
+	surface->pending.buffer_transform = transform;
+	// TODO: validate that the transform is valid;
+}
+static void nested_surface_set_buffer_scale(struct wl_client *client,
+		struct wl_resource *resource, int32_t scale) {
+	assert(wl_resource_instance_of(resource, &wl_surface_interface, &surface_impl));
+	struct forward_surface *surface = wl_resource_get_user_data(resource);
 	surface->pending.buffer_scale = scale;
 }
 static void nested_surface_damage_buffer(struct wl_client *client,
@@ -508,15 +1791,15 @@ static void nested_surface_damage_buffer(struct wl_client *client,
 	assert(wl_resource_instance_of(resource, &wl_surface_interface, &surface_impl));
 	struct forward_surface *surface = wl_resource_get_user_data(resource);
 
-	struct damage_record *new_damage = realloc(surface->buffer_damage, sizeof(struct damage_record) * (surface->buffer_damage_len + 1));
-	if (new_damage) {
-		surface->buffer_damage = new_damage;
-		surface->buffer_damage[surface->buffer_damage_len].x = x;
-		surface->buffer_damage[surface->buffer_damage_len].y = y;
-		surface->buffer_damage[surface->buffer_damage_len].w = width;
-		surface->buffer_damage[surface->buffer_damage_len].h = height;
-		surface->buffer_damage_len++;
-	}
+	add_damage(surface, &surface->buffer_damage, x, y, width, height);
+}
+
+static void nested_surface_offset(struct wl_client *client,
+		struct wl_resource *resource, int32_t x, int32_t y) {
+	assert(wl_resource_instance_of(resource, &wl_surface_interface, &surface_impl));
+	struct forward_surface *surface = wl_resource_get_user_data(resource);
+	surface->pending.offset_x = x;
+	surface->pending.offset_y = y;
 }
 
 static const struct wl_surface_interface surface_impl = {
@@ -530,6 +1813,7 @@ static const struct wl_surface_interface surface_impl = {
 	.set_buffer_transform = nested_surface_set_buffer_transform,
 	.set_buffer_scale = nested_surface_set_buffer_scale,
 	.damage_buffer = nested_surface_damage_buffer,
+	.offset = nested_surface_offset,
 };
 
 static void surface_handle_resource_destroy(struct wl_resource *resource) {
@@ -539,6 +1823,42 @@ static void surface_handle_resource_destroy(struct wl_resource *resource) {
 		fwd_surface->sway_surface->plugin_surface = NULL;
 	}
 
+	if (fwd_surface->subsurface) {
+		destroy_forward_subsurface(fwd_surface->subsurface);
+	}
+	/* child subsurfaces keep their role, but are no longer shown */
+	struct forward_subsurface *child, *tmp_child;
+	wl_list_for_each_safe(child, tmp_child, &fwd_surface->subsurfaces, link) {
+		wl_list_remove(&child->link);
+		wl_list_init(&child->link);
+		child->parent = NULL;
+		if (child->upstream_subsurface) {
+			wl_subsurface_destroy(child->upstream_subsurface);
+			child->upstream_subsurface = NULL;
+		}
+	}
+	if (fwd_surface->xdg_surface) {
+		wl_resource_set_user_data(fwd_surface->xdg_surface, NULL);
+	}
+	if (fwd_surface->xdg_toplevel) {
+		wl_resource_set_user_data(fwd_surface->xdg_toplevel, NULL);
+	}
+
+	/* forget this surface in get_surface_feedback objects */
+	struct wl_resource *feedback;
+	wl_resource_for_each(feedback, &fwd_surface->state->default_feedback.instances) {
+		if (wl_resource_get_user_data(feedback) == fwd_surface) {
+			wl_resource_set_user_data(feedback, NULL);
+		}
+	}
+	if (fwd_surface->sway_surface && fwd_surface->sway_surface->dmabuf_feedback) {
+		wl_resource_for_each(feedback, &fwd_surface->sway_surface->dmabuf_surface_feedback.instances) {
+			if (wl_resource_get_user_data(feedback) == fwd_surface) {
+				wl_resource_set_user_data(feedback, NULL);
+			}
+		}
+	}
+
 	struct wl_resource *cb_resource, *tmp;
 	wl_resource_for_each_safe(cb_resource, tmp, &fwd_surface->frame_callbacks) {
 		// the callback resource, on destruction, will try to remove itself,
@@ -568,9 +1888,26 @@ static void surface_handle_resource_destroy(struct wl_resource *resource) {
 		delete_image_desc_if_unreferenced(fwd_surface->committed.image_desc);
 	}
 
-	free(fwd_surface->buffer_damage);
-	free(fwd_surface->old_damage);
-	free(fwd_surface->serial_table);
+	region_finish(&fwd_surface->buffer_damage);
+	region_finish(&fwd_surface->surface_damage);
+	region_finish(&fwd_surface->mirror_damage);
+	free(fwd_surface->pending_opaque.ops);
+	free(fwd_surface->committed_opaque.ops);
+	for (size_t i = 0; i < SHADOW_BUFFER_COUNT; i++) {
+		finish_shadow_buffer(&fwd_surface->shadow[i]);
+		region_finish(&fwd_surface->shadow[i].stale);
+	}
+	discard_presentation_feedback(&fwd_surface->pending_feedbacks);
+	discard_presentation_feedback(&fwd_surface->queued_feedbacks);
+	if (fwd_surface->upstream_frame) {
+		wl_callback_destroy(fwd_surface->upstream_frame);
+	}
+	if (fwd_surface->frame_timer) {
+		loop_remove_timer(fwd_surface->state->eventloop, fwd_surface->frame_timer);
+	}
+	if (fwd_surface->deferred_commit_timer) {
+		loop_remove_timer(fwd_surface->state->eventloop, fwd_surface->deferred_commit_timer);
+	}
 
 	if (fwd_surface->viewport) {
 		wl_resource_set_user_data(fwd_surface->viewport, NULL);
@@ -584,6 +1921,21 @@ static void surface_handle_resource_destroy(struct wl_resource *resource) {
 	if (fwd_surface->color_representation) {
 		wl_resource_set_user_data(fwd_surface->color_representation, NULL);
 	}
+	if (fwd_surface->fifo) {
+		wl_resource_set_user_data(fwd_surface->fifo, NULL);
+	}
+	if (fwd_surface->commit_timing) {
+		wl_resource_set_user_data(fwd_surface->commit_timing, NULL);
+	}
+	if (fwd_surface->syncobj_surface) {
+		wl_resource_set_user_data(fwd_surface->syncobj_surface, NULL);
+		if (fwd_surface->sway_surface && fwd_surface->sway_surface->syncobj_surface) {
+			wp_linux_drm_syncobj_surface_v1_destroy(fwd_surface->sway_surface->syncobj_surface);
+			fwd_surface->sway_surface->syncobj_surface = NULL;
+		}
+	}
+	clear_sync_point(&fwd_surface->pending_acquire);
+	clear_sync_point(&fwd_surface->pending_release);
 
 	free(fwd_surface);
 }
@@ -622,9 +1974,24 @@ static void compositor_create_surface(struct wl_client *client,
 		return;
 	}
 	fwd_surface->state = state;
+	fwd_surface->resource = surf_resource;
 	wl_list_init(&fwd_surface->frame_callbacks);
+	wl_list_init(&fwd_surface->subsurfaces);
+	wl_list_init(&fwd_surface->pending_feedbacks);
+	wl_list_init(&fwd_surface->queued_feedbacks);
+	region_init(&fwd_surface->buffer_damage);
+	region_init(&fwd_surface->surface_damage);
+	region_init(&fwd_surface->mirror_damage);
+	/* mirrors may still have the state of a previous plugin surface */
+	fwd_surface->mirror_state_changed = true;
+	for (size_t i = 0; i < SHADOW_BUFFER_COUNT; i++) {
+		fwd_surface->shadow[i].surface = fwd_surface;
+		region_init(&fwd_surface->shadow[i].stale);
+	}
 	default_surface_state(&fwd_surface->pending);
 	default_surface_state(&fwd_surface->committed);
+	/* replace the opaque region swaylock guessed for the upstream surface */
+	fwd_surface->opaque_changed = true;
 
 	wl_resource_set_implementation(surf_resource, &surface_impl,
 		fwd_surface, surface_handle_resource_destroy);
@@ -632,35 +1999,84 @@ static void compositor_create_surface(struct wl_client *client,
 	// do not listen for events, because the plugin has no input anyway
 }
 
-static void region_add(struct wl_client *client, struct wl_resource *resource,
+static void push_region_op(struct wl_client *client, struct wl_resource *resource,
+		bool subtract, int32_t x, int32_t y, int32_t width, int32_t height) {
+	assert(wl_resource_instance_of(resource, &wl_region_interface, &region_impl));
+	struct forward_region *region = wl_resource_get_user_data(resource);
+	if (width <= 0 || height <= 0) {
+		/* has no effect */
+		return;
+	}
+	if (!reserve_region_ops(region->forward, &region->ops, region->ops.len + 1)) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	region->ops.ops[region->ops.len++] = (struct region_op){
+		.subtract = subtract, .x = x, .y = y, .width = width, .height = height,
+	};
+}
+
+static void nested_region_add(struct wl_client *client, struct wl_resource *resource,
 		int32_t x, int32_t y, int32_t width, int32_t height) {
-	// do nothing, swaylock doesn't need to know about regions
+	push_region_op(client, resource, false, x, y, width, height);
 }
 
-static void region_subtract(struct wl_client *client, struct wl_resource *resource,
+static void nested_region_subtract(struct wl_client *client, struct wl_resource *resource,
 		int32_t x, int32_t y, int32_t width, int32_t height) {
-	// do nothing, swaylock doesn't need to know about regions
+	push_region_op(client, resource, true, x, y, width, height);
 }
 
-static void region_destroy(struct wl_client *client, struct wl_resource *resource) {
+static void nested_region_destroy(struct wl_client *client, struct wl_resource *resource) {
 	wl_resource_destroy(resource);
 }
 static const struct wl_region_interface region_impl = {
-	.destroy = region_destroy,
-	.add = region_add,
-	.subtract = region_subtract,
+	.destroy = nested_region_destroy,
+	.add = nested_region_add,
+	.subtract = nested_region_subtract,
 };
 
+static void region_handle_resource_destroy(struct wl_resource *resource) {
+	assert(wl_resource_instance_of(resource, &wl_region_interface, &region_impl));
+	struct forward_region *region = wl_resource_get_user_data(resource);
+	free(region->ops.ops);
+	free(region);
+}
+
+void send_preferred_buffer_state(struct forward_surface *surface) {
+	struct swaylock_surface *sw_surf = surface->sway_surface;
+	if (wl_resource_get_version(surface->resource) <
+			WL_SURFACE_PREFERRED_BUFFER_SCALE_SINCE_VERSION) {
+		return;
+	}
+	if (sw_surf->preferred_buffer_scale > 0) {
+		wl_surface_send_preferred_buffer_scale(surface->resource,
+			sw_surf->preferred_buffer_scale);
+	}
+	if (sw_surf->has_preferred_buffer_transform) {
+		wl_surface_send_preferred_buffer_transform(surface->resource,
+			sw_surf->preferred_buffer_transform);
+	}
+}
+
 static void compositor_create_region(struct wl_client *client,
 		struct wl_resource *resource, uint32_t id) {
-	/* for nested clients, regions are ignored entirely */
+	struct forward_state *forward = wl_resource_get_user_data(resource);
 	struct wl_resource *region_resource = wl_resource_create(client,
 		&wl_region_interface, wl_resource_get_version(resource), id);
 	if (region_resource == NULL) {
 		wl_client_post_no_memory(client);
 		return;
 	}
-	wl_resource_set_implementation(region_resource, &region_impl, NULL, NULL);
+	struct forward_region *region = calloc(1, sizeof(*region));
+	if (!region) {
+		wl_resource_destroy(region_resource);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	count_allocation(forward);
+	region->forward = forward;
+	wl_resource_set_implementation(region_resource, &region_impl, region,
+		region_handle_resource_destroy);
 }
 
 static const struct wl_compositor_interface compositor_impl = {
@@ -678,12 +2094,210 @@ void bind_wl_compositor(struct wl_client *client, void *data,
 	wl_resource_set_implementation(resource, &compositor_impl, data, NULL);
 }
 
+/* Make the upstream subsurface, if the parent has an upstream surface yet */
+static void link_upstream_subsurface(struct forward_subsurface *sub) {
+	struct upstream_objects parent_up;
+	if (sub->upstream_subsurface || !sub->parent ||
+			!get_upstream(sub->parent, &parent_up)) {
+		return;
+	}
+	sub->upstream_subsurface = wl_subcompositor_get_subsurface(
+		sub->surface->state->subcompositor, sub->upstream, parent_up.surface);
+	if (sub->parent->sway_surface) {
+		/* New subsurfaces are placed on top; the indicator must stay
+		 * above everything the plugin draws */
+		wl_subsurface_place_below(sub->upstream_subsurface,
+			sub->parent->sway_surface->child);
+	}
+	wl_subsurface_set_position(sub->upstream_subsurface, sub->x, sub->y);
+	if (!sub->sync) {
+		wl_subsurface_set_desync(sub->upstream_subsurface);
+	}
+}
+
+void create_upstream_subsurfaces(struct forward_surface *surface) {
+	struct forward_subsurface *sub;
+	wl_list_for_each(sub, &surface->subsurfaces, link) {
+		link_upstream_subsurface(sub);
+	}
+}
+
+static void subsurface_handle_resource_destroy(struct wl_resource *resource) {
+	struct forward_subsurface *sub = wl_resource_get_user_data(resource);
+	if (sub) {
+		struct forward_surface *parent = sub->sync ? sub->parent : NULL;
+		destroy_forward_subsurface(sub);
+		resume_held_parent(parent);
+	}
+}
+static void nested_subsurface_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+static void nested_subsurface_set_position(struct wl_client *client,
+		struct wl_resource *resource, int32_t x, int32_t y) {
+	struct forward_subsurface *sub = wl_resource_get_user_data(resource);
+	if (!sub) {
+		return;
+	}
+	/* like the upstream request, this applies on the parent's next commit */
+	sub->x = x;
+	sub->y = y;
+	if (sub->upstream_subsurface) {
+		wl_subsurface_set_position(sub->upstream_subsurface, x, y);
+	}
+}
+static void restack_subsurface(struct wl_resource *resource,
+		struct wl_resource *sibling_resource, bool above) {
+	struct forward_subsurface *sub = wl_resource_get_user_data(resource);
+	if (!sub || !sub->parent) {
+		return;
+	}
+	struct forward_surface *sibling = wl_resource_get_user_data(sibling_resource);
+	if (sibling == sub->surface || (sibling != sub->parent &&
+			(!sibling->subsurface || sibling->subsurface->parent != sub->parent))) {
+		wl_resource_post_error(resource, WL_SUBSURFACE_ERROR_BAD_SURFACE,
+			"the reference surface is neither a sibling nor the parent");
+		return;
+	}
+	struct upstream_objects sibling_up;
+	if (!sub->upstream_subsurface || !get_upstream(sibling, &sibling_up)) {
+		/* the parent has no upstream surface yet, so nothing to restack */
+		return;
+	}
+	/* Restacking among the plugin's own subsurfaces, or relative to the
+	 * parent, keeps them all below the indicator */
+	if (above) {
+		wl_subsurface_place_above(sub->upstream_subsurface, sibling_up.surface);
+	} else {
+		wl_subsurface_place_below(sub->upstream_subsurface, sibling_up.surface);
+	}
+}
+static void nested_subsurface_place_above(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *sibling) {
+	restack_subsurface(resource, sibling, true);
+}
+static void nested_subsurface_place_below(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *sibling) {
+	restack_subsurface(resource, sibling, false);
+}
+static void nested_subsurface_set_sync(struct wl_client *client,
+		struct wl_resource *resource) {
+	struct forward_subsurface *sub = wl_resource_get_user_data(resource);
+	if (!sub) {
+		return;
+	}
+	/* the upstream compositor caches the state of synchronized
+	 * subsurfaces until the parent commits, just as it should */
+	sub->sync = true;
+	if (sub->upstream_subsurface) {
+		wl_subsurface_set_sync(sub->upstream_subsurface);
+	}
+}
+static void nested_subsurface_set_desync(struct wl_client *client,
+		struct wl_resource *resource) {
+	struct forward_subsurface *sub = wl_resource_get_user_data(resource);
+	if (!sub) {
+		return;
+	}
+	sub->sync = false;
+	if (sub->upstream_subsurface) {
+		wl_subsurface_set_desync(sub->upstream_subsurface);
+	}
+	resume_held_parent(sub->parent);
+}
+
+static const struct wl_subsurface_interface subsurface_impl = {
+	.destroy = nested_subsurface_destroy,
+	.set_position = nested_subsurface_set_position,
+	.place_above = nested_subsurface_place_above,
+	.place_below = nested_subsurface_place_below,
+	.set_sync = nested_subsurface_set_sync,
+	.set_desync = nested_subsurface_set_desync,
+};
+
+static void subcompositor_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+static void subcompositor_get_subsurface(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id,
+		struct wl_resource *surface_resource, struct wl_resource *parent_resource) {
+	assert(wl_resource_instance_of(surface_resource, &wl_surface_interface, &surface_impl));
+	assert(wl_resource_instance_of(parent_resource, &wl_surface_interface, &surface_impl));
+	struct forward_state *forward = wl_resource_get_user_data(resource);
+	struct forward_surface *surface = wl_resource_get_user_data(surface_resource);
+	struct forward_surface *parent = wl_resource_get_user_data(parent_resource);
+
+	if (surface->subsurface || surface->sway_surface || surface->layer_surface ||
+			surface->xdg_surface) {
+		wl_resource_post_error(resource, WL_SUBCOMPOSITOR_ERROR_BAD_SURFACE,
+			"the surface already has a role");
+		return;
+	}
+	/* the parent may not be the surface itself or one of its descendants */
+	for (struct forward_surface *iter = parent; iter;
+			iter = iter->subsurface ? iter->subsurface->parent : NULL) {
+		if (iter == surface) {
+			wl_resource_post_error(resource, WL_SUBCOMPOSITOR_ERROR_BAD_SURFACE,
+				"the parent is the surface or one of its descendants");
+			return;
+		}
+	}
+
+	struct wl_resource *sub_resource = wl_resource_create(client,
+		&wl_subsurface_interface, wl_resource_get_version(resource), id);
+	if (sub_resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	struct forward_subsurface *sub = calloc(1, sizeof(*sub));
+	if (!sub) {
+		wl_resource_destroy(sub_resource);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	count_allocation(forward);
+	sub->resource = sub_resource;
+	sub->surface = surface;
+	sub->parent = parent;
+	sub->sync = true;
+	wl_list_insert(parent->subsurfaces.prev, &sub->link);
+	sub->upstream = wl_compositor_create_surface(forward->compositor);
+	if (forward->viewporter) {
+		sub->viewport = wp_viewporter_get_viewport(forward->viewporter, sub->upstream);
+	}
+	surface->subsurface = sub;
+	wl_resource_set_implementation(sub_resource, &subsurface_impl, sub,
+		subsurface_handle_resource_destroy);
+
+	link_upstream_subsurface(sub);
+}
+
+static const struct wl_subcompositor_interface subcompositor_impl = {
+	.destroy = subcompositor_destroy,
+	.get_subsurface = subcompositor_get_subsurface,
+};
+void bind_subcompositor(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource =
+		wl_resource_create(client, &wl_subcompositor_interface, version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &subcompositor_impl, data, NULL);
+}
+
 
 static void nested_buffer_destroy(struct wl_client *client, struct wl_resource *resource) {
 	wl_resource_destroy(resource);
 }
 static void handle_buffer_release(void *data, struct wl_buffer *wl_buffer) {
+	/* If the buffer had a drm syncobj release point, the compositor signals
+	 * that on the plugin's own timeline */
 	struct forward_buffer *buffer = data;
+	clear_sync_point(&buffer->release);
 	if (buffer->resource) {
 		wl_buffer_send_release(buffer->resource);
 	}
@@ -710,18 +2324,50 @@ static void buffer_handle_resource_destroy(struct wl_resource *resource) {
 	}
 
 	if (wl_list_empty(&buffer->pending_surfaces)) {
-		wl_buffer_destroy(buffer->buffer);
-		free(buffer);
+		destroy_forward_buffer(buffer);
 	} else {
 		buffer->resource = NULL;
 	}
 }
+static struct forward_buffer *make_buffer(struct forward_state *forward,
+		int width, int height) {
+	struct forward_buffer *buffer = forward_slab_alloc(forward, &forward->buffer_slab);
+	if (!buffer) {
+		return NULL;
+	}
+	buffer->forward = forward;
+	wl_list_init(&buffer->pending_surfaces);
+	wl_list_init(&buffer->committed_surfaces);
+	buffer->width = width;
+	buffer->height = height;
+	return buffer;
+}
 static void nested_shm_pool_create_buffer(struct wl_client *client,
 		struct wl_resource *resource, uint32_t id,
 		int32_t offset, int32_t width, int32_t height,
 		int32_t stride, uint32_t format) {
 	assert(wl_resource_instance_of(resource, &wl_shm_pool_interface, &shm_pool_impl));
-	struct wl_shm_pool *shm_pool = wl_resource_get_user_data(resource);
+	struct forward_shm_pool *pool = wl_resource_get_user_data(resource);
+
+	if (!pool->pool) {
+		/* The buffer will be read locally, so do the checks the
+		 * compositor would otherwise make */
+		if (!is_shm_format_supported(pool->forward, format) ||
+				shm_format_bpp(format) == 0) {
+			wl_resource_post_error(resource, WL_SHM_ERROR_INVALID_FORMAT,
+				"invalid format 0x%x", format);
+			return;
+		}
+		int64_t min_stride = (int64_t)width * shm_format_bpp(format);
+		if (offset < 0 || width <= 0 || height <= 0 || stride <= 0 ||
+				stride < min_stride ||
+				(int64_t)offset + (int64_t)stride * height > (int64_t)pool->size) {
+			wl_resource_post_error(resource, WL_SHM_ERROR_INVALID_STRIDE,
+				"invalid width, height or stride (%dx%d, %d)",
+				width, height, stride);
+			return;
+		}
+	}
 
 	struct wl_resource *buf_resource = wl_resource_create(client, &wl_buffer_interface,
 		wl_resource_get_version(resource), id);
@@ -730,18 +2376,25 @@ static void nested_shm_pool_create_buffer(struct wl_client *client,
 		return;
 	}
 
-	struct forward_buffer *buffer = calloc(1, sizeof(struct forward_buffer));
+	struct forward_buffer *buffer = make_buffer(pool->forward, width, height);
 	if (!buffer) {
 		wl_client_post_no_memory(client);
 		return;
 	}
 	buffer->resource = buf_resource;
-	wl_list_init(&buffer->pending_surfaces);
-	wl_list_init(&buffer->committed_surfaces);
-	buffer->width = width;
-	buffer->height = height;
 
-	buffer->buffer = wl_shm_pool_create_buffer(shm_pool,
+	if (!pool->pool) {
+		pool->refs++;
+		buffer->shm_pool = pool;
+		buffer->offset = offset;
+		buffer->stride = stride;
+		buffer->format = format;
+		wl_resource_set_implementation(buf_resource, &buffer_impl,
+			buffer, buffer_handle_resource_destroy);
+		return;
+	}
+
+	buffer->buffer = wl_shm_pool_create_buffer(pool->pool,
 		offset, width, height, stride, format);
 	if (!buffer->buffer) {
 		wl_client_post_no_memory(client);
@@ -759,8 +2412,26 @@ static void nested_shm_pool_destroy(struct wl_client *client,
 static void nested_shm_pool_resize(struct wl_client *client,
 		struct wl_resource *resource, int32_t size) {
 	assert(wl_resource_instance_of(resource, &wl_shm_pool_interface, &shm_pool_impl));
-	struct wl_shm_pool* shm_pool = wl_resource_get_user_data(resource);
-	wl_shm_pool_resize(shm_pool, size);
+	struct forward_shm_pool *pool = wl_resource_get_user_data(resource);
+	if (pool->pool) {
+		wl_shm_pool_resize(pool->pool, size);
+		return;
+	}
+
+	if (size < 0 || (size_t)size < pool->size) {
+		wl_resource_post_error(resource, WL_SHM_ERROR_INVALID_STRIDE,
+			"shrinking pool invalid");
+		return;
+	}
+	void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, pool->fd, 0);
+	if (data == MAP_FAILED) {
+		wl_resource_post_error(resource, WL_SHM_ERROR_INVALID_FD,
+			"failed mmap fd %d: %s", pool->fd, strerror(errno));
+		return;
+	}
+	munmap(pool->data, pool->size);
+	pool->data = data;
+	pool->size = size;
 }
 
 static const struct wl_shm_pool_interface shm_pool_impl = {
@@ -771,8 +2442,11 @@ static const struct wl_shm_pool_interface shm_pool_impl = {
 
 static void shm_pool_handle_resource_destroy(struct wl_resource *resource) {
 	assert(wl_resource_instance_of(resource, &wl_shm_pool_interface, &shm_pool_impl));
-	struct wl_shm_pool* shm_pool = wl_resource_get_user_data(resource);
-	wl_shm_pool_destroy(shm_pool);
+	struct forward_shm_pool *pool = wl_resource_get_user_data(resource);
+	if (pool->fd >= 0) {
+		close(pool->fd);
+	}
+	unref_shm_pool(pool);
 }
 static void shm_create_pool(struct wl_client *client, struct wl_resource *resource,
 		uint32_t id, int32_t fd, int32_t size) {
@@ -785,12 +2459,39 @@ static void shm_create_pool(struct wl_client *client, struct wl_resource *resour
 	}
 
 	struct forward_state *server = wl_resource_get_user_data(resource);
-	struct wl_shm *shm = server->shm;
-	struct wl_shm_pool *shm_pool = wl_shm_create_pool(shm, fd, size);
-	close(fd);
+	struct forward_shm_pool *pool = calloc(1, sizeof(*pool));
+	if (!pool) {
+		close(fd);
+		wl_resource_destroy(pool_resource);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	count_allocation(server);
+	pool->forward = server;
+	pool->refs = 1;
+	pool->fd = -1;
+	if (server->shadow_buffers) {
+		void *data = size > 0 ?
+			mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+		if (data == MAP_FAILED) {
+			wl_resource_post_error(resource, WL_SHM_ERROR_INVALID_FD,
+				"failed mmap fd %d: %s", fd, size > 0 ? strerror(errno) : "invalid size");
+			close(fd);
+			free(pool);
+			wl_resource_destroy(pool_resource);
+			return;
+		}
+		pool->data = data;
+		pool->size = size;
+		pool->fd = fd;
+		install_sigbus_handler();
+	} else {
+		pool->pool = wl_shm_create_pool(server->shm, fd, size);
+		close(fd);
+	}
 
 	wl_resource_set_implementation(pool_resource, &shm_pool_impl,
-		shm_pool, shm_pool_handle_resource_destroy);
+		pool, shm_pool_handle_resource_destroy);
 }
 
 static const struct wl_shm_interface shm_impl = {
@@ -807,6 +2508,10 @@ void bind_wl_shm(struct wl_client *client, void *data,
 	}
 	struct forward_state *forward = data;
 	for (size_t i = 0; i < forward->shm_formats_len; i++) {
+		/* only formats with a known pixel size can be copied */
+		if (forward->shadow_buffers && shm_format_bpp(forward->shm_formats[i]) == 0) {
+			continue;
+		}
 		wl_shm_send_format(resource, forward->shm_formats[i]);
 	}
 	wl_resource_set_implementation(resource, &shm_impl, forward, NULL);
@@ -834,17 +2539,6 @@ static void nested_dmabuf_params_create(struct wl_client *client,
 	params->height = height;
 	zwp_linux_buffer_params_v1_create(params->params, width, height, format, flags);
 }
-static struct forward_buffer *make_buffer(int width, int height) {
-	struct forward_buffer *buffer = calloc(1, sizeof(struct forward_buffer));
-	if (!buffer) {
-		return NULL;
-	}
-	wl_list_init(&buffer->pending_surfaces);
-	wl_list_init(&buffer->committed_surfaces);
-	buffer->width = width;
-	buffer->height = height;
-	return buffer;
-}
 static void nested_dmabuf_params_create_immed(struct wl_client *client,
 		struct wl_resource *resource, uint32_t buffer_id, int32_t width,
 		int32_t height, uint32_t format, uint32_t flags) {
@@ -858,12 +2552,13 @@ static void nested_dmabuf_params_create_immed(struct wl_client *client,
 
 	struct forward_params *params = wl_resource_get_user_data(resource);
 
-	struct forward_buffer *buffer = make_buffer(width, height);
+	struct forward_buffer *buffer = make_buffer(params->forward, width, height);
 	if (!buffer) {
 		wl_client_post_no_memory(client);
 		return;
 	}
 	buffer->resource = buffer_resource;
+	buffer->dmabuf = true;
 	buffer->buffer = zwp_linux_buffer_params_v1_create_immed(params->params, width, height, format, flags);
 	if (!buffer->buffer) {
 		wl_client_post_no_memory(client);
@@ -888,7 +2583,7 @@ static void linux_dmabuf_params_handle_resource_destroy(struct wl_resource *reso
 	assert(wl_resource_instance_of(resource, &zwp_linux_buffer_params_v1_interface, &linux_dmabuf_params_impl));
 	struct forward_params* params = wl_resource_get_user_data(resource);
 	zwp_linux_buffer_params_v1_destroy(params->params);
-	free(params);
+	slab_free(&params->forward->params_slab, params);
 }
 
 static void nested_linux_dmabuf_destroy(struct wl_client *client,
@@ -909,12 +2604,14 @@ void handle_dmabuf_params_created(void *data,
 		return;
 	}
 
-	struct forward_buffer *buffer = make_buffer(params->width, params->height);
+	struct forward_buffer *buffer = make_buffer(params->forward,
+		params->width, params->height);
 	if (!buffer) {
 		wl_client_post_no_memory(client);
 		return;
 	}
 	buffer->resource = buffer_resource;
+	buffer->dmabuf = true;
 	buffer->buffer = wl_buffer;
 	wl_resource_set_implementation(buffer_resource, &buffer_impl,
 		buffer, buffer_handle_resource_destroy);
@@ -935,7 +2632,8 @@ static const struct zwp_linux_buffer_params_v1_listener params_listener = {
 
 static void nested_linux_dmabuf_create_params(struct wl_client *client,
 		struct wl_resource *resource, uint32_t params_id) {
-	struct forward_params *params = calloc(1, sizeof(*params));
+	struct forward_state *forward = wl_resource_get_user_data(resource);
+	struct forward_params *params = forward_slab_alloc(forward, &forward->params_slab);
 	if (!params) {
 		wl_client_post_no_memory(client);
 		return;
@@ -945,12 +2643,12 @@ static void nested_linux_dmabuf_create_params(struct wl_client *client,
 		&zwp_linux_buffer_params_v1_interface,
 		wl_resource_get_version(resource), params_id);
 	if (params_resource == NULL) {
-		free(params);
+		slab_free(&forward->params_slab, params);
 		wl_client_post_no_memory(client);
 		return;
 	}
 
-	struct forward_state *forward = wl_resource_get_user_data(resource);
+	params->forward = forward;
 	params->resource = params_resource;
 	params->params = zwp_linux_dmabuf_v1_create_params(forward->linux_dmabuf);
 	params->width = 0;
@@ -1032,10 +2730,10 @@ void nested_linux_dmabuf_get_default_feedback(struct wl_client *client,
 	wl_resource_set_implementation(feedback_resource, &linux_dmabuf_feedback_v1_impl,
 		NULL, linux_dmabuf_feedback_handle_resource_destroy);
 
-	send_dmabuf_feedback_data(feedback_resource, &forward->current);
+	send_dmabuf_feedback_data(feedback_resource, &forward->default_feedback.current);
 
 	/* register to listen to future changes */
-	wl_list_insert(&forward->feedback_instances, wl_resource_get_link(feedback_resource));
+	wl_list_insert(&forward->default_feedback.instances, wl_resource_get_link(feedback_resource));
 }
 
 void nested_linux_dmabuf_get_surface_feedback(struct wl_client *client,
@@ -1050,28 +2748,106 @@ void nested_linux_dmabuf_get_surface_feedback(struct wl_client *client,
 	}
 
 	struct forward_state *forward = wl_resource_get_user_data(resource);
+	struct forward_surface *fwd_surface = wl_resource_get_user_data(surface);
 
+	/* Until the surface is assigned an output, it gets the default
+	 * feedback; the user data is used to find it then */
+	struct dmabuf_feedback_receiver *receiver = &forward->default_feedback;
+	if (fwd_surface->sway_surface && fwd_surface->sway_surface->dmabuf_feedback) {
+		receiver = &fwd_surface->sway_surface->dmabuf_surface_feedback;
+	}
 	wl_resource_set_implementation(feedback_resource, &linux_dmabuf_feedback_v1_impl,
-		NULL, linux_dmabuf_feedback_handle_resource_destroy);
+		fwd_surface, linux_dmabuf_feedback_handle_resource_destroy);
 
-	send_dmabuf_feedback_data(feedback_resource, &forward->current);
+	send_dmabuf_feedback_data(feedback_resource,
+		receiver->done ? &receiver->current : &forward->default_feedback.current);
 
 	/* register to listen to future changes */
-	wl_list_insert(&forward->feedback_instances, wl_resource_get_link(feedback_resource));
-
-	/* alternative: instead of subscribing to general changes, ask for feedback from
-	 * upstream.
-	 *
-	struct forward_surface *fwd_surface = wl_resource_get_user_data(surface);
-	struct zwp_linux_dmabuf_feedback_v1 *feedback =
-		zwp_linux_dmabuf_v1_get_surface_feedback(forward->linux_dmabuf, fwd_surface->upstream);
-	*/
+	wl_list_insert(&receiver->instances, wl_resource_get_link(feedback_resource));
+}
 
+void adopt_surface_dmabuf_feedback(struct forward_surface *surface) {
+	struct swaylock_surface *sw_surf = surface->sway_surface;
+	if (!sw_surf->dmabuf_feedback) {
+		return;
+	}
+	struct dmabuf_feedback_receiver *receiver = &sw_surf->dmabuf_surface_feedback;
+	struct wl_resource *resource, *tmp;
+	wl_resource_for_each_safe(resource, tmp, &surface->state->default_feedback.instances) {
+		if (wl_resource_get_user_data(resource) != surface) {
+			continue;
+		}
+		wl_list_remove(wl_resource_get_link(resource));
+		wl_list_insert(&receiver->instances, wl_resource_get_link(resource));
+		if (receiver->done) {
+			send_dmabuf_feedback_data(resource, &receiver->current);
+		}
+	}
 }
 
-static const struct zwp_linux_dmabuf_v1_interface linux_dmabuf_impl = {
-	.destroy = nested_linux_dmabuf_destroy,
-	.create_params = nested_linux_dmabuf_create_params,
+void unmap_plugin_surface(struct forward_surface *surface) {
+	struct swaylock_surface *sw_surf = surface->sway_surface;
+	struct forward_subsurface *child;
+	wl_list_for_each(child, &surface->subsurfaces, link) {
+		if (child->upstream_subsurface) {
+			wl_subsurface_destroy(child->upstream_subsurface);
+			child->upstream_subsurface = NULL;
+		}
+	}
+	if (sw_surf->dmabuf_feedback) {
+		struct wl_resource *feedback, *tmp;
+		wl_resource_for_each_safe(feedback, tmp, &sw_surf->dmabuf_surface_feedback.instances) {
+			if (wl_resource_get_user_data(feedback) != surface) {
+				continue;
+			}
+			wl_list_remove(wl_resource_get_link(feedback));
+			wl_list_insert(&surface->state->default_feedback.instances,
+				wl_resource_get_link(feedback));
+		}
+	}
+	if (sw_surf->syncobj_surface) {
+		wp_linux_drm_syncobj_surface_v1_destroy(sw_surf->syncobj_surface);
+		sw_surf->syncobj_surface = NULL;
+	}
+
+	/* held back upstream commits have nowhere to go */
+	if (surface->deferred_commit_timer) {
+		loop_remove_timer(surface->state->eventloop, surface->deferred_commit_timer);
+		surface->deferred_commit_timer = NULL;
+	}
+	surface->mailbox_deferred = false;
+	surface->shadow_deferred = false;
+
+	/* an unmapped surface has no buffer, and must wait for a configure
+	 * before attaching one */
+	if (surface->committed.attachment
+			&& surface->committed.attachment != BUFFER_UNREACHABLE
+			&& surface->committed.attachment != BUFFER_COMMITTED) {
+		wl_list_remove(&surface->committed.attachment_link);
+	}
+	surface->committed.attachment = NULL;
+	struct forward_buffer *pending = surface->pending.attachment;
+	if (pending && pending != BUFFER_UNREACHABLE && pending != BUFFER_COMMITTED) {
+		wl_list_remove(&surface->pending.attachment_link);
+		if (pending->resource == NULL && wl_list_empty(&pending->pending_surfaces)) {
+			assert(wl_list_empty(&pending->committed_surfaces));
+			destroy_forward_buffer(pending);
+		}
+	}
+	surface->pending.attachment = NULL;
+	surface->shadow_active = false;
+	surface->shadow_dirty = false;
+	surface->shown_shadow = NULL;
+	region_clear(&surface->buffer_damage);
+	region_clear(&surface->surface_damage);
+	surface->has_been_configured = false;
+	surface->serial_ring_len = 0;
+	surface->configure_coalesced = false;
+}
+
+static const struct zwp_linux_dmabuf_v1_interface linux_dmabuf_impl = {
+	.destroy = nested_linux_dmabuf_destroy,
+	.create_params = nested_linux_dmabuf_create_params,
 	.get_default_feedback = nested_linux_dmabuf_get_default_feedback,
 	.get_surface_feedback = nested_linux_dmabuf_get_surface_feedback,
 };
@@ -1109,7 +2885,9 @@ void bind_linux_dmabuf(struct wl_client *client, void *data,
 
 static void nested_drm_authenticate(struct wl_client *client,
 		struct wl_resource *resource, uint32_t id) {
-	wl_client_post_implementation_error(client, "wl_drm.authenticate not supported");
+	/* The wl_drm global only exists if a render node was found, and
+	 * render nodes need no authentication */
+	wl_drm_send_authenticated(resource);
 }
 static void nested_drm_create_buffer(struct wl_client *client,
 		struct wl_resource *resource, uint32_t id,
@@ -1129,8 +2907,50 @@ static void nested_drm_create_prime_buffer(struct wl_client *client,
 		int32_t width, int32_t height, uint32_t format, int32_t offset0,
 		int32_t stride0, int32_t offset1,int32_t stride1, int32_t offset2,
 		int32_t stride2) {
-	wl_client_post_implementation_error(client, "wl_drm.create_prime_buffer not supported");
+	struct forward_state *forward = wl_resource_get_user_data(resource);
+	struct wl_resource *buf_resource = wl_resource_create(client, &wl_buffer_interface,
+		1, id);
+	if (buf_resource == NULL) {
+		close(name);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	struct forward_buffer *buffer = make_buffer(forward, width, height);
+	if (!buffer) {
+		close(name);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	buffer->resource = buf_resource;
+	buffer->dmabuf = true;
+
+	if (forward->linux_dmabuf) {
+		/* wl_drm formats are DRM fourcc codes, and its buffers use the
+		 * implicit modifier; planes after the first have nonzero strides */
+		int32_t offsets[3] = {offset0, offset1, offset2};
+		int32_t strides[3] = {stride0, stride1, stride2};
+		struct zwp_linux_buffer_params_v1 *params =
+			zwp_linux_dmabuf_v1_create_params(forward->linux_dmabuf);
+		for (uint32_t i = 0; i < 3 && (i == 0 || strides[i] != 0); i++) {
+			zwp_linux_buffer_params_v1_add(params, name, i, offsets[i], strides[i],
+				DRM_FORMAT_MOD_INVALID >> 32, DRM_FORMAT_MOD_INVALID & 0xffffffff);
+		}
+		buffer->buffer = zwp_linux_buffer_params_v1_create_immed(params,
+			width, height, format, 0);
+		zwp_linux_buffer_params_v1_destroy(params);
+	} else {
+		buffer->buffer = wl_drm_create_prime_buffer(forward->drm, name, width, height,
+			format, offset0, stride0, offset1, stride1, offset2, stride2);
+	}
+	close(name);
+	if (!buffer->buffer) {
+		wl_client_post_no_memory(client);
+		return;
+	}
 
+	wl_resource_set_implementation(buf_resource, &buffer_impl,
+		buffer, buffer_handle_resource_destroy);
+	wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
 }
 static const struct wl_drm_interface wl_drm_impl = {
 	.authenticate = nested_drm_authenticate,
@@ -1146,13 +2966,157 @@ void bind_drm(struct wl_client *client, void *data,
 		wl_client_post_no_memory(client);
 		return;
 	}
-	// TODO: look this up from the upstream copy
-	wl_drm_send_device(resource, "/dev/dri/renderD128");
-	wl_drm_send_capabilities(resource, 1);
+	struct forward_state *forward = data;
+	wl_drm_send_device(resource, forward->drm_render_node);
+	if (forward->drm_formats_len > 0) {
+		for (size_t i = 0; i < forward->drm_formats_len; i++) {
+			wl_drm_send_format(resource, forward->drm_formats[i]);
+		}
+	} else {
+		/* Without an upstream wl_drm, offer what linux-dmabuf accepts
+		 * with the implicit modifier */
+		for (size_t i = 0; i < forward->dmabuf_formats_len; i++) {
+			const struct dmabuf_modifier_pair *pair = &forward->dmabuf_formats[i];
+			uint64_t modifier = ((uint64_t)pair->modifier_hi << 32) | pair->modifier_lo;
+			if (modifier != DRM_FORMAT_MOD_INVALID) {
+				continue;
+			}
+			bool seen = false;
+			for (size_t j = 0; j < i && !seen; j++) {
+				const struct dmabuf_modifier_pair *prev = &forward->dmabuf_formats[j];
+				seen = prev->format == pair->format &&
+					prev->modifier_hi == pair->modifier_hi &&
+					prev->modifier_lo == pair->modifier_lo;
+			}
+			if (!seen) {
+				wl_drm_send_format(resource, pair->format);
+			}
+		}
+	}
+	if (version >= 2) {
+		wl_drm_send_capabilities(resource, WL_DRM_CAPABILITY_PRIME);
+	}
 
 	wl_resource_set_implementation(resource, &wl_drm_impl, data, NULL);
 }
 
+/* Pack a premultiplied wp_single_pixel_buffer_manager_v1 color into an
+ * ARGB8888 pixel */
+static uint32_t pack_argb8888(uint32_t r, uint32_t g, uint32_t b, uint32_t a) {
+	uint32_t channels[4] = {a, r, g, b};
+	uint32_t pixel = 0;
+	for (int i = 0; i < 4; i++) {
+		pixel = (pixel << 8) | (uint32_t)(((uint64_t)channels[i] * 255 + UINT32_MAX / 2) / UINT32_MAX);
+	}
+	return pixel;
+}
+
+/* Back a 1x1 buffer with a one-pixel shm pool, for when the compositor lacks
+ * wp_single_pixel_buffer_manager_v1; with --shadow-buffers the pixel is kept
+ * locally and copied like any other shm buffer */
+static bool make_shm_pixel_buffer(struct forward_buffer *buffer, uint32_t pixel) {
+	struct forward_state *forward = buffer->forward;
+	int fd = anonymous_shm_open();
+	if (fd < 0) {
+		return false;
+	}
+	if (ftruncate(fd, sizeof(pixel)) < 0) {
+		close(fd);
+		return false;
+	}
+	void *data = mmap(NULL, sizeof(pixel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+	memcpy(data, &pixel, sizeof(pixel));
+
+	if (forward->shadow_buffers) {
+		close(fd);
+		struct forward_shm_pool *pool = calloc(1, sizeof(*pool));
+		if (!pool) {
+			munmap(data, sizeof(pixel));
+			return false;
+		}
+		count_allocation(forward);
+		pool->forward = forward;
+		pool->refs = 1;
+		pool->fd = -1;
+		pool->data = data;
+		pool->size = sizeof(pixel);
+		buffer->shm_pool = pool;
+		buffer->offset = 0;
+		buffer->stride = sizeof(pixel);
+		buffer->format = WL_SHM_FORMAT_ARGB8888;
+		return true;
+	}
+
+	munmap(data, sizeof(pixel));
+	struct wl_shm_pool *pool = wl_shm_create_pool(forward->shm, fd, sizeof(pixel));
+	close(fd);
+	buffer->buffer = wl_shm_pool_create_buffer(pool, 0, 1, 1, sizeof(pixel),
+		WL_SHM_FORMAT_ARGB8888);
+	wl_shm_pool_destroy(pool);
+	return buffer->buffer != NULL;
+}
+
+static void nested_single_pixel_buffer_manager_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+static void nested_single_pixel_buffer_manager_create_u32_rgba_buffer(
+		struct wl_client *client, struct wl_resource *resource, uint32_t id,
+		uint32_t r, uint32_t g, uint32_t b, uint32_t a) {
+	struct forward_state *forward = wl_resource_get_user_data(resource);
+
+	struct wl_resource *buf_resource = wl_resource_create(client, &wl_buffer_interface,
+		1, id);
+	if (buf_resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	struct forward_buffer *buffer = make_buffer(forward, 1, 1);
+	if (!buffer) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	buffer->resource = buf_resource;
+
+	if (forward->single_pixel_buffer_manager) {
+		buffer->buffer = wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+			forward->single_pixel_buffer_manager, r, g, b, a);
+	} else if (!make_shm_pixel_buffer(buffer, pack_argb8888(r, g, b, a))) {
+		swaylock_log_errno(LOG_ERROR, "Failed to create single pixel buffer");
+		destroy_forward_buffer(buffer);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(buf_resource, &buffer_impl,
+		buffer, buffer_handle_resource_destroy);
+	if (buffer->buffer) {
+		wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+	}
+}
+
+static const struct wp_single_pixel_buffer_manager_v1_interface single_pixel_buffer_manager_impl = {
+	.destroy = nested_single_pixel_buffer_manager_destroy,
+	.create_u32_rgba_buffer = nested_single_pixel_buffer_manager_create_u32_rgba_buffer,
+};
+
+void bind_single_pixel_buffer_manager(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource = wl_resource_create(client,
+		&wp_single_pixel_buffer_manager_v1_interface, version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &single_pixel_buffer_manager_impl, data, NULL);
+}
+
+
 static void viewport_handle_resource_destroy(struct wl_resource *resource) {
 	assert(wl_resource_instance_of(resource, &wp_viewport_interface, &viewport_impl));
 	struct forward_surface *fwd_surface = wl_resource_get_user_data(resource);
@@ -1241,6 +3205,507 @@ void bind_viewporter(struct wl_client *client, void *data,
 	wl_resource_set_implementation(resource, &viewporter_impl, forward, NULL);
 }
 
+static void free_presentation_feedback(struct forward_presentation_feedback *feedback) {
+	slab_free(&feedback->forward->feedback_slab, feedback);
+}
+
+static void presentation_feedback_handle_resource_destroy(struct wl_resource *resource) {
+	assert(wl_resource_instance_of(resource, &wp_presentation_feedback_interface, NULL));
+	struct forward_presentation_feedback *feedback = wl_resource_get_user_data(resource);
+	wl_list_remove(&feedback->link);
+	wl_list_init(&feedback->link);
+	feedback->resource = NULL;
+	if (!feedback->feedback) {
+		free_presentation_feedback(feedback);
+	}
+}
+
+/* Report (and free) feedback whose content never reached the compositor */
+static void discard_presentation_feedback(struct wl_list *feedbacks) {
+	struct forward_presentation_feedback *feedback, *tmp;
+	wl_list_for_each_safe(feedback, tmp, feedbacks, link) {
+		wp_presentation_feedback_send_discarded(feedback->resource);
+		wl_resource_destroy(feedback->resource);
+	}
+}
+
+/* Called on each plugin commit; the feedback of an earlier commit that was
+ * merged into this one without being forwarded is discarded */
+static void queue_presentation_feedback(struct forward_surface *surface) {
+	discard_presentation_feedback(&surface->queued_feedbacks);
+	wl_list_insert_list(&surface->queued_feedbacks, &surface->pending_feedbacks);
+	wl_list_init(&surface->pending_feedbacks);
+}
+
+static void upstream_feedback_done(struct forward_presentation_feedback *feedback) {
+	wp_presentation_feedback_destroy(feedback->feedback);
+	feedback->feedback = NULL;
+	if (feedback->resource) {
+		wl_resource_destroy(feedback->resource);
+	} else {
+		free_presentation_feedback(feedback);
+	}
+}
+
+static void upstream_feedback_handle_sync_output(void *data,
+		struct wp_presentation_feedback *wp_presentation_feedback,
+		struct wl_output *output) {
+	struct forward_presentation_feedback *feedback = data;
+	if (!feedback->resource) {
+		return;
+	}
+	/* send the plugin's own wl_output for the upstream output */
+	struct wl_client *client = wl_resource_get_client(feedback->resource);
+	struct swaylock_surface *surface;
+	wl_list_for_each(surface, &feedback->state->surfaces, link) {
+		if (surface->output != output) {
+			continue;
+		}
+		struct wl_resource *output_resource;
+		wl_resource_for_each(output_resource, &surface->nested_server_wl_output_resources) {
+			if (wl_resource_get_client(output_resource) == client) {
+				wp_presentation_feedback_send_sync_output(feedback->resource,
+					output_resource);
+			}
+		}
+	}
+}
+
+static void upstream_feedback_handle_presented(void *data,
+		struct wp_presentation_feedback *wp_presentation_feedback,
+		uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+		uint32_t refresh, uint32_t seq_hi, uint32_t seq_lo, uint32_t flags) {
+	struct forward_presentation_feedback *feedback = data;
+	if (feedback->resource) {
+		wp_presentation_feedback_send_presented(feedback->resource, tv_sec_hi,
+			tv_sec_lo, tv_nsec, refresh, seq_hi, seq_lo, flags);
+	}
+	upstream_feedback_done(feedback);
+}
+
+static void upstream_feedback_handle_discarded(void *data,
+		struct wp_presentation_feedback *wp_presentation_feedback) {
+	struct forward_presentation_feedback *feedback = data;
+	if (feedback->resource) {
+		wp_presentation_feedback_send_discarded(feedback->resource);
+	}
+	upstream_feedback_done(feedback);
+}
+
+static const struct wp_presentation_feedback_listener upstream_feedback_listener = {
+	.sync_output = upstream_feedback_handle_sync_output,
+	.presented = upstream_feedback_handle_presented,
+	.discarded = upstream_feedback_handle_discarded,
+};
+
+/* Request upstream feedback for the commit about to be made */
+static void forward_queued_feedback(struct forward_surface *surface) {
+	struct swaylock_state *state = wl_container_of(surface->state, state, forward);
+	struct upstream_objects up;
+	get_upstream(surface, &up);
+	struct forward_presentation_feedback *feedback, *tmp;
+	wl_list_for_each_safe(feedback, tmp, &surface->queued_feedbacks, link) {
+		feedback->state = state;
+		feedback->feedback = wp_presentation_feedback(surface->state->presentation,
+			up.surface);
+		wp_presentation_feedback_add_listener(feedback->feedback,
+			&upstream_feedback_listener, feedback);
+		wl_list_remove(&feedback->link);
+		wl_list_init(&feedback->link);
+	}
+}
+
+static void nested_presentation_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+static void nested_presentation_feedback(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *surface_resource,
+		uint32_t callback) {
+	assert(wl_resource_instance_of(resource, &wp_presentation_interface, &presentation_impl));
+	struct forward_state *forward = wl_resource_get_user_data(resource);
+	struct forward_surface *surface = wl_resource_get_user_data(surface_resource);
+
+	struct wl_resource *feedback_resource = wl_resource_create(client,
+		&wp_presentation_feedback_interface, wl_resource_get_version(resource), callback);
+	if (feedback_resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	struct forward_presentation_feedback *feedback =
+		forward_slab_alloc(forward, &forward->feedback_slab);
+	if (!feedback) {
+		wl_resource_destroy(feedback_resource);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	feedback->forward = forward;
+	feedback->resource = feedback_resource;
+	/* applies to the next commit, like wl_surface::frame */
+	wl_list_insert(surface->pending_feedbacks.prev, &feedback->link);
+	wl_resource_set_implementation(feedback_resource, NULL, feedback,
+		presentation_feedback_handle_resource_destroy);
+}
+
+static const struct wp_presentation_interface presentation_impl = {
+	.destroy = nested_presentation_destroy,
+	.feedback = nested_presentation_feedback,
+};
+
+void bind_presentation(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource =
+		wl_resource_create(client, &wp_presentation_interface, version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	struct forward_state *forward = data;
+	wl_resource_set_implementation(resource, &presentation_impl, forward, NULL);
+	wp_presentation_send_clock_id(resource, forward->presentation_clock_id);
+}
+
+static void fifo_handle_resource_destroy(struct wl_resource *resource) {
+	assert(wl_resource_instance_of(resource, &wp_fifo_v1_interface, &fifo_impl));
+	struct forward_surface *fwd_surface = wl_resource_get_user_data(resource);
+	if (fwd_surface) {
+		fwd_surface->fifo = NULL;
+		fwd_surface->pending_timing.fifo_barrier = false;
+		fwd_surface->pending_timing.fifo_wait = false;
+	}
+}
+
+static void nested_fifo_destroy(struct wl_client *client, struct wl_resource *resource) {
+	/* `fifo_handle_resource_destroy` will be invoked */
+	wl_resource_destroy(resource);
+}
+
+static void nested_fifo_set_barrier(struct wl_client *client, struct wl_resource *resource) {
+	assert(wl_resource_instance_of(resource, &wp_fifo_v1_interface, &fifo_impl));
+	struct forward_surface *fwd_surface = wl_resource_get_user_data(resource);
+	if (!fwd_surface) {
+		wl_resource_post_error(resource, WP_FIFO_V1_ERROR_SURFACE_DESTROYED,
+			"surface destroyed");
+		return;
+	}
+	fwd_surface->pending_timing.fifo_barrier = true;
+}
+
+static void nested_fifo_wait_barrier(struct wl_client *client, struct wl_resource *resource) {
+	assert(wl_resource_instance_of(resource, &wp_fifo_v1_interface, &fifo_impl));
+	struct forward_surface *fwd_surface = wl_resource_get_user_data(resource);
+	if (!fwd_surface) {
+		wl_resource_post_error(resource, WP_FIFO_V1_ERROR_SURFACE_DESTROYED,
+			"surface destroyed");
+		return;
+	}
+	fwd_surface->pending_timing.fifo_wait = true;
+}
+
+static const struct wp_fifo_v1_interface fifo_impl = {
+	.set_barrier = nested_fifo_set_barrier,
+	.wait_barrier = nested_fifo_wait_barrier,
+	.destroy = nested_fifo_destroy,
+};
+
+static void nested_fifo_manager_destroy(struct wl_client *client, struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+static void nested_fifo_manager_get_fifo(struct wl_client *client, struct wl_resource *resource,
+		uint32_t id, struct wl_resource *surface) {
+	struct forward_surface *forward_surf = wl_resource_get_user_data(surface);
+	/* Each surface has at most one wp_fifo_v1 associated */
+	if (forward_surf->fifo) {
+		wl_resource_post_error(resource, WP_FIFO_MANAGER_V1_ERROR_ALREADY_EXISTS,
+			"fifo already exists");
+		return;
+	}
+
+	struct wl_resource *fifo_resource = wl_resource_create(client, &wp_fifo_v1_interface,
+		wl_resource_get_version(resource), id);
+	if (fifo_resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	forward_surf->fifo = fifo_resource;
+	wl_resource_set_implementation(fifo_resource, &fifo_impl,
+		forward_surf, fifo_handle_resource_destroy);
+}
+
+static const struct wp_fifo_manager_v1_interface fifo_manager_impl = {
+	.destroy = nested_fifo_manager_destroy,
+	.get_fifo = nested_fifo_manager_get_fifo,
+};
+
+void bind_fifo_manager(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource =
+		wl_resource_create(client, &wp_fifo_manager_v1_interface, version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &fifo_manager_impl, data, NULL);
+}
+
+static void commit_timer_handle_resource_destroy(struct wl_resource *resource) {
+	assert(wl_resource_instance_of(resource, &wp_commit_timer_v1_interface, &commit_timer_impl));
+	struct forward_surface *fwd_surface = wl_resource_get_user_data(resource);
+	if (fwd_surface) {
+		fwd_surface->commit_timing = NULL;
+		fwd_surface->pending_timing.has_timestamp = false;
+	}
+}
+
+static void nested_commit_timer_destroy(struct wl_client *client, struct wl_resource *resource) {
+	/* `commit_timer_handle_resource_destroy` will be invoked */
+	wl_resource_destroy(resource);
+}
+
+static void nested_commit_timer_set_timestamp(struct wl_client *client,
+		struct wl_resource *resource, uint32_t tv_sec_hi, uint32_t tv_sec_lo,
+		uint32_t tv_nsec) {
+	assert(wl_resource_instance_of(resource, &wp_commit_timer_v1_interface, &commit_timer_impl));
+	struct forward_surface *fwd_surface = wl_resource_get_user_data(resource);
+	if (!fwd_surface) {
+		wl_resource_post_error(resource, WP_COMMIT_TIMER_V1_ERROR_SURFACE_DESTROYED,
+			"surface destroyed");
+		return;
+	}
+	if (tv_nsec >= 1000000000) {
+		wl_resource_post_error(resource, WP_COMMIT_TIMER_V1_ERROR_INVALID_TIMESTAMP,
+			"tv_nsec out of range");
+		return;
+	}
+	struct commit_timing_state *pending = &fwd_surface->pending_timing;
+	if (pending->has_timestamp) {
+		wl_resource_post_error(resource, WP_COMMIT_TIMER_V1_ERROR_TIMESTAMP_EXISTS,
+			"timestamp already set for this commit");
+		return;
+	}
+	pending->has_timestamp = true;
+	pending->tv_sec_hi = tv_sec_hi;
+	pending->tv_sec_lo = tv_sec_lo;
+	pending->tv_nsec = tv_nsec;
+}
+
+static const struct wp_commit_timer_v1_interface commit_timer_impl = {
+	.set_timestamp = nested_commit_timer_set_timestamp,
+	.destroy = nested_commit_timer_destroy,
+};
+
+static void nested_commit_timing_manager_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+static void nested_commit_timing_manager_get_timer(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id, struct wl_resource *surface) {
+	struct forward_surface *forward_surf = wl_resource_get_user_data(surface);
+	/* Each surface has at most one wp_commit_timer_v1 associated */
+	if (forward_surf->commit_timing) {
+		wl_resource_post_error(resource,
+			WP_COMMIT_TIMING_MANAGER_V1_ERROR_COMMIT_TIMER_EXISTS,
+			"commit timer already exists");
+		return;
+	}
+
+	struct wl_resource *timer_resource = wl_resource_create(client,
+		&wp_commit_timer_v1_interface, wl_resource_get_version(resource), id);
+	if (timer_resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	forward_surf->commit_timing = timer_resource;
+	wl_resource_set_implementation(timer_resource, &commit_timer_impl,
+		forward_surf, commit_timer_handle_resource_destroy);
+}
+
+static const struct wp_commit_timing_manager_v1_interface commit_timing_manager_impl = {
+	.destroy = nested_commit_timing_manager_destroy,
+	.get_timer = nested_commit_timing_manager_get_timer,
+};
+
+void bind_commit_timing_manager(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource =
+		wl_resource_create(client, &wp_commit_timing_manager_v1_interface, version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &commit_timing_manager_impl, data, NULL);
+}
+
+static void syncobj_timeline_handle_resource_destroy(struct wl_resource *resource) {
+	assert(wl_resource_instance_of(resource, &wp_linux_drm_syncobj_timeline_v1_interface,
+		&syncobj_timeline_impl));
+	unref_timeline(wl_resource_get_user_data(resource));
+}
+
+static void nested_syncobj_timeline_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+static const struct wp_linux_drm_syncobj_timeline_v1_interface syncobj_timeline_impl = {
+	.destroy = nested_syncobj_timeline_destroy,
+};
+
+static void syncobj_surface_handle_resource_destroy(struct wl_resource *resource) {
+	assert(wl_resource_instance_of(resource, &wp_linux_drm_syncobj_surface_v1_interface,
+		&syncobj_surface_impl));
+	struct forward_surface *fwd_surface = wl_resource_get_user_data(resource);
+	if (!fwd_surface) {
+		return;
+	}
+	fwd_surface->syncobj_surface = NULL;
+	clear_sync_point(&fwd_surface->pending_acquire);
+	clear_sync_point(&fwd_surface->pending_release);
+
+	struct upstream_objects up;
+	if (!get_upstream(fwd_surface, &up) || !*up.syncobj_surface) {
+		return;
+	}
+	if ((fwd_surface->deferred_commit_timer || fwd_surface->mailbox_deferred) &&
+			fwd_surface->release_point_unsent) {
+		/* points set since the last upstream commit would be lost */
+		flush_deferred_commit(fwd_surface);
+	}
+	wp_linux_drm_syncobj_surface_v1_destroy(*up.syncobj_surface);
+	*up.syncobj_surface = NULL;
+}
+
+static void nested_syncobj_surface_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	/* `syncobj_surface_handle_resource_destroy` will be invoked */
+	wl_resource_destroy(resource);
+}
+
+static void set_sync_point(struct wl_resource *resource, struct wl_resource *timeline_resource,
+		uint32_t point_hi, uint32_t point_lo, bool acquire) {
+	assert(wl_resource_instance_of(resource, &wp_linux_drm_syncobj_surface_v1_interface,
+		&syncobj_surface_impl));
+	struct forward_surface *fwd_surface = wl_resource_get_user_data(resource);
+	if (!fwd_surface) {
+		wl_resource_post_error(resource, WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_NO_SURFACE,
+			"surface destroyed");
+		return;
+	}
+	struct syncobj_point *point = acquire ?
+		&fwd_surface->pending_acquire : &fwd_surface->pending_release;
+	clear_sync_point(point);
+	point->timeline = wl_resource_get_user_data(timeline_resource);
+	point->timeline->refs++;
+	point->point_hi = point_hi;
+	point->point_lo = point_lo;
+}
+
+static void nested_syncobj_surface_set_acquire_point(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *timeline,
+		uint32_t point_hi, uint32_t point_lo) {
+	set_sync_point(resource, timeline, point_hi, point_lo, true);
+}
+
+static void nested_syncobj_surface_set_release_point(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *timeline,
+		uint32_t point_hi, uint32_t point_lo) {
+	set_sync_point(resource, timeline, point_hi, point_lo, false);
+}
+
+static const struct wp_linux_drm_syncobj_surface_v1_interface syncobj_surface_impl = {
+	.destroy = nested_syncobj_surface_destroy,
+	.set_acquire_point = nested_syncobj_surface_set_acquire_point,
+	.set_release_point = nested_syncobj_surface_set_release_point,
+};
+
+static void nested_syncobj_manager_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+static void nested_syncobj_manager_get_surface(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id, struct wl_resource *surface) {
+	struct forward_surface *forward_surf = wl_resource_get_user_data(surface);
+	/* Each surface has at most one wp_linux_drm_syncobj_surface_v1 associated */
+	if (forward_surf->syncobj_surface) {
+		wl_resource_post_error(resource, WP_LINUX_DRM_SYNCOBJ_MANAGER_V1_ERROR_SURFACE_EXISTS,
+			"syncobj surface already exists");
+		return;
+	}
+
+	struct wl_resource *syncobj_resource = wl_resource_create(client,
+		&wp_linux_drm_syncobj_surface_v1_interface, wl_resource_get_version(resource), id);
+	if (syncobj_resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	/* The upstream object is made with the first commit that has points,
+	 * since the surface may not have a role yet */
+	forward_surf->syncobj_surface = syncobj_resource;
+	wl_resource_set_implementation(syncobj_resource, &syncobj_surface_impl,
+		forward_surf, syncobj_surface_handle_resource_destroy);
+}
+
+static void nested_syncobj_manager_import_timeline(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id, int32_t fd) {
+	struct forward_state *forward = wl_resource_get_user_data(resource);
+	/* Checked here, as an invalid fd would make the compositor disconnect
+	 * swaylock rather than the plugin */
+	uint32_t handle;
+	if (!import_local_syncobj(forward, fd, &handle)) {
+		close(fd);
+		wl_resource_post_error(resource,
+			WP_LINUX_DRM_SYNCOBJ_MANAGER_V1_ERROR_INVALID_TIMELINE,
+			"fd is not a drm syncobj");
+		return;
+	}
+	struct wl_resource *timeline_resource = wl_resource_create(client,
+		&wp_linux_drm_syncobj_timeline_v1_interface, wl_resource_get_version(resource), id);
+	if (timeline_resource == NULL) {
+		close(fd);
+		destroy_local_syncobj(forward, handle);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	struct forward_timeline *timeline = calloc(1, sizeof(*timeline));
+	if (!timeline) {
+		close(fd);
+		destroy_local_syncobj(forward, handle);
+		wl_resource_destroy(timeline_resource);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	count_allocation(forward);
+	timeline->forward = forward;
+	timeline->handle = handle;
+	timeline->refs = 1;
+	timeline->timeline = wp_linux_drm_syncobj_manager_v1_import_timeline(
+		forward->syncobj_manager, fd);
+	close(fd);
+	wl_resource_set_implementation(timeline_resource, &syncobj_timeline_impl,
+		timeline, syncobj_timeline_handle_resource_destroy);
+}
+
+static const struct wp_linux_drm_syncobj_manager_v1_interface syncobj_manager_impl = {
+	.destroy = nested_syncobj_manager_destroy,
+	.get_surface = nested_syncobj_manager_get_surface,
+	.import_timeline = nested_syncobj_manager_import_timeline,
+};
+
+void bind_syncobj_manager(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource = wl_resource_create(client,
+		&wp_linux_drm_syncobj_manager_v1_interface, version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &syncobj_manager_impl, data, NULL);
+}
+
 static void fractional_scale_handle_resource_destroy(struct wl_resource *resource) {
 	assert(wl_resource_instance_of(resource, &wp_fractional_scale_v1_interface, &fractional_scale_impl));
 	struct forward_surface *fwd_surface = wl_resource_get_user_data(resource);
@@ -7,11 +7,29 @@
  *
  * The loop consists of file descriptors and timers. Typically the Wayland
  * display's file descriptor will be one of the fds in the loop.
+ *
+ * It is built on epoll; timers are kept in binary heaps by deadline and by
+ * expiry, with a timerfd armed for the earliest deadline, so adding,
+ * removing and running timers costs O(log n). Timer objects are recycled,
+ * so that in steady state (e.g. repeatedly rescheduling an idle timer) no
+ * memory is allocated.
  */
 
 struct loop;
 struct loop_timer;
 
+/**
+ * Order in which ready fds are dispatched by loop_poll(): high priority fds,
+ * then default priority fds, then expired timers, then low priority fds.
+ * Before each low priority callback, newly ready high priority fds are
+ * handled first.
+ */
+enum loop_priority {
+	LOOP_PRIORITY_HIGH,
+	LOOP_PRIORITY_DEFAULT,
+	LOOP_PRIORITY_LOW,
+};
+
 /**
  * Create an event loop.
  */
@@ -23,23 +41,63 @@ struct loop *loop_create(void);
 void loop_destroy(struct loop *loop);
 
 /**
- * Poll the event loop. This will block until one of the fds has data.
+ * Poll the event loop. This will block until one of the fds has data or a
+ * timer expires.
  */
 void loop_poll(struct loop *loop);
 
 /**
  * Add a file descriptor to the loop.
+ *
+ * `name` identifies the callback in the loop statistics; loop_add_fd()
+ * uses the name of the callback function.
  */
-void loop_add_fd(struct loop *loop, int fd, short mask,
-		void (*func)(int fd, short mask, void *data), void *data);
+void _loop_add_fd(struct loop *loop, int fd, short mask,
+		void (*func)(int fd, short mask, void *data), void *data,
+		const char *name);
+
+#define loop_add_fd(loop, fd, mask, func, data) \
+	_loop_add_fd(loop, fd, mask, func, data, #func)
+
+/**
+ * Change the events (POLLIN, POLLOUT, ...) watched for a file descriptor in
+ * the loop; a mask of 0 suspends it. Returns false if the fd is not in the
+ * loop.
+ */
+bool loop_update_fd(struct loop *loop, int fd, short mask);
+
+/**
+ * Change the dispatch priority of a file descriptor in the loop; fds are
+ * added with LOOP_PRIORITY_DEFAULT. Returns false if the fd is not in the
+ * loop.
+ */
+bool loop_set_fd_priority(struct loop *loop, int fd,
+		enum loop_priority priority);
 
 /**
  * Add a timer to the loop.
  *
- * When the timer expires, the timer will be removed from the loop and freed.
+ * When the timer expires, the timer will be removed from the loop and freed;
+ * any pointers to it must be cleared by the callback.
+ *
+ * The callback runs between `ms` and `ms + slack_ms` milliseconds from now;
+ * within that window it is run at the first wakeup of the loop for any
+ * reason, so that timers with slack can share wakeups.
+ *
+ * `name` identifies the callback in the loop statistics; loop_add_timer()
+ * uses the name of the callback function.
+ *
+ * Timers may be added and removed from any thread; a timer that becomes
+ * the earliest takes effect without waking the loop first.
  */
-struct loop_timer *loop_add_timer(struct loop *loop, int ms,
-		void (*callback)(void *data), void *data);
+struct loop_timer *_loop_add_timer(struct loop *loop, int ms, int slack_ms,
+		void (*callback)(void *data), void *data, const char *name);
+
+#define loop_add_timer(loop, ms, callback, data) \
+	_loop_add_timer(loop, ms, 0, callback, data, #callback)
+
+#define loop_add_timer_slack(loop, ms, slack_ms, callback, data) \
+	_loop_add_timer(loop, ms, slack_ms, callback, data, #callback)
 
 /**
  * Remove a file descriptor from the loop.
@@ -47,8 +105,39 @@ struct loop_timer *loop_add_timer(struct loop *loop, int ms,
 bool loop_remove_fd(struct loop *loop, int fd);
 
 /**
- * Remove a timer from the loop.
+ * Remove a timer from the loop. Returns false if the timer has already
+ * expired.
  */
 bool loop_remove_timer(struct loop *loop, struct loop_timer *timer);
 
+/**
+ * Set functions to take and release a lock shared with another thread;
+ * loop_poll() holds it while running callbacks, except those of fds marked
+ * with loop_set_fd_unlocked(). Either may be NULL.
+ *
+ * The other thread may then call loop functions while holding the lock;
+ * fds may only be added, removed or changed with it held.
+ */
+void loop_set_lock_hooks(struct loop *loop, void (*lock)(void *data),
+		void (*unlock)(void *data), void *data);
+
+/**
+ * Run the callback for a file descriptor without the lock set with
+ * loop_set_lock_hooks(); the callback must take it itself where needed.
+ * Returns false if the fd is not in the loop.
+ */
+bool loop_set_fd_unlocked(struct loop *loop, int fd);
+
+/**
+ * Start recording, for each fd and timer callback, the number of invocations,
+ * the time spent in it, and for timers how late they ran compared with their
+ * expiry. Off by default, as it costs two clock reads per callback.
+ */
+void loop_enable_stats(struct loop *loop);
+
+/**
+ * Print the recorded statistics, with histograms, to stderr.
+ */
+void loop_print_stats(struct loop *loop);
+
 #endif
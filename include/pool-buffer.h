@@ -15,6 +15,8 @@ struct pool_buffer {
 	bool busy;
 };
 
+/* Open a new, unlinked shared memory file; returns -1 on failure */
+int anonymous_shm_open(void);
 struct pool_buffer *create_buffer(struct wl_shm *shm, struct pool_buffer *buf,
 	int32_t width, int32_t height, uint32_t format);
 struct pool_buffer *get_next_buffer(struct wl_shm *shm,
@@ -0,0 +1,43 @@
+#ifndef _SWAYLOCK_REGION_H
+#define _SWAYLOCK_REGION_H
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A set of rectangles with non-negative coordinates, used to accumulate
+ * damage. Adding a rectangle merges it with any it overlaps or exactly
+ * adjoins, when the bounding box of the two wastes no more area than they
+ * share, so that the region stays small; the result covers at least the
+ * union of everything added.
+ *
+ * Storage is kept when the region is cleared, so that a region reused for
+ * every frame stops allocating once it has reached its working size.
+ */
+
+struct region_rect {
+	int32_t x, y, width, height;
+};
+
+struct region {
+	struct region_rect *rects;
+	size_t len, capacity;
+};
+
+void region_init(struct region *region);
+
+void region_finish(struct region *region);
+
+/**
+ * Remove all rectangles, keeping the allocated storage.
+ */
+void region_clear(struct region *region);
+
+/**
+ * Add a rectangle to the region. Parts with negative coordinates are clipped
+ * away. If the region would then have more than `max_rects` rectangles, it is
+ * collapsed to its bounding box.
+ */
+void region_add(struct region *region, int32_t x, int32_t y,
+	int32_t width, int32_t height, size_t max_rects);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef _SWAYLOCK_SLAB_H
+#define _SWAYLOCK_SLAB_H
+#include <stddef.h>
+
+/**
+ * A fixed-size object allocator. Objects are carved out of larger chunks and
+ * recycled through a free list, so that once the slab has grown to its
+ * working set size, allocating and freeing objects does not touch the heap.
+ * Chunks are only returned to the system by slab_finish().
+ */
+
+struct slab_chunk;
+
+struct slab {
+	size_t object_size;
+	size_t objects_per_chunk;
+	void *free_list;
+	struct slab_chunk *chunks;
+	/* Number of chunks allocated so far; each one is a heap allocation */
+	size_t chunk_count;
+};
+
+void slab_init(struct slab *slab, size_t object_size, size_t objects_per_chunk);
+
+/**
+ * Return all chunks to the system. All objects allocated from the slab
+ * become invalid.
+ */
+void slab_finish(struct slab *slab);
+
+/**
+ * Allocate a zero-initialized object, or return NULL on allocation failure.
+ */
+void *slab_alloc(struct slab *slab);
+
+/**
+ * Return an object to the slab. Only the first pointer-sized bytes of the
+ * object are overwritten; `object` may be NULL.
+ */
+void slab_free(struct slab *slab, void *object);
+
+#endif
@@ -7,11 +7,18 @@
 #include "background-image.h"
 #include "cairo.h"
 #include "pool-buffer.h"
+#include "region.h"
+#include "slab.h"
 #include "seat.h"
 #include "linux-dmabuf-unstable-v1-client-protocol.h"
 #include "wayland-drm-client-protocol.h"
 #include "fractional-scale-v1-client-protocol.h"
 #include "viewporter-client-protocol.h"
+#include "single-pixel-buffer-v1-client-protocol.h"
+#include "presentation-time-client-protocol.h"
+#include "fifo-v1-client-protocol.h"
+#include "linux-drm-syncobj-v1-client-protocol.h"
+#include "commit-timing-v1-client-protocol.h"
 #include "color-management-v1-client-protocol.h"
 #include "color-representation-v1-client-protocol.h"
 
@@ -78,10 +85,23 @@ struct swaylock_args {
 	bool indicator_idle_visible;
 	char *plugin_command;
 	bool plugin_per_output;
+	/* beyond this many rectangles, forwarded damage becomes one box */
+	uint32_t max_damage_rects;
+	/* handle plugin clients on a separate thread */
+	bool nested_thread;
+	/* copy plugin shm buffers into swaylock's own upstream buffers */
+	bool shadow_buffers;
+	/* hold plugin commits until the compositor has shown the last one */
+	bool mailbox;
+	/* offer one output per group of identical outputs, and show the
+	 * plugin surface for it on all of them */
+	bool mirror;
 	/* negative values = no grace; unit: seconds */
 	float grace_time;
 	/* max number of pixels/sec mouse motion which will be ignored */
 	float grace_pointer_hysteresis;
+	/* record per-callback timing in the event loop */
+	bool loop_stats;
 };
 
 struct swaylock_password {
@@ -118,12 +138,19 @@ struct swaylock_bg_server {
 	struct wl_event_loop *loop;
 	struct wl_global *wlr_layer_shell;
 	struct wl_global *compositor;
+	struct wl_global *subcompositor;
 	struct wl_global *shm;
 	struct wl_global *xdg_output_manager;
+	struct wl_global *xdg_wm_base;
 	struct wl_global *zwp_linux_dmabuf;
 	struct wl_global *drm;
 	struct wl_global *wp_fractional_scale;
 	struct wl_global *wp_viewporter;
+	struct wl_global *wp_single_pixel_buffer_manager;
+	struct wl_global *wp_presentation;
+	struct wl_global *wp_fifo_manager;
+	struct wl_global *wp_commit_timing_manager;
+	struct wl_global *wp_linux_drm_syncobj_manager;
 	struct wl_global *data_device_manager;
 	struct wl_global *wp_color_manager;
 	struct wl_global *wp_color_representation_manager;
@@ -159,6 +186,17 @@ struct dmabuf_feedback_state  {
 	size_t tranches_len;
 };
 
+/* Feedback from an upstream zwp_linux_dmabuf_feedback_v1 object, and the
+ * plugin feedback resources it is forwarded to */
+struct dmabuf_feedback_receiver {
+	struct dmabuf_feedback_state current, pending;
+	struct feedback_tranche pending_tranche;
+	/* list of wl_resources to send `current` to when it is updated */
+	struct wl_list instances;
+	/* has a complete set of feedback been received */
+	bool done;
+};
+
 struct color_coef_range {
 	uint32_t coefficients;
 	uint32_t range;
@@ -179,21 +217,50 @@ struct forward_state {
 	/* these pointers are copies of those in swaylock_state */
 	struct wl_display *upstream_display;
 	struct wl_registry *upstream_registry;
+	/* With --nested-thread, the globals below are replaced by proxy
+	 * wrappers, so that all upstream objects made for plugins have their
+	 * events go to this queue, which the nested server thread dispatches */
+	struct wl_event_queue *queue;
+
+	/* copy of swaylock_args::max_damage_rects */
+	size_t max_damage_rects;
+	/* copy of swaylock_args::shadow_buffers */
+	bool shadow_buffers;
+	/* copy of swaylock_args::mailbox */
+	bool mailbox;
+	/* copy of swaylock_state::eventloop, for --max-fps pacing timers */
+	struct loop *eventloop;
+
+	/* allocators for per-buffer objects */
+	struct slab buffer_slab; // struct forward_buffer
+	struct slab params_slab; // struct forward_params
+	struct slab feedback_slab; // struct forward_presentation_feedback
+	/* heap allocations made by the forwarding code (not by libwayland),
+	 * logged periodically in debug mode to check that steady state
+	 * commits do not allocate */
+	uint64_t allocations;
+	uint32_t commits_since_report;
 
 	struct wl_drm *drm;
 	struct wl_shm *shm;
 	/* this instance is used just for forwarding */
 	struct zwp_linux_dmabuf_v1 *linux_dmabuf;
-	/* list of wl_resources corresponding to (default/surface) feedback instances
-	 * that should get updated when the upstream feedback is updated */
-	struct wl_list feedback_instances;
-	/* We only let the background generator create surfaces, but not
-	 * subsurfaces, because those are much trickier to implement correctly,
-	 * and a well designed background shouldn't need them anyway. */
 	struct wl_compositor *compositor;
+	/* plugin subsurfaces are made into upstream subsurfaces */
+	struct wl_subcompositor *subcompositor;
 
 	struct wp_viewporter *viewporter;
+	/* may be null; single pixel buffers are then made from shm */
+	struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager;
 	struct wp_fractional_scale_manager_v1 *fractional_scale;
+	struct wp_presentation *presentation;
+	uint32_t presentation_version;
+	/* from wp_presentation::clock_id; valid once received */
+	uint32_t presentation_clock_id;
+	bool presentation_clock_id_done;
+	struct wp_fifo_manager_v1 *fifo_manager;
+	struct wp_commit_timing_manager_v1 *commit_timing_manager;
+	struct wp_linux_drm_syncobj_manager_v1 *syncobj_manager;
 
 	struct wp_color_manager_v1 *color_management; // latest version
 	struct wp_color_representation_manager_v1 *color_representation;
@@ -201,11 +268,23 @@ struct forward_state {
 	uint32_t *shm_formats;
 	size_t shm_formats_len;
 
+	/* from the upstream wl_drm, if any */
+	char *drm_device;
+	uint32_t *drm_formats;
+	size_t drm_formats_len;
+	/* render node sent to clients of the nested wl_drm; null if none was
+	 * found, in which case wl_drm is not offered */
+	char *drm_render_node;
+	/* drm_render_node opened to check the plugins' drm syncobj timelines,
+	 * and to signal points the compositor will not; -1 if not open */
+	int drm_fd;
+
 	struct dmabuf_modifier_pair *dmabuf_formats;
 	size_t dmabuf_formats_len;
 
-	struct dmabuf_feedback_state current, pending;
-	struct feedback_tranche pending_tranche;
+	/* the default feedback; also used for surfaces without a role, or
+	 * whose own feedback has not arrived yet */
+	struct dmabuf_feedback_receiver default_feedback;
 
 	/* True once wp_color_representation_manager_v1::done is received */
 	bool color_representation_done;
@@ -245,21 +324,37 @@ struct forward_state {
 	struct wl_list color_feedback_resources;
 };
 
-struct damage_record {
-	int32_t x,y,w,h;
+struct forward_shm_pool;
+
+/* A wp_linux_drm_syncobj_surface_v1 acquire or release point; the timeline
+ * is null if no point is set */
+struct syncobj_point {
+	struct forward_timeline *timeline;
+	uint32_t point_hi, point_lo;
 };
 
 struct forward_buffer {
+	struct forward_state *forward;
 	/* may be null if plugin program deleted it */
 	struct wl_resource *resource;
-	/* upstream buffer */
+	/* upstream buffer; null for shadowed shm buffers */
 	struct wl_buffer *buffer;
+	/* for shadowed shm buffers, the locally mapped pool and the layout
+	 * of the buffer in it */
+	struct forward_shm_pool *shm_pool;
+	int32_t offset, stride;
+	uint32_t format;
 	/* list of surfaces where buffer is pending */
 	struct wl_list pending_surfaces;
 	/* list of surfaces where buffer is committed */
 	struct wl_list committed_surfaces;
 	/* dimensions of the buffer */
 	uint32_t width, height;
+	/* made with linux-dmabuf, so usable with explicit synchronization */
+	bool dmabuf;
+	/* with explicit synchronization, the release point of the last upstream
+	 * commit of this buffer, held until the compositor releases it */
+	struct syncobj_point release;
 };
 /* BUFFER_UNREACHABLE is used for the committed buffer it it was been deleted
  * downstream
@@ -370,6 +465,11 @@ struct surface_state {
 	struct wl_list image_desc_link;
 };
 
+/* Maximum number of unacknowledged configures remembered per surface; if a
+ * plugin falls further behind than this, newer configures are coalesced
+ * until it catches up, so every serial it was sent stays valid */
+#define SERIAL_RING_CAPACITY 32
+
 struct serial_pair {
 	uint32_t plugin_serial;
 	uint32_t upstream_serial;
@@ -383,21 +483,72 @@ struct serial_pair {
 	bool local_only;
 };
 
+/* wp_fifo_v1 and wp_commit_timer_v1 requests, which apply to a single commit */
+struct commit_timing_state {
+	bool fifo_barrier, fifo_wait;
+	bool has_timestamp;
+	uint32_t tv_sec_hi, tv_sec_lo, tv_nsec;
+};
+
+/* A wl_region request; regions are kept as the list of these, so that they
+ * can be rebuilt exactly upstream */
+struct region_op {
+	bool subtract;
+	int32_t x, y, width, height;
+};
+
+struct region_ops {
+	struct region_op *ops;
+	size_t len, capacity;
+};
+
+/* Number of upstream buffers per surface used with --shadow-buffers */
+#define SHADOW_BUFFER_COUNT 2
+
+/* An upstream shm buffer owned by swaylock, into which the contents of
+ * plugin buffers are copied */
+struct shadow_buffer {
+	struct forward_surface *surface;
+	struct wl_buffer *buffer;
+	void *data;
+	size_t size;
+	int32_t width, height, stride;
+	uint32_t format;
+	/* attached upstream and not yet released */
+	bool busy;
+	/* plugin damage not yet copied into this buffer, in buffer coordinates */
+	struct region stale;
+};
+
+struct forward_subsurface;
+
 /* this is a resource associated to a downstream wl_surface */
 struct forward_surface {
+	struct wl_resource *resource;
 	bool has_been_configured;
 	struct wl_resource *layer_surface; // downstream only
+	/* set instead of layer_surface when the plugin uses xdg-shell */
+	struct wl_resource *xdg_surface, *xdg_toplevel; // downstream only
 
 	/* Used to look up global properties like default parametric image description */
 	struct forward_state *state;
 
 	/* is null until get_layer_surface is called and initializes this */
 	struct swaylock_surface *sway_surface;
+	/* set instead of sway_surface if the surface is a plugin subsurface */
+	struct forward_subsurface *subsurface;
+	/* subsurfaces with this surface as parent; links are forward_subsurface::link */
+	struct wl_list subsurfaces;
 	// set after layer surface is destroyed
 	bool inert;
 
 	/* list of callbacks for wl_surface::frame */
 	struct wl_list frame_callbacks;
+	/* wp_presentation_feedback resources requested for the next commit, and
+	 * those of the last commit, not yet forwarded upstream; the links are
+	 * forward_presentation_feedback::link */
+	struct wl_list pending_feedbacks;
+	struct wl_list queued_feedbacks;
 
 	// double-buffered state
 	struct surface_state pending;
@@ -406,16 +557,55 @@ struct forward_surface {
 	uint32_t committed_buffer_width;
 	uint32_t committed_buffer_height;
 
+	/* the opaque region for the next commit; applied upstream if changed */
+	struct region_ops pending_opaque;
+	bool opaque_changed;
+	/* the opaque region as of the last commit, also given to mirrors */
+	struct region_ops committed_opaque;
+
 	/* damage is not, strictly speaking, double buffered */
-	struct damage_record *buffer_damage;
-	size_t buffer_damage_len;
-	struct damage_record *old_damage;
-	size_t old_damage_len;
+	struct region buffer_damage;
+	/* from wl_surface::damage; converted to buffer damage on commit */
+	struct region surface_damage;
 
 	uint32_t last_used_plugin_serial;
 	uint32_t last_acked_width, last_acked_height;
-	struct serial_pair *serial_table;
-	size_t serial_table_len;
+	/* ring of configures sent to the plugin and not yet acknowledged,
+	 * oldest first; starts at serial_ring[serial_ring_start] */
+	struct serial_pair serial_ring[SERIAL_RING_CAPACITY];
+	size_t serial_ring_start, serial_ring_len;
+	/* upstream configures arrived while one sent to the plugin was not yet
+	 * acknowledged; the newest is sent once it is */
+	bool configure_coalesced;
+
+	struct shadow_buffer shadow[SHADOW_BUFFER_COUNT];
+	/* the committed plugin buffer is a shadowed shm buffer */
+	bool shadow_active;
+	/* plugin contents or damage not yet copied into a shadow buffer */
+	bool shadow_dirty;
+	/* the upstream commit waits for a shadow buffer to be released, this
+	 * surface's own or that of a synchronized subsurface */
+	bool shadow_deferred;
+
+	/* --max-fps pacing; times are CLOCK_MONOTONIC milliseconds */
+	int64_t last_frame_done_ms, last_upstream_commit_ms;
+	/* timestamp of the last upstream frame callback, and when it arrived */
+	uint32_t frame_done_time;
+	int64_t frame_done_received_ms;
+	/* delays frame callbacks / the upstream commit, if armed */
+	struct loop_timer *frame_timer;
+	struct loop_timer *deferred_commit_timer;
+	/* the outstanding upstream frame callback, if any; at most one is
+	 * requested at a time */
+	struct wl_callback *upstream_frame;
+	/* --mailbox: a plugin commit is held back until upstream_frame arrives */
+	bool mailbox_deferred;
+	/* --mirror: damage and changes to surface state sent upstream since
+	 * the last upstream commit, to repeat on the mirroring outputs */
+	struct region mirror_damage;
+	bool mirror_state_changed;
+	/* the shadow buffer last attached upstream */
+	struct shadow_buffer *shown_shadow;
 
 	/* The unique viewport resource attached to the surface, if any */
 	struct wl_resource *viewport;
@@ -428,6 +618,23 @@ struct forward_surface {
 
 	/* The unique color representation resource attached to the surface, if any */
 	struct wl_resource *color_representation;
+
+	/* The unique fifo and commit timer resources attached to the surface, if any */
+	struct wl_resource *fifo;
+	struct wl_resource *commit_timing;
+	/* requests made for the next commit, and those of plugin commits that
+	 * were merged and not yet forwarded upstream */
+	struct commit_timing_state pending_timing;
+	struct commit_timing_state unsent_timing;
+
+	/* The unique drm syncobj surface resource attached to the surface, if any */
+	struct wl_resource *syncobj_surface;
+	/* points for the buffer of the next commit */
+	struct syncobj_point pending_acquire, pending_release;
+	/* a plugin buffer was attached since the last commit */
+	bool buffer_attached;
+	/* the upstream surface has a release point that was not yet committed */
+	bool release_point_unsent;
 };
 
 struct swaylock_state {
@@ -436,12 +643,18 @@ struct swaylock_state {
 	struct loop_timer *auth_idle_timer; // timer to stop displaying AUTH_STATE_INVALID
 	struct loop_timer *clear_password_timer;  // clears the password buffer
 	struct wl_display *display;
+	/* With --nested-thread, seats, keyboards and pointers have their events
+	 * go to this queue, which the main thread dispatches without taking the
+	 * lock shared with the nested server thread */
+	struct wl_event_queue *input_queue;
 	struct wl_compositor *compositor;
 	struct wl_subcompositor *subcompositor;
 	struct wl_shm *shm;
+	struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager;
 	struct zwp_linux_dmabuf_feedback_v1 *dmabuf_default_feedback;
 	struct wl_list surfaces;
 	struct wl_list images;
+	struct wl_list fps_limits;
 	struct swaylock_args args;
 	struct swaylock_password password;
 	struct swaylock_xkb xkb;
@@ -452,6 +665,8 @@ struct swaylock_state {
 	uint32_t highlight_start; // position of highlight; 2048 = 1 full turn
 	int failed_attempts;
 	bool run_display, locked;
+	/* the last flush to the compositor could not write everything */
+	bool upstream_congested;
 	struct ext_session_lock_manager_v1 *ext_session_lock_manager_v1;
 	struct ext_session_lock_v1 *ext_session_lock_v1;
 	struct zxdg_output_manager_v1 *zxdg_output_manager;
@@ -485,7 +700,22 @@ struct swaylock_surface {
 	struct wp_color_management_surface_v1 *color_surface;
 	struct wp_color_management_output_v1 *color_output;
 	struct wp_image_description_v1 *color_output_description;
+	/* created when a plugin first uses fifo-v1 / commit-timing-v1, and
+	 * shared by later plugin surfaces, as only one may exist per surface */
+	struct wp_fifo_v1 *fifo;
+	struct wp_commit_timer_v1 *commit_timer;
+	/* upstream per-surface dmabuf feedback, forwarded to the plugin's
+	 * get_surface_feedback objects for its surface */
+	struct zwp_linux_dmabuf_feedback_v1 *dmabuf_feedback;
+	struct dmabuf_feedback_receiver dmabuf_surface_feedback;
+	/* exists while a plugin surface uses explicit synchronization; every
+	 * buffer attached meanwhile needs acquire and release points */
+	struct wp_linux_drm_syncobj_surface_v1 *syncobj_surface;
 	uint32_t last_fractional_scale; /* is zero if nothing received yet */
+	/* from wl_surface v6 events; the scale is zero if nothing received yet */
+	int32_t preferred_buffer_scale;
+	uint32_t preferred_buffer_transform;
+	bool has_preferred_buffer_transform;
 	struct pool_buffer indicator_buffers[2];
 	bool created;
 	bool dirty;
@@ -504,6 +734,14 @@ struct swaylock_surface {
 	struct image_description_state output_desc;
 
 	struct wl_global *nested_server_output;
+	/* --mirror: the output whose plugin surface is shown on this one, in
+	 * which case nested_server_output is null; and the outputs mirroring
+	 * this one, linked by mirror_link */
+	struct swaylock_surface *mirror_of;
+	struct wl_list mirrors;
+	struct wl_list mirror_link;
+	/* the mirror has not yet been given the plugin surface state */
+	bool mirror_stale;
 	// lists of associated resources
 	struct wl_list nested_server_wl_output_resources;
 	struct wl_list nested_server_xdg_output_resources;
@@ -528,6 +766,14 @@ struct swaylock_surface {
 	/* has a buffer been attached and committed */
 	bool has_buffer;
 
+	/* solid background buffer for clientless mode, scaled to the surface size
+	 * by the viewport; either a single-pixel buffer or the 1x1 fallback_shm */
+	struct wl_buffer *fallback_buffer;
+	struct pool_buffer fallback_shm;
+
+	/* minimum time between plugin frames from --max-fps; 0 if unlimited */
+	int min_frame_interval_ms;
+
 	/* If not NULL, the client which provides surfaces for this surface.
 	 * If NULL, server.main_client will do so */
 	struct swaylock_bg_client *client;
@@ -553,10 +799,16 @@ struct swaylock_surface {
  * to crash swaylock than to crash the compositor.
  */
 void bind_wl_compositor(struct wl_client *client, void *data, uint32_t version, uint32_t id);
+void bind_subcompositor(struct wl_client *client, void *data, uint32_t version, uint32_t id);
 void bind_wl_shm(struct wl_client *client, void *data, uint32_t version, uint32_t id);
 void bind_linux_dmabuf(struct wl_client *client, void *data, uint32_t version, uint32_t id);
 void bind_drm(struct wl_client *client, void *data, uint32_t version, uint32_t id);
 void bind_viewporter(struct wl_client *client, void *data, uint32_t version, uint32_t id);
+void bind_single_pixel_buffer_manager(struct wl_client *client, void *data, uint32_t version, uint32_t id);
+void bind_presentation(struct wl_client *client, void *data, uint32_t version, uint32_t id);
+void bind_fifo_manager(struct wl_client *client, void *data, uint32_t version, uint32_t id);
+void bind_commit_timing_manager(struct wl_client *client, void *data, uint32_t version, uint32_t id);
+void bind_syncobj_manager(struct wl_client *client, void *data, uint32_t version, uint32_t id);
 void bind_fractional_scale(struct wl_client *client, void *data, uint32_t version, uint32_t id);
 void bind_color_manager(struct wl_client *client, void *data, uint32_t version, uint32_t id);
 void bind_color_representation_manager(struct wl_client *client, void *data, uint32_t version, uint32_t id);
@@ -565,8 +817,38 @@ void send_dmabuf_feedback_data(struct wl_resource *feedback, const struct dmabuf
  * used when clients unnecessarily require specific interfaces to run. */
 void bind_wl_data_device_manager(struct wl_client *client, void *data, uint32_t version, uint32_t id);
 
-/* Listeners to record upstream info broadcasts; take &forward_state */
+/* Set up the lists and allocators of a zero-initialized forward_state */
+void init_forward_state(struct forward_state *forward);
+
+/* Set up or release a dmabuf_feedback_receiver; use with dmabuf_feedback_listener.
+ * Finishing moves the remaining resources to `fallback` */
+void init_dmabuf_feedback_receiver(struct dmabuf_feedback_receiver *receiver);
+void finish_dmabuf_feedback_receiver(struct dmabuf_feedback_receiver *receiver,
+	struct dmabuf_feedback_receiver *fallback);
+/* Switch the plugin's get_surface_feedback objects for the surface over to
+ * the feedback of the swaylock surface it was assigned to */
+void adopt_surface_dmabuf_feedback(struct forward_surface *surface);
+/* Create the upstream subsurfaces for the plugin subsurfaces of a surface
+ * which was just assigned to a swaylock surface */
+void create_upstream_subsurfaces(struct forward_surface *surface);
+/* Undo the above, and reset the surface to its initial unmapped state, when
+ * its role object is destroyed; it must still be assigned */
+void unmap_plugin_surface(struct forward_surface *surface);
+/* Send the preferred buffer scale and transform of the surface's output, if known */
+void send_preferred_buffer_state(struct forward_surface *surface);
+/* --mirror: show the current plugin contents of the mirrored output on a
+ * newly configured mirror, acknowledging its configure */
+void refresh_mirror(struct swaylock_surface *mirror);
+
+/* Set forward_state::drm_render_node from the upstream wl_drm device, or else
+ * from the main device of the default dmabuf feedback */
+void resolve_drm_render_node(struct forward_state *forward);
+
+/* Listeners to record upstream info broadcasts; take &forward_state, except
+ * dmabuf_feedback_listener, which takes a dmabuf_feedback_receiver */
 extern const struct wl_shm_listener shm_listener;
+extern const struct wl_drm_listener drm_listener;
+extern const struct wp_presentation_listener presentation_listener;
 extern const struct zwp_linux_dmabuf_v1_listener linux_dmabuf_listener;
 extern const struct zwp_linux_dmabuf_feedback_v1_listener dmabuf_feedback_listener;
 extern const struct wp_color_manager_v1_listener color_manager_listener;
@@ -584,6 +866,14 @@ uint32_t color_identity_v2_to_v1(uint32_t identity_hi, uint32_t identity_lo);
  * If local_only=true, mark that the downstream serial does _not_ need forwarding. */
 void add_serial_pair(struct forward_surface *surf, uint32_t upstream_serial,
 	uint32_t downstream_serial, uint32_t width, uint32_t height, bool local_only);
+/* Look up the entry for the configure with the given plugin serial, and discard
+ * it and all older entries. Returns false if the serial is not known. */
+bool take_serial_pair(struct forward_surface *surf, uint32_t plugin_serial,
+	struct serial_pair *entry);
+/* Send a configure or close to the plugin surface's layer surface or xdg_toplevel */
+void send_plugin_configure(struct forward_surface *surface, uint32_t serial,
+	uint32_t width, uint32_t height);
+void send_plugin_closed(struct forward_surface *surface);
 
 // There is exactly one swaylock_image for each -i argument
 struct swaylock_image {
@@ -593,6 +883,13 @@ struct swaylock_image {
 	struct wl_list link;
 };
 
+// There is at most one swaylock_fps_limit per output given to --max-fps
+struct swaylock_fps_limit {
+	char *output_name;
+	float fps;
+	struct wl_list link;
+};
+
 void swaylock_handle_key(struct swaylock_state *state,
 		xkb_keysym_t keysym, uint32_t codepoint);
 
@@ -1,151 +1,597 @@
+#include <errno.h>
 #include <limits.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include "log.h"
 #include "loop.h"
+#include "slab.h"
+
+/* Maximum number of fd events handled per call to epoll_wait */
+#define LOOP_MAX_EVENTS 16
+/* Timers are allocated in groups of this size */
+#define LOOP_TIMERS_PER_CHUNK 32
+/* Histogram bucket i > 0 covers [2^(i-1), 2^i) microseconds; the last
+ * bucket is open ended */
+#define LOOP_STATS_BUCKETS 18
+/* Timer slack for the process's own blocking calls; see loop_create() */
+#define LOOP_PROCESS_TIMER_SLACK_NS 1000000
+/* Interval over which the wakeup rate is measured */
+#define LOOP_WAKEUP_PERIOD_NS 60000000000LL
 
 struct loop_fd_event {
 	void (*callback)(int fd, short mask, void *data);
 	void *data;
+	const char *name;
+	int fd;
+	enum loop_priority priority;
+	/* run without the lock hooks; see loop_set_fd_unlocked() */
+	bool unlocked;
 	bool removed;
-	struct wl_list link; // struct loop_fd_event::link
+	struct wl_list link; // struct loop::removed_fd_events, once removed
+};
+
+/* Armed timers are kept in two binary min-heaps, ordered by: */
+enum timer_order {
+	/* deadline, to program the timerfd for the first one */
+	TIMER_BY_DEADLINE,
+	/* expiry, to find the timers which may run at a wakeup */
+	TIMER_BY_EXPIRY,
+	TIMER_ORDER_COUNT,
 };
 
 struct loop_timer {
+	/* first field is overwritten by the slab free list once released */
 	void (*callback)(void *data);
 	void *data;
-	struct timespec expiry;
-	bool removed;
-	struct wl_list link; // struct loop_timer::link
+	const char *name;
+	/* The timer may fire anywhere in [expiry, deadline], where
+	 * deadline = expiry + slack */
+	struct timespec expiry, deadline;
+	/* index in each of loop::timer_heap, or -1 if the timer is no longer
+	 * armed */
+	int heap_index[TIMER_ORDER_COUNT];
+};
+
+struct loop_callback_stats {
+	const char *name;
+	bool is_timer;
+	uint64_t calls;
+	uint64_t total_ns, max_ns;
+	uint64_t duration_hist[LOOP_STATS_BUCKETS];
+	/* timers only: delay between expiry and the start of the callback */
+	uint64_t total_late_ns, max_late_ns;
+	uint64_t lateness_hist[LOOP_STATS_BUCKETS];
 };
 
 struct loop {
-	struct pollfd *fds;
-	int fd_length;
-	int fd_capacity;
+	int epoll_fd;
+	int timer_fd;
+
+	/* fd events, indexed by file descriptor */
+	struct loop_fd_event **fd_events;
+	int fd_events_len;
+	/* removed fd events, which are freed once no longer being dispatched */
+	struct wl_list removed_fd_events; // struct loop_fd_event::link
+
+	/* guards the timers and timer_fd state below, which other threads
+	 * may change while loop_poll() waits or runs unlocked callbacks */
+	pthread_mutex_t timer_mutex;
+	/* binary min-heaps of armed timers, see enum timer_order; both hold
+	 * the same timers */
+	struct loop_timer **timer_heap[TIMER_ORDER_COUNT];
+	int timer_heap_len;
+	int timer_heap_capacity;
+	struct slab timer_slab;
+
+	/* the deadline currently programmed into timer_fd, if any */
+	bool timer_fd_armed;
+	struct timespec timer_fd_deadline;
+
+	/* wakeups counted since period_start, and the rate over the last
+	 * complete period */
+	struct timespec period_start;
+	uint64_t period_wakeups;
+	double wakeups_per_minute;
+
+	/* called around callbacks, if set; see loop_set_lock_hooks() */
+	void (*lock)(void *data);
+	void (*unlock)(void *data);
+	void *lock_data;
 
-	struct wl_list fd_events; // struct loop_fd_event::link
-	struct wl_list timers; // struct loop_timer::link
+	bool stats_enabled;
+	struct timespec stats_start;
+	uint64_t stats_wakeups;
+	struct loop_callback_stats *stats;
+	size_t stats_len, stats_capacity;
 };
 
+static bool timespec_less(const struct timespec *a, const struct timespec *b) {
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static int64_t timespec_diff_ns(const struct timespec *a, const struct timespec *b) {
+	return (int64_t)(a->tv_sec - b->tv_sec) * 1000000000 + (a->tv_nsec - b->tv_nsec);
+}
+
+static void timespec_add_ns(struct timespec *t, int64_t ns) {
+	t->tv_sec += ns / 1000000000;
+	t->tv_nsec += ns % 1000000000;
+	if (t->tv_nsec >= 1000000000) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000;
+	}
+}
+
+static void hist_add(uint64_t hist[static LOOP_STATS_BUCKETS], uint64_t ns) {
+	uint64_t us = ns / 1000;
+	int bucket = 0;
+	while (us > 0 && bucket < LOOP_STATS_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	hist[bucket]++;
+}
+
+static void record_call(struct loop *loop, const char *name, bool is_timer,
+		const struct timespec *expiry, const struct timespec *start,
+		const struct timespec *end) {
+	struct loop_callback_stats *stats = NULL;
+	for (size_t i = 0; i < loop->stats_len; i++) {
+		if (loop->stats[i].is_timer == is_timer &&
+				(loop->stats[i].name == name ||
+				 strcmp(loop->stats[i].name, name) == 0)) {
+			stats = &loop->stats[i];
+			break;
+		}
+	}
+	if (!stats) {
+		if (loop->stats_len == loop->stats_capacity) {
+			size_t new_capacity = loop->stats_capacity > 0 ?
+				2 * loop->stats_capacity : 16;
+			struct loop_callback_stats *new_stats = realloc(loop->stats,
+				sizeof(struct loop_callback_stats) * new_capacity);
+			if (!new_stats) {
+				return;
+			}
+			loop->stats = new_stats;
+			loop->stats_capacity = new_capacity;
+		}
+		stats = &loop->stats[loop->stats_len++];
+		memset(stats, 0, sizeof(*stats));
+		stats->name = name;
+		stats->is_timer = is_timer;
+	}
+
+	uint64_t duration = timespec_diff_ns(end, start);
+	stats->calls++;
+	stats->total_ns += duration;
+	if (duration > stats->max_ns) {
+		stats->max_ns = duration;
+	}
+	hist_add(stats->duration_hist, duration);
+	if (is_timer) {
+		int64_t late = timespec_diff_ns(start, expiry);
+		uint64_t lateness = late > 0 ? (uint64_t)late : 0;
+		stats->total_late_ns += lateness;
+		if (lateness > stats->max_late_ns) {
+			stats->max_late_ns = lateness;
+		}
+		hist_add(stats->lateness_hist, lateness);
+	}
+}
+
+static uint32_t poll_to_epoll_mask(short mask) {
+	uint32_t events = 0;
+	if (mask & POLLIN) {
+		events |= EPOLLIN;
+	}
+	if (mask & POLLOUT) {
+		events |= EPOLLOUT;
+	}
+	if (mask & POLLPRI) {
+		events |= EPOLLPRI;
+	}
+	return events;
+}
+
+static short epoll_to_poll_mask(uint32_t events) {
+	short mask = 0;
+	if (events & EPOLLIN) {
+		mask |= POLLIN;
+	}
+	if (events & EPOLLOUT) {
+		mask |= POLLOUT;
+	}
+	if (events & EPOLLPRI) {
+		mask |= POLLPRI;
+	}
+	if (events & EPOLLERR) {
+		mask |= POLLERR;
+	}
+	if (events & EPOLLHUP) {
+		mask |= POLLHUP;
+	}
+	return mask;
+}
+
 struct loop *loop_create(void) {
 	struct loop *loop = calloc(1, sizeof(struct loop));
 	if (!loop) {
 		swaylock_log(LOG_ERROR, "Unable to allocate memory for loop");
 		return NULL;
 	}
-	loop->fd_capacity = 10;
-	loop->fds = malloc(sizeof(struct pollfd) * loop->fd_capacity);
-	wl_list_init(&loop->fd_events);
-	wl_list_init(&loop->timers);
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd == -1) {
+		swaylock_log_errno(LOG_ERROR, "Unable to create epoll instance");
+		free(loop);
+		return NULL;
+	}
+	loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (loop->timer_fd == -1) {
+		swaylock_log_errno(LOG_ERROR, "Unable to create timerfd");
+		close(loop->epoll_fd);
+		free(loop);
+		return NULL;
+	}
+	/* The timerfd is the only registered fd with no loop_fd_event */
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &ev) == -1) {
+		swaylock_log_errno(LOG_ERROR, "Unable to watch timerfd");
+		close(loop->timer_fd);
+		close(loop->epoll_fd);
+		free(loop);
+		return NULL;
+	}
+
+	wl_list_init(&loop->removed_fd_events);
+	pthread_mutex_init(&loop->timer_mutex, NULL);
+	slab_init(&loop->timer_slab, sizeof(struct loop_timer), LOOP_TIMERS_PER_CHUNK);
+	clock_gettime(CLOCK_MONOTONIC, &loop->period_start);
+
+#ifdef __linux__
+	/* Let the kernel batch any other timed waits of this process with
+	 * nearby wakeups. (timerfd expiries are not subject to this; the
+	 * loop applies per-timer slack itself.) */
+	if (prctl(PR_SET_TIMERSLACK, LOOP_PROCESS_TIMER_SLACK_NS, 0, 0, 0) == -1) {
+		swaylock_log_errno(LOG_DEBUG, "Unable to set timer slack");
+	}
+#endif
 	return loop;
 }
 
-void loop_destroy(struct loop *loop) {
+static void free_removed_fd_events(struct loop *loop) {
 	struct loop_fd_event *event = NULL, *tmp_event = NULL;
-	wl_list_for_each_safe(event, tmp_event, &loop->fd_events, link) {
+	wl_list_for_each_safe(event, tmp_event, &loop->removed_fd_events, link) {
 		wl_list_remove(&event->link);
 		free(event);
 	}
-	struct loop_timer *timer = NULL, *tmp_timer = NULL;
-	wl_list_for_each_safe(timer, tmp_timer, &loop->timers, link) {
-		wl_list_remove(&timer->link);
-		free(timer);
+}
+
+void loop_destroy(struct loop *loop) {
+	for (int i = 0; i < loop->fd_events_len; i++) {
+		free(loop->fd_events[i]);
 	}
-	free(loop->fds);
+	free_removed_fd_events(loop);
+	free(loop->fd_events);
+	for (int order = 0; order < TIMER_ORDER_COUNT; order++) {
+		free(loop->timer_heap[order]);
+	}
+	free(loop->stats);
+	slab_finish(&loop->timer_slab);
+	pthread_mutex_destroy(&loop->timer_mutex);
+	close(loop->timer_fd);
+	close(loop->epoll_fd);
 	free(loop);
 }
 
-void loop_poll(struct loop *loop) {
-	// Calculate next timer in ms
-	int ms = INT_MAX;
-	if (!wl_list_empty(&loop->timers)) {
-		struct timespec now;
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		struct loop_timer *timer = NULL;
-		wl_list_for_each(timer, &loop->timers, link) {
-			int timer_ms = (timer->expiry.tv_sec - now.tv_sec) * 1000;
-			timer_ms += (timer->expiry.tv_nsec - now.tv_nsec) / 1000000;
-			if (timer_ms < ms) {
-				ms = timer_ms;
-			}
+static const struct timespec *timer_key(const struct loop_timer *timer,
+		enum timer_order order) {
+	return order == TIMER_BY_DEADLINE ? &timer->deadline : &timer->expiry;
+}
+
+static bool timer_less(const struct loop_timer *a, const struct loop_timer *b,
+		enum timer_order order) {
+	return timespec_less(timer_key(a, order), timer_key(b, order));
+}
+
+static void heap_set(struct loop *loop, enum timer_order order, int index,
+		struct loop_timer *timer) {
+	loop->timer_heap[order][index] = timer;
+	timer->heap_index[order] = index;
+}
+
+static void heap_sift_up(struct loop *loop, enum timer_order order, int index) {
+	struct loop_timer **heap = loop->timer_heap[order];
+	struct loop_timer *timer = heap[index];
+	while (index > 0) {
+		int parent = (index - 1) / 2;
+		if (!timer_less(timer, heap[parent], order)) {
+			break;
 		}
+		heap_set(loop, order, index, heap[parent]);
+		index = parent;
 	}
-	if (ms < 0) {
-		ms = 0;
-	}
+	heap_set(loop, order, index, timer);
+}
 
-	int ret = poll(loop->fds, loop->fd_length, ms);
-	if (ret < 0 && errno != EINTR) {
-		swaylock_log_errno(LOG_ERROR, "poll failed");
-		exit(1);
+static void heap_sift_down(struct loop *loop, enum timer_order order, int index) {
+	struct loop_timer **heap = loop->timer_heap[order];
+	struct loop_timer *timer = heap[index];
+	while (true) {
+		int child = 2 * index + 1;
+		if (child >= loop->timer_heap_len) {
+			break;
+		}
+		if (child + 1 < loop->timer_heap_len &&
+				timer_less(heap[child + 1], heap[child], order)) {
+			child++;
+		}
+		if (!timer_less(heap[child], timer, order)) {
+			break;
+		}
+		heap_set(loop, order, index, heap[child]);
+		index = child;
 	}
+	heap_set(loop, order, index, timer);
+}
 
-	// Dispatch fds
-	size_t fd_index = 0;
-	struct loop_fd_event *event = NULL, *tmp_event = NULL;
-	wl_list_for_each_safe(event, tmp_event, &loop->fd_events, link) {
-		struct pollfd pfd = loop->fds[fd_index];
-		++fd_index;
+static void heap_insert(struct loop *loop, struct loop_timer *timer) {
+	int index = loop->timer_heap_len++;
+	for (int order = 0; order < TIMER_ORDER_COUNT; order++) {
+		loop->timer_heap[order][index] = timer;
+		heap_sift_up(loop, order, index);
+	}
+}
 
-		if (event->removed) {
+static void heap_remove(struct loop *loop, struct loop_timer *timer) {
+	int last = --loop->timer_heap_len;
+	for (int order = 0; order < TIMER_ORDER_COUNT; order++) {
+		int index = timer->heap_index[order];
+		timer->heap_index[order] = -1;
+		if (index == last) {
 			continue;
 		}
+		struct loop_timer *moved = loop->timer_heap[order][last];
+		heap_set(loop, order, index, moved);
+		heap_sift_up(loop, order, index);
+		heap_sift_down(loop, order, moved->heap_index[order]);
+	}
+}
 
-		// Always send these events
-		unsigned events = pfd.events | POLLHUP | POLLERR;
+/* Return the armed timer with the earliest expiry, if it is before `now` */
+static struct loop_timer *first_expired(struct loop *loop,
+		const struct timespec *now) {
+	if (loop->timer_heap_len == 0) {
+		return NULL;
+	}
+	struct loop_timer *timer = loop->timer_heap[TIMER_BY_EXPIRY][0];
+	return timespec_less(&timer->expiry, now) ? timer : NULL;
+}
 
-		if (pfd.revents & events) {
-			event->callback(pfd.fd, pfd.revents, event->data);
+/* Program the timerfd to go off when the first timer deadline is reached */
+static void update_timer_fd(struct loop *loop) {
+	struct itimerspec spec = {0};
+	if (loop->timer_heap_len > 0) {
+		struct timespec *deadline =
+			&loop->timer_heap[TIMER_BY_DEADLINE][0]->deadline;
+		if (loop->timer_fd_armed && deadline->tv_sec == loop->timer_fd_deadline.tv_sec &&
+				deadline->tv_nsec == loop->timer_fd_deadline.tv_nsec) {
+			return;
+		}
+		spec.it_value = *deadline;
+		if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+			/* an all-zero it_value would disarm the timer */
+			spec.it_value.tv_nsec = 1;
+		}
+		loop->timer_fd_armed = true;
+		loop->timer_fd_deadline = *deadline;
+	} else {
+		if (!loop->timer_fd_armed) {
+			return;
 		}
+		loop->timer_fd_armed = false;
+	}
+	if (timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+		swaylock_log_errno(LOG_ERROR, "timerfd_settime failed");
+		exit(1);
 	}
+}
 
-	// Free removed fd events
-	fd_index = 0;
-	wl_list_for_each_safe(event, tmp_event, &loop->fd_events, link) {
-		if (event->removed) {
-			wl_list_remove(&event->link);
-			free(event);
-			loop->fd_length--;
-			memmove(&loop->fds[fd_index], &loop->fds[fd_index + 1],
-				sizeof(struct pollfd) * (loop->fd_length - fd_index));
-		} else {
-			fd_index++;
+static void loop_lock(struct loop *loop) {
+	if (loop->lock) {
+		loop->lock(loop->lock_data);
+	}
+}
+
+static void loop_unlock(struct loop *loop) {
+	if (loop->unlock) {
+		loop->unlock(loop->lock_data);
+	}
+}
+
+static void run_fd_callback(struct loop *loop, struct loop_fd_event *event,
+		uint32_t events) {
+	// POLLHUP and POLLERR are always reported, as with poll()
+	short mask = epoll_to_poll_mask(events);
+	bool locked = !event->unlocked;
+	if (locked) {
+		loop_lock(loop);
+	}
+	if (loop->stats_enabled) {
+		struct timespec start, end;
+		const char *name = event->name;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		event->callback(event->fd, mask, event->data);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		record_call(loop, name, false, NULL, &start, &end);
+	} else {
+		event->callback(event->fd, mask, event->data);
+	}
+	if (locked) {
+		loop_unlock(loop);
+	}
+}
+
+/* Run callbacks for high priority fds which have become ready since the
+ * last epoll_wait; anything else stays pending until the next loop_poll */
+static void dispatch_pending_high(struct loop *loop) {
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	int ret = epoll_wait(loop->epoll_fd, events, LOOP_MAX_EVENTS, 0);
+	for (int i = 0; i < ret; i++) {
+		struct loop_fd_event *event = events[i].data.ptr;
+		if (event && !event->removed &&
+				event->priority == LOOP_PRIORITY_HIGH) {
+			run_fd_callback(loop, event, events[i].events);
 		}
 	}
+}
 
-	// Dispatch timers
-	if (!wl_list_empty(&loop->timers)) {
-		struct timespec now;
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		struct loop_timer *timer = NULL, *tmp_timer = NULL;
-		wl_list_for_each_safe(timer, tmp_timer, &loop->timers, link) {
-			if (timer->removed) {
-				wl_list_remove(&timer->link);
-				free(timer);
-				continue;
+void loop_poll(struct loop *loop) {
+	pthread_mutex_lock(&loop->timer_mutex);
+	update_timer_fd(loop);
+	pthread_mutex_unlock(&loop->timer_mutex);
+
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	int ret = epoll_wait(loop->epoll_fd, events, LOOP_MAX_EVENTS, -1);
+	if (ret < 0 && errno != EINTR) {
+		swaylock_log_errno(LOG_ERROR, "epoll_wait failed");
+		exit(1);
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	loop->period_wakeups++;
+	int64_t period = timespec_diff_ns(&now, &loop->period_start);
+	if (period >= LOOP_WAKEUP_PERIOD_NS) {
+		loop->wakeups_per_minute = loop->period_wakeups * 60e9 / period;
+		swaylock_log(LOG_DEBUG, "Event loop: %.1f wakeups per minute",
+			loop->wakeups_per_minute);
+		loop->period_start = now;
+		loop->period_wakeups = 0;
+	}
+	if (loop->stats_enabled) {
+		loop->stats_wakeups++;
+	}
+
+	// Priorities are captured now, so that each fd is dispatched at most
+	// once even if a callback changes them
+	enum loop_priority priorities[LOOP_MAX_EVENTS];
+	for (int i = 0; i < ret; i++) {
+		struct loop_fd_event *event = events[i].data.ptr;
+		if (!event) {
+			/* timerfd; timers are checked below in any case */
+			uint64_t expirations;
+			pthread_mutex_lock(&loop->timer_mutex);
+			(void)read(loop->timer_fd, &expirations, sizeof(expirations));
+			loop->timer_fd_armed = false;
+			pthread_mutex_unlock(&loop->timer_mutex);
+			continue;
+		}
+		priorities[i] = event->priority;
+	}
+
+	// Dispatch high and default priority fds, in that order
+	for (int p = LOOP_PRIORITY_HIGH; p <= LOOP_PRIORITY_DEFAULT; p++) {
+		for (int i = 0; i < ret; i++) {
+			struct loop_fd_event *event = events[i].data.ptr;
+			if (event && !event->removed && priorities[i] == (enum loop_priority)p) {
+				run_fd_callback(loop, event, events[i].events);
 			}
+		}
+	}
 
-			bool expired = timer->expiry.tv_sec < now.tv_sec ||
-				(timer->expiry.tv_sec == now.tv_sec &&
-				 timer->expiry.tv_nsec < now.tv_nsec);
-			if (expired) {
+	// Dispatch timers. Every timer that has passed its expiry is run, not
+	// only those that reached their deadline, so that timers with slack
+	// share wakeups with each other and with fd events.
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&loop->timer_mutex);
+	bool timers_due = first_expired(loop, &now) != NULL;
+	pthread_mutex_unlock(&loop->timer_mutex);
+	if (timers_due) {
+		/* The lock is only taken when needed, so that a wakeup for an
+		 * unlocked fd never waits for it. Timers are taken from the heap
+		 * under the lock, as another thread holding it may remove them. */
+		loop_lock(loop);
+		pthread_mutex_lock(&loop->timer_mutex);
+		/* Timers added by callbacks expire strictly after `now`, so
+		 * this terminates even if a callback re-adds a 0ms timer */
+		struct loop_timer *timer;
+		while ((timer = first_expired(loop, &now))) {
+			heap_remove(loop, timer);
+			/* callbacks may add and remove timers */
+			pthread_mutex_unlock(&loop->timer_mutex);
+			if (loop->stats_enabled) {
+				struct timespec start, end;
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				timer->callback(timer->data);
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				record_call(loop, timer->name, true, &timer->expiry,
+					&start, &end);
+			} else {
 				timer->callback(timer->data);
-				wl_list_remove(&timer->link);
-				free(timer);
 			}
+			pthread_mutex_lock(&loop->timer_mutex);
+			slab_free(&loop->timer_slab, timer);
 		}
+		pthread_mutex_unlock(&loop->timer_mutex);
+		loop_unlock(loop);
 	}
+
+	// Dispatch low priority fds, checking before each one whether a high
+	// priority fd needs attention first
+	for (int i = 0; i < ret; i++) {
+		struct loop_fd_event *event = events[i].data.ptr;
+		if (!event || priorities[i] != LOOP_PRIORITY_LOW) {
+			continue;
+		}
+		dispatch_pending_high(loop);
+		if (!event->removed) {
+			run_fd_callback(loop, event, events[i].events);
+		}
+	}
+
+	// Free removed fd events, now that no pointers to them remain
+	free_removed_fd_events(loop);
 }
 
-void loop_add_fd(struct loop *loop, int fd, short mask,
-		void (*callback)(int fd, short mask, void *data), void *data) {
+void _loop_add_fd(struct loop *loop, int fd, short mask,
+		void (*callback)(int fd, short mask, void *data), void *data,
+		const char *name) {
+	if (fd < 0) {
+		swaylock_log(LOG_ERROR, "Tried to add invalid fd %d to loop", fd);
+		return;
+	}
+	if (fd >= loop->fd_events_len) {
+		int new_len = loop->fd_events_len > 0 ? loop->fd_events_len : 16;
+		while (new_len <= fd) {
+			new_len *= 2;
+		}
+		struct loop_fd_event **new_events = realloc(loop->fd_events,
+			sizeof(struct loop_fd_event *) * new_len);
+		if (!new_events) {
+			swaylock_log(LOG_ERROR, "Unable to allocate memory for event");
+			return;
+		}
+		memset(new_events + loop->fd_events_len, 0,
+			sizeof(struct loop_fd_event *) * (new_len - loop->fd_events_len));
+		loop->fd_events = new_events;
+		loop->fd_events_len = new_len;
+	}
+
 	struct loop_fd_event *event = calloc(1, sizeof(struct loop_fd_event));
 	if (!event) {
 		swaylock_log(LOG_ERROR, "Unable to allocate memory for event");
@@ -153,64 +599,211 @@ void loop_add_fd(struct loop *loop, int fd, short mask,
 	}
 	event->callback = callback;
 	event->data = data;
-	wl_list_insert(loop->fd_events.prev, &event->link);
-
-	struct pollfd pfd = {fd, mask, 0};
+	event->name = name;
+	event->fd = fd;
+	event->priority = LOOP_PRIORITY_DEFAULT;
 
-	if (loop->fd_length == loop->fd_capacity) {
-		loop->fd_capacity += 10;
-		loop->fds = realloc(loop->fds,
-				sizeof(struct pollfd) * loop->fd_capacity);
+	struct epoll_event ev = {
+		.events = poll_to_epoll_mask(mask),
+		.data.ptr = event,
+	};
+	struct loop_fd_event *stale = loop->fd_events[fd];
+	if (stale) {
+		/* The fd was closed and its number reused without a call to
+		 * loop_remove_fd; the old registration may or may not still
+		 * exist, depending on whether the fd was duplicated. */
+		stale->removed = true;
+		wl_list_insert(&loop->removed_fd_events, &stale->link);
+		loop->fd_events[fd] = NULL;
 	}
-
-	loop->fds[loop->fd_length++] = pfd;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1 &&
+			(errno != EEXIST ||
+			 epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1)) {
+		swaylock_log_errno(LOG_ERROR, "Unable to add fd %d to loop", fd);
+		free(event);
+		return;
+	}
+	loop->fd_events[fd] = event;
 }
 
-struct loop_timer *loop_add_timer(struct loop *loop, int ms,
-		void (*callback)(void *data), void *data) {
-	struct loop_timer *timer = calloc(1, sizeof(struct loop_timer));
+struct loop_timer *_loop_add_timer(struct loop *loop, int ms, int slack_ms,
+		void (*callback)(void *data), void *data, const char *name) {
+	pthread_mutex_lock(&loop->timer_mutex);
+	if (loop->timer_heap_len == loop->timer_heap_capacity) {
+		int new_capacity = loop->timer_heap_capacity > 0 ?
+			2 * loop->timer_heap_capacity : LOOP_TIMERS_PER_CHUNK;
+		for (int order = 0; order < TIMER_ORDER_COUNT; order++) {
+			struct loop_timer **new_heap = realloc(loop->timer_heap[order],
+				sizeof(struct loop_timer *) * new_capacity);
+			if (!new_heap) {
+				pthread_mutex_unlock(&loop->timer_mutex);
+				swaylock_log(LOG_ERROR, "Unable to allocate memory for timer");
+				return NULL;
+			}
+			loop->timer_heap[order] = new_heap;
+		}
+		loop->timer_heap_capacity = new_capacity;
+	}
+
+	struct loop_timer *timer = slab_alloc(&loop->timer_slab);
 	if (!timer) {
+		pthread_mutex_unlock(&loop->timer_mutex);
 		swaylock_log(LOG_ERROR, "Unable to allocate memory for timer");
 		return NULL;
 	}
 	timer->callback = callback;
 	timer->data = data;
+	timer->name = name;
 
 	clock_gettime(CLOCK_MONOTONIC, &timer->expiry);
-	timer->expiry.tv_sec += ms / 1000;
+	timespec_add_ns(&timer->expiry, (int64_t)ms * 1000000);
+	int64_t slack_ns = slack_ms > 0 ? (int64_t)slack_ms * 1000000 : 0;
+	timer->deadline = timer->expiry;
+	timespec_add_ns(&timer->deadline, slack_ns);
 
-	long int nsec = (ms % 1000) * 1000000;
-	if (timer->expiry.tv_nsec + nsec >= 1000000000) {
-		timer->expiry.tv_sec++;
-		nsec -= 1000000000;
+	heap_insert(loop, timer);
+	if (timer->heap_index[TIMER_BY_DEADLINE] == 0) {
+		/* loop_poll() may already be waiting on the old deadline */
+		update_timer_fd(loop);
 	}
-	timer->expiry.tv_nsec += nsec;
-
-	wl_list_insert(&loop->timers, &timer->link);
+	pthread_mutex_unlock(&loop->timer_mutex);
 
 	return timer;
 }
 
 bool loop_remove_fd(struct loop *loop, int fd) {
-	size_t fd_index = 0;
-	struct loop_fd_event *event = NULL, *tmp_event = NULL;
-	wl_list_for_each_safe(event, tmp_event, &loop->fd_events, link) {
-		if (loop->fds[fd_index].fd == fd) {
-			event->removed = true;
-			return true;
+	if (fd < 0 || fd >= loop->fd_events_len || !loop->fd_events[fd]) {
+		return false;
+	}
+	struct loop_fd_event *event = loop->fd_events[fd];
+	/* may fail harmlessly if the fd was already closed */
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	event->removed = true;
+	loop->fd_events[fd] = NULL;
+	/* freed at the end of loop_poll(), as it may be pending dispatch */
+	wl_list_insert(&loop->removed_fd_events, &event->link);
+	return true;
+}
+
+bool loop_update_fd(struct loop *loop, int fd, short mask) {
+	if (fd < 0 || fd >= loop->fd_events_len || !loop->fd_events[fd]) {
+		return false;
+	}
+	struct epoll_event ev = {
+		.events = poll_to_epoll_mask(mask),
+		.data.ptr = loop->fd_events[fd],
+	};
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+		swaylock_log_errno(LOG_ERROR, "Unable to update fd %d in loop", fd);
+		return false;
+	}
+	return true;
+}
+
+bool loop_set_fd_priority(struct loop *loop, int fd,
+		enum loop_priority priority) {
+	if (fd < 0 || fd >= loop->fd_events_len || !loop->fd_events[fd]) {
+		return false;
+	}
+	loop->fd_events[fd]->priority = priority;
+	return true;
+}
+
+bool loop_remove_timer(struct loop *loop, struct loop_timer *timer) {
+	pthread_mutex_lock(&loop->timer_mutex);
+	if (timer->heap_index[TIMER_BY_DEADLINE] < 0) {
+		/* timer has already expired, or is currently being dispatched */
+		pthread_mutex_unlock(&loop->timer_mutex);
+		return false;
+	}
+	heap_remove(loop, timer);
+	slab_free(&loop->timer_slab, timer);
+	pthread_mutex_unlock(&loop->timer_mutex);
+	return true;
+}
+
+void loop_set_lock_hooks(struct loop *loop, void (*lock)(void *data),
+		void (*unlock)(void *data), void *data) {
+	loop->lock = lock;
+	loop->unlock = unlock;
+	loop->lock_data = data;
+}
+
+bool loop_set_fd_unlocked(struct loop *loop, int fd) {
+	if (fd < 0 || fd >= loop->fd_events_len || !loop->fd_events[fd]) {
+		return false;
+	}
+	loop->fd_events[fd]->unlocked = true;
+	return true;
+}
+
+void loop_enable_stats(struct loop *loop) {
+	if (loop->stats_enabled) {
+		return;
+	}
+	loop->stats_enabled = true;
+	clock_gettime(CLOCK_MONOTONIC, &loop->stats_start);
+}
+
+static void print_histogram(const char *title,
+		const uint64_t hist[static LOOP_STATS_BUCKETS]) {
+	uint64_t max_count = 0;
+	for (int i = 0; i < LOOP_STATS_BUCKETS; i++) {
+		if (hist[i] > max_count) {
+			max_count = hist[i];
 		}
-		++fd_index;
 	}
-	return false;
+	if (max_count == 0) {
+		return;
+	}
+	fprintf(stderr, "    %s:\n", title);
+	for (int i = 0; i < LOOP_STATS_BUCKETS; i++) {
+		if (hist[i] == 0) {
+			continue;
+		}
+		char range[32];
+		if (i == 0) {
+			snprintf(range, sizeof(range), "< 1 us");
+		} else if (i == LOOP_STATS_BUCKETS - 1) {
+			snprintf(range, sizeof(range), ">= %llu us", 1ULL << (i - 1));
+		} else if (i == 1) {
+			snprintf(range, sizeof(range), "1 us");
+		} else {
+			snprintf(range, sizeof(range), "%llu-%llu us",
+				1ULL << (i - 1), (1ULL << i) - 1);
+		}
+		int bar = (int)((hist[i] * 40 + max_count - 1) / max_count);
+		fprintf(stderr, "      %16s %10llu %.*s\n", range,
+			(unsigned long long)hist[i], bar,
+			"########################################");
+	}
 }
 
-bool loop_remove_timer(struct loop *loop, struct loop_timer *remove) {
-	struct loop_timer *timer = NULL, *tmp_timer = NULL;
-	wl_list_for_each_safe(timer, tmp_timer, &loop->timers, link) {
-		if (timer == remove) {
-			timer->removed = true;
-			return true;
+void loop_print_stats(struct loop *loop) {
+	if (!loop->stats_enabled) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = timespec_diff_ns(&now, &loop->stats_start) * 1e-9;
+
+	fprintf(stderr, "Event loop statistics: %llu wakeups in %.1f s "
+		"(%.1f per minute over the last full minute)\n",
+		(unsigned long long)loop->stats_wakeups, elapsed,
+		loop->wakeups_per_minute);
+	for (size_t i = 0; i < loop->stats_len; i++) {
+		const struct loop_callback_stats *stats = &loop->stats[i];
+		fprintf(stderr, "  %s (%s): %llu calls, total %.3f ms, "
+			"mean %.1f us, max %.3f ms\n",
+			stats->name, stats->is_timer ? "timer" : "fd",
+			(unsigned long long)stats->calls, stats->total_ns * 1e-6,
+			stats->total_ns * 1e-3 / stats->calls, stats->max_ns * 1e-6);
+		print_histogram("run time", stats->duration_hist);
+		if (stats->is_timer) {
+			fprintf(stderr, "    lateness: mean %.1f us, max %.3f ms\n",
+				stats->total_late_ns * 1e-3 / stats->calls,
+				stats->max_late_ns * 1e-6);
+			print_histogram("lateness", stats->lateness_hist);
 		}
 	}
-	return false;
 }
@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdbool.h>
@@ -32,18 +33,27 @@
 #include "xdg-output-unstable-v1-client-protocol.h"
 #include "xdg-output-unstable-v1-server-protocol.h"
 #include "wlr-layer-shell-unstable-v1-server-protocol.h"
+#include "xdg-shell-server-protocol.h"
 #include "linux-dmabuf-unstable-v1-client-protocol.h"
 #include "fractional-scale-v1-server-protocol.h"
 #include "viewporter-server-protocol.h"
+#include "single-pixel-buffer-v1-server-protocol.h"
+#include "presentation-time-server-protocol.h"
+#include "fifo-v1-server-protocol.h"
+#include "linux-drm-syncobj-v1-server-protocol.h"
+#include "commit-timing-v1-server-protocol.h"
 
 #define WL_OUTPUT_MM_PER_PIX 0.264
 #define WL_OUTPUT_VERSION 4
 
 #define TIMEOUT_CONNECT 2500
 #define TIMEOUT_SURFACE 4000
+/* The watchdogs above need not fire at a precise time */
+#define TIMEOUT_SLACK 1000
 
 static void bind_wl_output(struct wl_client *client, void *data,
 		uint32_t version, uint32_t id);
+static void advertise_output(struct swaylock_surface *surface);
 static void render_fallback_surface(struct swaylock_surface *surface);
 static void output_redraw_timeout(void *data);
 static bool run_plugin_command(struct swaylock_state *state,
@@ -138,7 +148,7 @@ static void destroy_surface(struct swaylock_surface *surface) {
 	wl_list_remove(&surface->link);
 	if (surface->plugin_surface) {
 		// todo: proper cleanup
-		zwlr_layer_surface_v1_send_closed(surface->plugin_surface->layer_surface);
+		send_plugin_closed(surface->plugin_surface);
 		surface->plugin_surface->sway_surface = NULL;
 		surface->plugin_surface->inert = true;
 	}
@@ -153,6 +163,30 @@ static void destroy_surface(struct swaylock_surface *surface) {
 		assert(surface->client == NULL);
 	}
 
+	if (surface->mirror_of) {
+		wl_list_remove(&surface->mirror_link);
+	}
+	/* The first mirror of this output is offered in its place, and
+	 * the others mirror that one; without a plugin, they keep showing
+	 * the last contents */
+	struct swaylock_surface *heir = NULL, *mirror, *tmp_mirror;
+	wl_list_for_each_safe(mirror, tmp_mirror, &surface->mirrors, mirror_link) {
+		wl_list_remove(&mirror->mirror_link);
+		wl_list_init(&mirror->mirror_link);
+		mirror->mirror_of = NULL;
+		if (!state->server.display) {
+			continue;
+		}
+		if (!heir) {
+			heir = mirror;
+			advertise_output(heir);
+		} else {
+			wl_list_insert(heir->mirrors.prev, &mirror->mirror_link);
+			mirror->mirror_of = heir;
+			mirror->mirror_stale = true;
+		}
+	}
+
 	if (surface->nested_server_output) {
 		wl_global_remove(surface->nested_server_output);
 		// Unlink the resources; calling wl_resource_remove might be unsafe?
@@ -188,6 +222,24 @@ static void destroy_surface(struct swaylock_surface *surface) {
 	if (surface->viewport) {
 		wp_viewport_destroy(surface->viewport);
 	}
+	if (surface->dmabuf_feedback) {
+		zwp_linux_dmabuf_feedback_v1_destroy(surface->dmabuf_feedback);
+		finish_dmabuf_feedback_receiver(&surface->dmabuf_surface_feedback,
+			&state->forward.default_feedback);
+	}
+	if (surface->fifo) {
+		wp_fifo_v1_destroy(surface->fifo);
+	}
+	if (surface->commit_timer) {
+		wp_commit_timer_v1_destroy(surface->commit_timer);
+	}
+	if (surface->syncobj_surface) {
+		wp_linux_drm_syncobj_surface_v1_destroy(surface->syncobj_surface);
+	}
+	if (surface->fallback_buffer && surface->fallback_buffer != surface->fallback_shm.buffer) {
+		wl_buffer_destroy(surface->fallback_buffer);
+	}
+	destroy_buffer(&surface->fallback_shm);
 	if (surface->subsurface) {
 		wl_subsurface_destroy(surface->subsurface);
 	}
@@ -227,6 +279,8 @@ static const struct wp_fractional_scale_v1_listener fract_scale_listener = {
 
 static cairo_surface_t *select_image(struct swaylock_state *state,
 		struct swaylock_surface *surface);
+static int select_frame_interval(struct swaylock_state *state,
+		struct swaylock_surface *surface);
 
 static bool surface_is_opaque(struct swaylock_surface *surface) {
 	if (surface->image) {
@@ -235,13 +289,64 @@ static bool surface_is_opaque(struct swaylock_surface *surface) {
 	return (surface->state->args.colors.background & 0xff) == 0xff;
 }
 
+/* Mark the whole lock surface as opaque, or clear its opaque region */
+static void set_opaque_region(struct swaylock_surface *surface, bool opaque) {
+	struct wl_region *region = NULL;
+	if (opaque) {
+		region = wl_compositor_create_region(surface->state->compositor);
+		wl_region_add(region, 0, 0, INT32_MAX, INT32_MAX);
+	}
+	wl_surface_set_opaque_region(surface->surface, region);
+	if (region) {
+		wl_region_destroy(region);
+	}
+}
+
+static void surface_handle_enter(void *data, struct wl_surface *wl_surface,
+		struct wl_output *output) {
+	// nothing to do
+}
+
+static void surface_handle_leave(void *data, struct wl_surface *wl_surface,
+		struct wl_output *output) {
+	// nothing to do
+}
+
+static void surface_handle_preferred_buffer_scale(void *data,
+		struct wl_surface *wl_surface, int32_t factor) {
+	struct swaylock_surface *surface = data;
+	surface->preferred_buffer_scale = factor;
+	if (surface->plugin_surface) {
+		send_preferred_buffer_state(surface->plugin_surface);
+	}
+}
+
+static void surface_handle_preferred_buffer_transform(void *data,
+		struct wl_surface *wl_surface, uint32_t transform) {
+	struct swaylock_surface *surface = data;
+	surface->preferred_buffer_transform = transform;
+	surface->has_preferred_buffer_transform = true;
+	if (surface->plugin_surface) {
+		send_preferred_buffer_state(surface->plugin_surface);
+	}
+}
+
+static const struct wl_surface_listener surface_listener = {
+	.enter = surface_handle_enter,
+	.leave = surface_handle_leave,
+	.preferred_buffer_scale = surface_handle_preferred_buffer_scale,
+	.preferred_buffer_transform = surface_handle_preferred_buffer_transform,
+};
+
 static void create_surface(struct swaylock_surface *surface) {
 	struct swaylock_state *state = surface->state;
 
 	surface->image = select_image(state, surface);
+	surface->min_frame_interval_ms = select_frame_interval(state, surface);
 
 	surface->surface = wl_compositor_create_surface(state->compositor);
 	assert(surface->surface);
+	wl_surface_add_listener(surface->surface, &surface_listener, surface);
 
 	surface->child = wl_compositor_create_surface(state->compositor);
 	assert(surface->child);
@@ -254,15 +359,9 @@ static void create_surface(struct swaylock_surface *surface) {
 	ext_session_lock_surface_v1_add_listener(surface->ext_session_lock_surface_v1,
 			&ext_session_lock_surface_v1_listener, surface);
 
-	if (surface_is_opaque(surface) &&
-			surface->state->args.mode != BACKGROUND_MODE_CENTER &&
-			surface->state->args.mode != BACKGROUND_MODE_FIT) {
-		struct wl_region *region =
-			wl_compositor_create_region(surface->state->compositor);
-		wl_region_add(region, 0, 0, INT32_MAX, INT32_MAX);
-		wl_surface_set_opaque_region(surface->surface, region);
-		wl_region_destroy(region);
-	}
+	set_opaque_region(surface, surface_is_opaque(surface) &&
+		surface->state->args.mode != BACKGROUND_MODE_CENTER &&
+		surface->state->args.mode != BACKGROUND_MODE_FIT);
 
 	if (state->forward.fractional_scale) {
 		surface->fractional_scale = wp_fractional_scale_manager_v1_get_fractional_scale(
@@ -276,6 +375,16 @@ static void create_surface(struct swaylock_surface *surface) {
 		assert(surface->viewport);
 	}
 
+	if (state->forward.linux_dmabuf &&
+			zwp_linux_dmabuf_v1_get_version(state->forward.linux_dmabuf) >= 4) {
+		/* may differ from the default feedback, e.g. to permit direct scanout */
+		init_dmabuf_feedback_receiver(&surface->dmabuf_surface_feedback);
+		surface->dmabuf_feedback = zwp_linux_dmabuf_v1_get_surface_feedback(
+			state->forward.linux_dmabuf, surface->surface);
+		zwp_linux_dmabuf_feedback_v1_add_listener(surface->dmabuf_feedback,
+			&dmabuf_feedback_listener, &surface->dmabuf_surface_feedback);
+	}
+
 	if (state->forward.color_representation) {
 		surface->color_rep_surface = wp_color_representation_manager_v1_get_surface(
 			state->forward.color_representation, surface->surface);
@@ -295,8 +404,8 @@ static void create_surface(struct swaylock_surface *surface) {
 
 	// Plugin should provide a surface quickly enough, after compositor
 	// has made the necessary details available
-	surface->client_submission_timer = loop_add_timer(state->eventloop,
-		TIMEOUT_SURFACE, output_redraw_timeout, surface);
+	surface->client_submission_timer = loop_add_timer_slack(state->eventloop,
+		TIMEOUT_SURFACE, TIMEOUT_SLACK, output_redraw_timeout, surface);
 
 	// Run command, now that we know the output's name and description,
 	// and can pass these along to the plugin program using environment
@@ -310,17 +419,92 @@ static void create_surface(struct swaylock_surface *surface) {
 	surface->created = true;
 }
 
+/* Configure the plugin surface with the size of the newest upstream configure;
+ * acknowledging it also acknowledges all older upstream configures */
+static void send_newest_configure(struct swaylock_surface *surface) {
+	struct forward_surface *plugin_surf = surface->plugin_surface;
+	if (plugin_surf->serial_ring_len == SERIAL_RING_CAPACITY) {
+		/* sent once the plugin acknowledges an outstanding configure */
+		plugin_surf->configure_coalesced = true;
+		return;
+	}
+	struct swaylock_bg_client *bg_client = surface->client ?
+		surface->client : surface->state->server.main_client;
+	uint32_t plugin_serial = bg_client->serial++;
+	add_serial_pair(plugin_surf, surface->newest_serial, plugin_serial,
+		surface->width, surface->height, false);
+	send_plugin_configure(plugin_surf, plugin_serial, surface->width, surface->height);
+	plugin_surf->configure_coalesced = false;
+}
+
+static void advertise_output(struct swaylock_surface *surface) {
+	surface->nested_server_output = wl_global_create(
+		surface->state->server.display, &wl_output_interface,
+		WL_OUTPUT_VERSION, surface, bind_wl_output);
+}
+
+/* --mirror: can one plugin surface be shown unchanged on both outputs */
+static bool outputs_match(struct swaylock_surface *a, struct swaylock_surface *b) {
+	return a->width == b->width && a->height == b->height &&
+		a->scale == b->scale && a->output_transform == b->output_transform;
+}
+
+/* --mirror: find an output offered to the plugin that matches `surface` */
+static struct swaylock_surface *find_mirror_target(struct swaylock_surface *surface) {
+	struct swaylock_state *state = surface->state;
+	if (!state->args.mirror || state->args.plugin_per_output) {
+		return NULL;
+	}
+	struct swaylock_surface *iter;
+	wl_list_for_each(iter, &state->surfaces, link) {
+		if (iter != surface && iter->nested_server_output && outputs_match(iter, surface)) {
+			return iter;
+		}
+	}
+	return NULL;
+}
+
+/* Offer a mirroring output to the plugin as an output of its own */
+static void stop_mirroring(struct swaylock_surface *surface) {
+	wl_list_remove(&surface->mirror_link);
+	wl_list_init(&surface->mirror_link);
+	surface->mirror_of = NULL;
+	surface->mirror_stale = false;
+	advertise_output(surface);
+}
+
 static void forward_configure(struct swaylock_surface *surface, bool first_configure, uint32_t serial) {
 	if (first_configure && (surface->width > 0 && surface->height > 0)) {
-		// delay output creation until we know exactly what layer
-		// surface size we are provided with.
-		surface->nested_server_output = wl_global_create(
-			surface->state->server.display, &wl_output_interface,
-			WL_OUTPUT_VERSION, surface, bind_wl_output);
-
 		surface->first_configure_serial = serial;
 		surface->used_first_configure = false;
+
+		struct swaylock_surface *target = find_mirror_target(surface);
+		if (target) {
+			/* Show the plugin surface of the matching output instead of
+			 * offering another one; its configures are acknowledged as
+			 * that surface is copied, and should this output later get
+			 * a plugin surface of its own, that starts from the newest */
+			surface->mirror_of = target;
+			wl_list_insert(target->mirrors.prev, &surface->mirror_link);
+			surface->used_first_configure = true;
+			return;
+		}
+		// delay output creation until we know exactly what layer
+		// surface size we are provided with.
+		advertise_output(surface);
 	} else if (surface->width > 0 && surface->height > 0) {
+		if (surface->mirror_of) {
+			if (!outputs_match(surface, surface->mirror_of)) {
+				stop_mirroring(surface);
+			}
+			return;
+		}
+		struct swaylock_surface *mirror, *tmp;
+		wl_list_for_each_safe(mirror, tmp, &surface->mirrors, mirror_link) {
+			if (!outputs_match(surface, mirror)) {
+				stop_mirroring(mirror);
+			}
+		}
 		struct wl_resource *output;
 		wl_resource_for_each(output, &surface->nested_server_wl_output_resources) {
 			wl_output_send_geometry(output, 0, 0, surface->physical_width,
@@ -339,12 +523,14 @@ static void forward_configure(struct swaylock_surface *surface, bool first_confi
 			/* reconfigure plugin surface with new size */
 			if (surface->plugin_surface->has_been_configured) {
 				/* wait until the first commit/configure cycle is over */
-				struct swaylock_bg_client *bg_client = surface->client ?
-					surface->client : surface->state->server.main_client;
-				uint32_t plugin_serial = bg_client->serial++;
-				add_serial_pair(surface->plugin_surface, serial, plugin_serial, surface->width, surface->height, false);
-				zwlr_layer_surface_v1_send_configure(surface->plugin_surface->layer_surface,
-					plugin_serial, surface->width, surface->height);
+				if (surface->plugin_surface->serial_ring_len > 0) {
+					/* The plugin has not acknowledged the last configure
+					 * yet; once it does, only the newest size is sent,
+					 * so it does not allocate buffers for obsolete sizes */
+					surface->plugin_surface->configure_coalesced = true;
+				} else {
+					send_newest_configure(surface);
+				}
 			}
 		}
 	}
@@ -372,6 +558,9 @@ static void ext_session_lock_surface_v1_handle_configure(void *data,
 	if (surface->state->server.display) {
 		forward_configure(surface, first_configure, serial);
 		surface->has_newer_serial = true;
+		if (surface->mirror_of) {
+			refresh_mirror(surface);
+		}
 	} else {
 		ext_session_lock_surface_v1_ack_configure(surface->ext_session_lock_surface_v1, serial);
 		surface->has_newer_serial = false;
@@ -386,8 +575,8 @@ static void ext_session_lock_surface_v1_handle_configure(void *data,
 		// needs an update. Problem: do noop-configures or reverted
 		// configures need acknowledgement?
 		if (!surface->client_submission_timer) {
-			surface->client_submission_timer = loop_add_timer(surface->state->eventloop,
-				TIMEOUT_SURFACE, output_redraw_timeout, surface);
+			surface->client_submission_timer = loop_add_timer_slack(surface->state->eventloop,
+				TIMEOUT_SURFACE, TIMEOUT_SLACK, output_redraw_timeout, surface);
 		}
 	}
 }
@@ -396,11 +585,17 @@ static const struct ext_session_lock_surface_v1_listener ext_session_lock_surfac
 	.configure = ext_session_lock_surface_v1_handle_configure,
 };
 
+/* Set while compositor input is dispatched without nested_lock; the redraws
+ * it causes are made once the lock is held */
+static bool defer_render = false;
+
 void damage_state(struct swaylock_state *state) {
 	struct swaylock_surface *surface;
 	wl_list_for_each(surface, &state->surfaces, link) {
 		surface->dirty = true;
-		render(surface);
+		if (!defer_render) {
+			render(surface);
+		}
 	}
 }
 
@@ -525,13 +720,19 @@ static void handle_global(void *data, struct wl_registry *registry,
 		uint32_t name, const char *interface, uint32_t version) {
 	struct swaylock_state *state = data;
 	if (strcmp(interface, wl_compositor_interface.name) == 0) {
-		/* version 5 required for wl_surface::offset */
+		/* version 5 required for wl_surface::offset, and version 6 for
+		 * the preferred buffer scale and transform events */
 		state->compositor = wl_registry_bind(registry, name,
-				&wl_compositor_interface, version >= 5 ? 5 : 4);
+				&wl_compositor_interface, version >= 6 ? 6 : (version >= 5 ? 5 : 4));
 		state->forward.compositor = state->compositor;
 	} else if (strcmp(interface, wl_subcompositor_interface.name) == 0) {
 		state->subcompositor = wl_registry_bind(registry, name,
 				&wl_subcompositor_interface, 1);
+		state->forward.subcompositor = state->subcompositor;
+	} else if (strcmp(interface, wp_single_pixel_buffer_manager_v1_interface.name) == 0) {
+		state->single_pixel_buffer_manager = wl_registry_bind(registry, name,
+				&wp_single_pixel_buffer_manager_v1_interface, 1);
+		state->forward.single_pixel_buffer_manager = state->single_pixel_buffer_manager;
 	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
 		state->shm = wl_registry_bind(registry, name,
 				&wl_shm_interface, 1);
@@ -546,19 +747,27 @@ static void handle_global(void *data, struct wl_registry *registry,
 		zwp_linux_dmabuf_v1_add_listener(state->forward.linux_dmabuf, &linux_dmabuf_listener, &state->forward);
 		if (version >= 4) {
 			state->dmabuf_default_feedback = zwp_linux_dmabuf_v1_get_default_feedback(state->forward.linux_dmabuf);
-			zwp_linux_dmabuf_feedback_v1_add_listener(state->dmabuf_default_feedback, &dmabuf_feedback_listener, &state->forward);
-
-			memset(&state->forward.pending, 0, sizeof(state->forward.pending));
-			memset(&state->forward.current, 0, sizeof(state->forward.current));
-			state->forward.pending.table_fd = -1;
-			state->forward.current.table_fd = -1;
+			zwp_linux_dmabuf_feedback_v1_add_listener(state->dmabuf_default_feedback,
+				&dmabuf_feedback_listener, &state->forward.default_feedback);
 		}
 	} else if (strcmp(interface, wl_drm_interface.name) == 0) {
 		state->forward.drm = wl_registry_bind(registry, name,
 				&wl_drm_interface, 2);
+		wl_drm_add_listener(state->forward.drm, &drm_listener, &state->forward);
 	} else if (strcmp(interface, wl_seat_interface.name) == 0) {
+		/* seat events, and those of its keyboards and pointers, go to the
+		 * input queue if there is one */
+		struct wl_registry *seat_registry = registry;
+		if (state->input_queue) {
+			seat_registry = wl_proxy_create_wrapper(registry);
+			wl_proxy_set_queue((struct wl_proxy *)seat_registry,
+				state->input_queue);
+		}
 		struct wl_seat *seat = wl_registry_bind(
-				registry, name, &wl_seat_interface, 4);
+				seat_registry, name, &wl_seat_interface, 4);
+		if (seat_registry != registry) {
+			wl_proxy_wrapper_destroy(seat_registry);
+		}
 		struct swaylock_seat *swaylock_seat =
 			calloc(1, sizeof(struct swaylock_seat));
 		swaylock_seat->state = state;
@@ -581,6 +790,8 @@ static void handle_global(void *data, struct wl_registry *registry,
 		wl_list_init(&surface->nested_server_wl_output_resources);
 		wl_list_init(&surface->nested_server_xdg_output_resources);
 		wl_list_init(&surface->nested_server_color_output_resources);
+		wl_list_init(&surface->mirrors);
+		wl_list_init(&surface->mirror_link);
 	} else if (strcmp(interface, ext_session_lock_manager_v1_interface.name) == 0) {
 		state->ext_session_lock_manager_v1 = wl_registry_bind(registry, name,
 				&ext_session_lock_manager_v1_interface, 1);
@@ -590,6 +801,21 @@ static void handle_global(void *data, struct wl_registry *registry,
 	} else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
 		state->forward.viewporter = wl_registry_bind(registry, name,
 			&wp_viewporter_interface, version >= 1 ? 1 : version);
+	} else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+		state->forward.presentation_version = version >= 2 ? 2 : version;
+		state->forward.presentation = wl_registry_bind(registry, name,
+			&wp_presentation_interface, state->forward.presentation_version);
+		wp_presentation_add_listener(state->forward.presentation,
+			&presentation_listener, &state->forward);
+	} else if (strcmp(interface, wp_fifo_manager_v1_interface.name) == 0) {
+		state->forward.fifo_manager = wl_registry_bind(registry, name,
+			&wp_fifo_manager_v1_interface, 1);
+	} else if (strcmp(interface, wp_commit_timing_manager_v1_interface.name) == 0) {
+		state->forward.commit_timing_manager = wl_registry_bind(registry, name,
+			&wp_commit_timing_manager_v1_interface, 1);
+	} else if (strcmp(interface, wp_linux_drm_syncobj_manager_v1_interface.name) == 0) {
+		state->forward.syncobj_manager = wl_registry_bind(registry, name,
+			&wp_linux_drm_syncobj_manager_v1_interface, 1);
 	} else if (strcmp(interface, wp_color_manager_v1_interface.name) == 0) {
 		assert(!state->forward.color_management); // only expected once
 
@@ -633,6 +859,23 @@ static const struct wl_registry_listener registry_listener = {
 
 static int sigusr_fds[2] = {-1, -1};
 static int sigusr2_fds[2] = {-1, -1};
+static int sigstats_fds[2] = {-1, -1};
+
+/* With --nested-thread, this lock guards what the nested server thread shares
+ * with the main thread: the nested server, forward_state, the loop's fds, and
+ * the parts of swaylock_state that serve plugins. The nested thread holds it
+ * except while polling; the main thread takes it around loop callbacks, but
+ * dispatches compositor input (state.input_queue) without it. */
+static pthread_mutex_t nested_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t nested_thread;
+static bool nested_thread_running = false;
+/* set by the nested thread when it stops on an error */
+static bool nested_thread_failed = false;
+/* wakes the nested server thread */
+static int nested_wake_fds[2] = {-1, -1};
+/* wakes the main thread, after the nested thread read upstream events that
+ * may be for the other queues, or it failed */
+static int nested_notify_fds[2] = {-1, -1};
 
 void do_sigusr(int sig) {
 	(void)write(sigusr_fds[1], "1", 1);
@@ -642,6 +885,10 @@ void do_sigusr2(int sig) {
 	(void)write(sigusr2_fds[1], "1", 1);
 }
 
+void do_sigstats(int sig) {
+	(void)write(sigstats_fds[1], "1", 1);
+}
+
 static cairo_surface_t *select_image(struct swaylock_state *state,
 		struct swaylock_surface *surface) {
 	struct swaylock_image *image;
@@ -656,6 +903,60 @@ static cairo_surface_t *select_image(struct swaylock_state *state,
 	return default_image;
 }
 
+static int select_frame_interval(struct swaylock_state *state,
+		struct swaylock_surface *surface) {
+	struct swaylock_fps_limit *limit;
+	float fps = 0;
+	wl_list_for_each(limit, &state->fps_limits, link) {
+		if (lenient_strcmp(limit->output_name, surface->output_name) == 0) {
+			fps = limit->fps;
+			break;
+		} else if (!limit->output_name) {
+			fps = limit->fps;
+		}
+	}
+	return fps > 0 ? (int)ceilf(1000.f / fps) : 0;
+}
+
+static void load_fps_limit(char *arg, struct swaylock_state *state) {
+	// [[<output>]:]<fps>
+	char *output_name = NULL;
+	char *value = arg;
+	char *separator = strrchr(arg, ':');
+	if (separator) {
+		*separator = '\0';
+		output_name = separator == arg ? NULL : arg;
+		value = separator + 1;
+	}
+
+	char *end = NULL;
+	errno = 0;
+	float fps = strtof(value, &end);
+	if (*value == '\0' || *end != '\0' || errno != 0 || !(fps > 0.f)) {
+		swaylock_log(LOG_ERROR,
+			"Invalid value for max fps: '%s' is not a positive number", value);
+		return;
+	}
+
+	struct swaylock_fps_limit *limit;
+	wl_list_for_each(limit, &state->fps_limits, link) {
+		if (lenient_strcmp(limit->output_name, output_name) == 0) {
+			limit->fps = fps;
+			return;
+		}
+	}
+	limit = calloc(1, sizeof(struct swaylock_fps_limit));
+	if (!limit) {
+		swaylock_log(LOG_ERROR, "Failed to allocate fps limit");
+		return;
+	}
+	limit->output_name = output_name ? strdup(output_name) : NULL;
+	limit->fps = fps;
+	wl_list_insert(&state->fps_limits, &limit->link);
+	swaylock_log(LOG_DEBUG, "Limiting plugin frame rate to %g fps for output %s",
+		fps, output_name ? output_name : "*");
+}
+
 static char *join_args(char **argv, int argc) {
 	assert(argc > 0);
 	int len = 0, i;
@@ -821,6 +1122,13 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		LO_PLUGIN_POINTER_HYSTERESIS,
 		LO_PLUGIN_COMMAND,
 		LO_PLUGIN_COMMAND_EACH,
+		LO_LOOP_STATS,
+		LO_NESTED_THREAD,
+		LO_MAX_DAMAGE_RECTS,
+		LO_SHADOW_BUFFERS,
+		LO_MAX_FPS,
+		LO_MAILBOX,
+		LO_MIRROR,
 	};
 
 	static struct option long_options[] = {
@@ -882,6 +1190,13 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		{"pointer-hysteresis", required_argument, NULL, LO_PLUGIN_POINTER_HYSTERESIS},
 		{"command", required_argument, NULL, LO_PLUGIN_COMMAND},
 		{"command-each", required_argument, NULL, LO_PLUGIN_COMMAND_EACH},
+		{"loop-stats", no_argument, NULL, LO_LOOP_STATS},
+		{"nested-thread", no_argument, NULL, LO_NESTED_THREAD},
+		{"max-damage-rects", required_argument, NULL, LO_MAX_DAMAGE_RECTS},
+		{"shadow-buffers", no_argument, NULL, LO_SHADOW_BUFFERS},
+		{"max-fps", required_argument, NULL, LO_MAX_FPS},
+		{"mailbox", no_argument, NULL, LO_MAILBOX},
+		{"mirror", no_argument, NULL, LO_MIRROR},
 		{0, 0, 0, 0}
 	};
 
@@ -1008,6 +1323,20 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 			"Allow unlocking without a password before <seconds> elapse\n"
 		"  --pointer-hysteresis <distance>  "
 			"If --grace used, minimum mouse motion needed to auto-unlock\n"
+		"  --loop-stats                     "
+			"Print event loop timing statistics on SIGRTMIN and at exit\n"
+		"  --nested-thread                  "
+			"Handle plugin clients on a separate thread\n"
+		"  --max-damage-rects <n>           "
+			"Forward at most <n> damage rectangles per plugin commit\n"
+		"  --shadow-buffers                 "
+			"Copy plugin shm buffers instead of forwarding them\n"
+		"  --max-fps [[<output>]:]<fps>     "
+			"Limit the frame rate of plugin programs\n"
+		"  --mailbox                        "
+			"Forward only the latest plugin frame once per refresh\n"
+		"  --mirror                         "
+			"Show one plugin surface on all identical outputs\n"
 		"  --command <cmd>                  "
 			"Indicates which program to run to draw backgrounds.\n"
 		"  --command-each <cmd>             "
@@ -1339,6 +1668,50 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 				state->args.plugin_per_output = true;
 			}
 			break;
+		case LO_LOOP_STATS:
+			if (state) {
+				state->args.loop_stats = true;
+			}
+			break;
+		case LO_NESTED_THREAD:
+			if (state) {
+				state->args.nested_thread = true;
+			}
+			break;
+		case LO_MAX_DAMAGE_RECTS:
+			if (state) {
+				char *end = NULL;
+				errno = 0;
+				unsigned long value = strtoul(optarg, &end, 10);
+				if (*end == '\0' && errno == 0 && value >= 1 &&
+						value <= INT_MAX) {
+					state->args.max_damage_rects = value;
+				} else {
+					swaylock_log(LOG_ERROR,
+						"Invalid value for max damage rects: '%s' is not a positive integer", optarg);
+				}
+			}
+			break;
+		case LO_SHADOW_BUFFERS:
+			if (state) {
+				state->args.shadow_buffers = true;
+			}
+			break;
+		case LO_MAX_FPS:
+			if (state) {
+				load_fps_limit(optarg, state);
+			}
+			break;
+		case LO_MAILBOX:
+			if (state) {
+				state->args.mailbox = true;
+			}
+			break;
+		case LO_MIRROR:
+			if (state) {
+				state->args.mirror = true;
+			}
+			break;
 		default:
 			fprintf(stderr, "%s", usage);
 			return 1;
@@ -1426,8 +1799,111 @@ static int load_config(char *path, struct swaylock_state *state,
 
 static struct swaylock_state state = {0};
 
+/*
+ * Send queued requests to the compositor. If the socket is full, wait for it
+ * to become writable, and until then stop reading requests from plugin
+ * clients, which would otherwise pile up in the outgoing buffer.
+ */
+static bool flush_upstream(struct swaylock_state *state) {
+	bool congested = false;
+	errno = 0;
+	if (wl_display_flush(state->display) == -1) {
+		if (errno != EAGAIN) {
+			return false;
+		}
+		congested = true;
+	}
+	if (congested != state->upstream_congested) {
+		swaylock_log(LOG_DEBUG, "Upstream connection %s",
+			congested ? "congested, pausing plugin clients" : "writable again");
+		state->upstream_congested = congested;
+		loop_update_fd(state->eventloop, wl_display_get_fd(state->display),
+			congested ? POLLIN | POLLOUT : POLLIN);
+		if (nested_thread_running) {
+			/* the nested thread checks upstream_congested before polling */
+			(void)write(nested_wake_fds[1], "1", 1);
+		} else if (state->server.loop) {
+			loop_update_fd(state->eventloop,
+				wl_event_loop_get_fd(state->server.loop),
+				congested ? 0 : POLLIN);
+		}
+	}
+	return true;
+}
+
+/* Flush requests to the compositor and events to plugin clients, before the
+ * main thread waits; with --nested-thread, upstream callbacks and timers on
+ * this thread also send events to plugins */
+static bool flush_all(void) {
+	pthread_mutex_lock(&nested_lock);
+	bool ok = flush_upstream(&state);
+	if (ok && state.server.display) {
+		// libwayland-server itself watches for a client socket
+		// becoming writable when it cannot be flushed entirely
+		wl_display_flush_clients(state.server.display);
+	}
+	pthread_mutex_unlock(&nested_lock);
+	return ok;
+}
+
+/* Dispatch upstream events which have already been read. With
+ * --nested-thread, compositor input is handled first and never waits for the
+ * nested thread; the redraws it causes wait for the lock, as they commit the
+ * surfaces that plugin content is committed to. */
+static bool dispatch_upstream_pending(void) {
+	if (state.input_queue) {
+		defer_render = true;
+		int ret = wl_display_dispatch_queue_pending(state.display,
+			state.input_queue);
+		defer_render = false;
+		if (ret == -1) {
+			return false;
+		}
+	}
+	pthread_mutex_lock(&nested_lock);
+	bool ok = wl_display_dispatch_pending(state.display) != -1 &&
+		!nested_thread_failed;
+	if (state.input_queue) {
+		struct swaylock_surface *surface;
+		wl_list_for_each(surface, &state.surfaces, link) {
+			render(surface);
+		}
+	}
+	pthread_mutex_unlock(&nested_lock);
+	return ok;
+}
+
+/* Runs without nested_lock; see loop_set_fd_unlocked() */
 static void display_in(int fd, short mask, void *data) {
-	if (wl_display_dispatch(state.display) == -1) {
+	if (mask & POLLOUT) {
+		pthread_mutex_lock(&nested_lock);
+		bool flushed = flush_upstream(&state);
+		pthread_mutex_unlock(&nested_lock);
+		if (!flushed) {
+			state.run_display = false;
+			return;
+		}
+	}
+	if (!(mask & (POLLIN | POLLHUP | POLLERR))) {
+		return;
+	}
+	// Not wl_display_dispatch(), which would block until a congested
+	// connection has been flushed
+	while (wl_display_prepare_read(state.display) != 0) {
+		if (!dispatch_upstream_pending()) {
+			state.run_display = false;
+			return;
+		}
+	}
+	if (wl_display_read_events(state.display) == -1) {
+		state.run_display = false;
+		return;
+	}
+	if (nested_thread_running) {
+		/* Some of the events read may be for the forwarding queue */
+		(void)write(nested_wake_fds[1], "1", 1);
+	}
+	if (!dispatch_upstream_pending()) {
 		state.run_display = false;
 	}
 }
@@ -1454,12 +1930,168 @@ static void comm_in(int fd, short mask, void *data) {
 }
 
 static void dispatch_nested(int fd, short mask, void *data) {
+	/* This fd has low priority, and each call handles one slice of plugin
+	 * traffic: libwayland-server reads at most once from each ready client
+	 * per dispatch, so clients are served round-robin, and upstream input
+	 * and auth replies are checked between slices by the loop. */
 	wl_event_loop_dispatch(state.server.loop, 0);
 	if (state.start_clientless_mode) {
 		setup_clientless_mode(&state);
 	}
 }
 
+/* Runs without nested_lock, like display_in() */
+static void nested_notify_in(int fd, short mask, void *data) {
+	char buf[16];
+	(void)read(fd, buf, sizeof(buf));
+	if (!dispatch_upstream_pending()) {
+		state.run_display = false;
+	}
+}
+
+static void *nested_thread_main(void *data) {
+	struct swaylock_state *state = data;
+	int display_fd = wl_display_get_fd(state->display);
+	int nested_fd = wl_event_loop_get_fd(state->server.loop);
+
+	pthread_mutex_lock(&nested_lock);
+	while (nested_thread_running) {
+		while (wl_display_prepare_read_queue(state->display,
+				state->forward.queue) != 0) {
+			if (wl_display_dispatch_queue_pending(state->display,
+					state->forward.queue) == -1) {
+				goto error;
+			}
+		}
+		wl_display_flush_clients(state->server.display);
+		if (!flush_upstream(state)) {
+			wl_display_cancel_read(state->display);
+			goto error;
+		}
+		struct pollfd fds[] = {
+			{ .fd = display_fd, .events = POLLIN },
+			/* see flush_upstream() */
+			{ .fd = nested_fd, .events = state->upstream_congested ? 0 : POLLIN },
+			{ .fd = nested_wake_fds[0], .events = POLLIN },
+		};
+		pthread_mutex_unlock(&nested_lock);
+
+		// The read intent is resolved without holding the lock, so that
+		// the main thread can take it while waiting in
+		// wl_display_read_events for this thread to read or cancel.
+		int ret = poll(fds, sizeof(fds) / sizeof(fds[0]), -1);
+		if (ret > 0 && (fds[0].revents & POLLIN)) {
+			if (wl_display_read_events(state->display) == 0) {
+				/* Some of the events read may be for the default queue */
+				(void)write(nested_notify_fds[1], "1", 1);
+			}
+		} else {
+			wl_display_cancel_read(state->display);
+		}
+		if (ret > 0 && (fds[2].revents & POLLIN)) {
+			char buf[16];
+			(void)read(nested_wake_fds[0], buf, sizeof(buf));
+		}
+
+		pthread_mutex_lock(&nested_lock);
+		if (wl_display_dispatch_queue_pending(state->display,
+				state->forward.queue) == -1) {
+			goto error;
+		}
+		if (ret > 0 && (fds[1].revents & POLLIN)) {
+			wl_event_loop_dispatch(state->server.loop, 0);
+			if (state->start_clientless_mode) {
+				setup_clientless_mode(state);
+			}
+		}
+	}
+	pthread_mutex_unlock(&nested_lock);
+	return NULL;
+
+error:
+	nested_thread_failed = true;
+	(void)write(nested_notify_fds[1], "1", 1);
+	pthread_mutex_unlock(&nested_lock);
+	return NULL;
+}
+
+static void nested_lock_release(void *data) {
+	pthread_mutex_unlock(&nested_lock);
+}
+
+static void nested_lock_acquire(void *data) {
+	pthread_mutex_lock(&nested_lock);
+}
+
+/* Outside of loop callbacks, the main thread takes nested_lock explicitly
+ * around code that touches shared state */
+static bool start_nested_thread(struct swaylock_state *state) {
+	nested_thread_running = true;
+	nested_thread_failed = false;
+	int err = pthread_create(&nested_thread, NULL, nested_thread_main, state);
+	if (err != 0) {
+		swaylock_log(LOG_ERROR, "Failed to start nested server thread: %s",
+			strerror(err));
+		nested_thread_running = false;
+		return false;
+	}
+	loop_set_lock_hooks(state->eventloop, nested_lock_acquire,
+		nested_lock_release, NULL);
+	return true;
+}
+
+static void stop_nested_thread(struct swaylock_state *state) {
+	if (!nested_thread_running) {
+		return;
+	}
+	pthread_mutex_lock(&nested_lock);
+	nested_thread_running = false;
+	pthread_mutex_unlock(&nested_lock);
+	(void)write(nested_wake_fds[1], "1", 1);
+	loop_set_lock_hooks(state->eventloop, NULL, NULL, NULL);
+	pthread_join(nested_thread, NULL);
+}
+
+static void *wrap_for_forwarding(struct forward_state *forward, void *proxy) {
+	if (!proxy) {
+		return NULL;
+	}
+	void *wrapper = wl_proxy_create_wrapper(proxy);
+	if (!wrapper) {
+		swaylock_log(LOG_ERROR, "Failed to create proxy wrapper");
+		exit(EXIT_FAILURE);
+	}
+	wl_proxy_set_queue(wrapper, forward->queue);
+	return wrapper;
+}
+
+/* Make upstream objects created for plugins use the forwarding queue */
+static void setup_forwarding_queue(struct swaylock_state *state) {
+	struct forward_state *forward = &state->forward;
+	forward->queue = wl_display_create_queue(state->display);
+	if (!forward->queue) {
+		swaylock_log(LOG_ERROR, "Failed to create forwarding event queue");
+		exit(EXIT_FAILURE);
+	}
+	forward->compositor = wrap_for_forwarding(forward, forward->compositor);
+	forward->subcompositor = wrap_for_forwarding(forward, forward->subcompositor);
+	forward->shm = wrap_for_forwarding(forward, forward->shm);
+	forward->drm = wrap_for_forwarding(forward, forward->drm);
+	forward->linux_dmabuf = wrap_for_forwarding(forward, forward->linux_dmabuf);
+	forward->viewporter = wrap_for_forwarding(forward, forward->viewporter);
+	forward->single_pixel_buffer_manager = wrap_for_forwarding(forward,
+		forward->single_pixel_buffer_manager);
+	forward->presentation = wrap_for_forwarding(forward, forward->presentation);
+	forward->fifo_manager = wrap_for_forwarding(forward, forward->fifo_manager);
+	forward->commit_timing_manager = wrap_for_forwarding(forward,
+		forward->commit_timing_manager);
+	forward->syncobj_manager = wrap_for_forwarding(forward, forward->syncobj_manager);
+	forward->fractional_scale = wrap_for_forwarding(forward, forward->fractional_scale);
+	forward->color_management = wrap_for_forwarding(forward, forward->color_management);
+	forward->color_representation = wrap_for_forwarding(forward,
+		forward->color_representation);
+}
+
 static void xdg_output_destroy_func(struct wl_resource *resource) {
 	/* remove xdg output resource from surface's list of them (or if surface
 	 * is gone, from the stale list */
@@ -1589,9 +2221,9 @@ static void zwlr_layer_surface_get_popup(struct wl_client *client,
 		struct wl_resource *resource, struct wl_resource *popup) {
 	/* should never be called, as no xdg_popup can be ever be created */
 }
-static void zwlr_layer_surface_ack_configure(struct wl_client *client,
-	struct wl_resource *resource, uint32_t serial) {
-	struct swaylock_surface *surface = wl_resource_get_user_data(resource);
+/* Handle an ack_configure from either the layer surface or the xdg_surface */
+static void ack_plugin_configure(struct wl_client *client,
+		struct swaylock_surface *surface, uint32_t serial) {
 	struct forward_surface *plugin_surf = surface->plugin_surface;
 
 	if (serial == plugin_surf->last_used_plugin_serial) {
@@ -1602,38 +2234,24 @@ static void zwlr_layer_surface_ack_configure(struct wl_client *client,
 	}
 	plugin_surf->last_used_plugin_serial = serial;
 
-	uint32_t upstream_serial = -1;
-	bool found_serial = false;
-	for (size_t i = 0; i < plugin_surf->serial_table_len; i++) {
-		// fprintf(stderr, "serial check (%zu): %u -> %u =? %u\n", i, plugin_surf->serial_table[i].upstream_serial,
-		//	plugin_surf->serial_table[i].plugin_serial, serial);
-		if (plugin_surf->serial_table[i].plugin_serial == serial) {
-			struct serial_pair entry = plugin_surf->serial_table[i];
-			upstream_serial = entry.upstream_serial;
-			found_serial = true;
-			bool local_only = entry.local_only;
-			plugin_surf->last_acked_width = entry.config_width;
-			plugin_surf->last_acked_height = entry.config_height;
-
-			/* once a serial is used, discard both it and serials older than it */
-			memmove(plugin_surf->serial_table, plugin_surf->serial_table + (i + 1),
-				(plugin_surf->serial_table_len - (i + 1))
-					* sizeof(struct serial_pair) );
-			plugin_surf->serial_table_len -= (i+1);
-
-			if (local_only) {
-				// This serial was sent by us, not in response
-				// to an upstream configure, so do not forward it
-				return;
-			}
-			break;
-		}
-	}
-	if (!found_serial) {
+	struct serial_pair entry;
+	if (!take_serial_pair(plugin_surf, serial, &entry)) {
 		// todo: get right message
 		wl_client_post_implementation_error(client, "used ack configure with invalid serial");
 		return;
 	}
+	plugin_surf->last_acked_width = entry.config_width;
+	plugin_surf->last_acked_height = entry.config_height;
+	if (plugin_surf->configure_coalesced && plugin_surf->serial_ring_len == 0) {
+		/* upstream configures arrived since the one acknowledged */
+		send_newest_configure(surface);
+	}
+	if (entry.local_only) {
+		// This serial was sent by us, not in response
+		// to an upstream configure, so do not forward it
+		return;
+	}
+	uint32_t upstream_serial = entry.upstream_serial;
 
 	/* Do not send the ack_configure immediately; this avoids a race condition
 	 * where the plugin sends ack_configure, and before it sends the matching
@@ -1644,6 +2262,11 @@ static void zwlr_layer_surface_ack_configure(struct wl_client *client,
 	surface->has_pending_ack_conf = true;
 	surface->pending_upstream_serial = upstream_serial;
 }
+static void zwlr_layer_surface_ack_configure(struct wl_client *client,
+	struct wl_resource *resource, uint32_t serial) {
+	struct swaylock_surface *surface = wl_resource_get_user_data(resource);
+	ack_plugin_configure(client, surface, serial);
+}
 static void zwlr_layer_surface_destroy(struct wl_client *client,
 		struct wl_resource *resource) {
 	/* no resource to clean up */
@@ -1672,6 +2295,89 @@ static const struct zwlr_layer_surface_v1_interface layer_surface_impl = {
 	.set_exclusive_edge = zwlr_layer_surface_set_exclusive_edge,
 };
 
+/* Lookup output for a client started for a single output; returns null for
+ * the main client */
+static struct swaylock_surface *client_unique_output(struct swaylock_state *state,
+		struct wl_client *client) {
+	struct swaylock_bg_client *bg_client;
+	wl_list_for_each(bg_client, &state->server.clients, link) {
+		if (bg_client->client == client) {
+			return bg_client->unique_output;
+		}
+	}
+	return NULL;
+}
+
+/* Make the plugin surface provide the contents of the given lock surface;
+ * returns false (after posting an error) if either already has a partner.
+ * `role` names the role object being created, for error messages */
+static bool assign_plugin_surface(struct wl_client *client,
+		struct forward_surface *surf, struct swaylock_surface *sw_surface,
+		const char *role) {
+	// todo: replace the old surface instead; this will simplify implementation
+	// of plugin command restarting
+	if (sw_surface->plugin_surface) {
+		wl_client_post_implementation_error(client, "Tried to get a new %s for an output that already has one.", role);
+		return false;
+	}
+	if (surf->sway_surface) {
+		wl_client_post_implementation_error(client, "Tried to get a new %s for a surface that already has one.", role);
+		return false;
+	}
+	if (surf->subsurface) {
+		wl_client_post_implementation_error(client, "Tried to get a new %s for a subsurface.", role);
+		return false;
+	}
+
+	sw_surface->plugin_surface = surf;
+	surf->sway_surface = sw_surface;
+	if (sw_surface->viewport) {
+		/* render_fallback_surface() may have set a destination; the
+		 * plugin surface's viewport state is forwarded only as it
+		 * changes, so start from the unset state it assumes */
+		wl_fixed_t n = wl_fixed_from_int(-1);
+		wp_viewport_set_source(sw_surface->viewport, n, n, n, n);
+		wp_viewport_set_destination(sw_surface->viewport, -1, -1);
+		surf->committed.viewport_source_x = n;
+		surf->committed.viewport_source_y = n;
+		surf->committed.viewport_source_w = n;
+		surf->committed.viewport_source_h = n;
+		surf->committed.viewport_dest_width = -1;
+		surf->committed.viewport_dest_height = -1;
+	}
+	adopt_surface_dmabuf_feedback(surf);
+	send_preferred_buffer_state(surf);
+	create_upstream_subsurfaces(surf);
+
+	/* consume a serial, and do not reveal it to the client, for the purpose
+	 * of ensuring this value is unique. todo: simpler solution */
+	struct swaylock_bg_client *bg_client = sw_surface->client ?
+		sw_surface->client : sw_surface->state->server.main_client;
+	assert(bg_client);
+	assert(bg_client->client == client);
+	surf->last_used_plugin_serial = bg_client->serial++;
+
+	/* Notify client immediately of surface fractional scale, if possible and it is available */
+	if (sw_surface->last_fractional_scale > 0 && surf->fractional_scale) {
+		wp_fractional_scale_v1_send_preferred_scale(surf->fractional_scale,
+			sw_surface->last_fractional_scale);
+	}
+	return true;
+}
+
+/* Undo assign_plugin_surface when the role object is destroyed. As when a
+ * plugin surface is destroyed, the lock surface keeps its last contents
+ * until a plugin surface is assigned to it again */
+static void unassign_plugin_surface(struct forward_surface *surf) {
+	struct swaylock_surface *sw_surface = surf->sway_surface;
+	if (!sw_surface) {
+		return;
+	}
+	unmap_plugin_surface(surf);
+	sw_surface->plugin_surface = NULL;
+	surf->sway_surface = NULL;
+}
+
 void wlr_layer_shell_get_layer_surface(struct wl_client *client,
 		struct wl_resource *resource, uint32_t id, struct wl_resource *surface,
 		struct wl_resource *output, uint32_t layer, const char *namespace) {
@@ -1688,27 +2394,14 @@ void wlr_layer_shell_get_layer_surface(struct wl_client *client,
 		sw_surface = wl_resource_get_user_data(output);
 		assert(sw_surface);
 	} else {
-		// Lookup output for client
-		struct swaylock_bg_client *bg_client;
-		wl_list_for_each(bg_client, &state->server.clients, link) {
-			if (bg_client->client == client) {
-				sw_surface = bg_client->unique_output;
-			}
-		}
+		sw_surface = client_unique_output(state, client);
 		if (!sw_surface) {
 			swaylock_log(LOG_ERROR, "Failed to find an output matching client");
 			return;
 		}
 	}
 
-	// todo: replace the old surface instead; this will simplify implementation
-	// of plugin command restarting
-	if (sw_surface->plugin_surface) {
-		wl_client_post_implementation_error(client, "Tried to get a new layer surface for an output that already has one.");
-		return;
-	}
-	if (surf->sway_surface) {
-		wl_client_post_implementation_error(client, "Tried to get a new layer surface for a surface that already has one.");
+	if (!assign_plugin_surface(client, surf, sw_surface, "layer surface")) {
 		return;
 	}
 	/* normal programs will only use the BACKGROUND layer, but there is no reason
@@ -1717,17 +2410,6 @@ void wlr_layer_shell_get_layer_surface(struct wl_client *client,
 	/* not important */
 	(void)namespace;
 
-	sw_surface->plugin_surface = surf;
-	surf->sway_surface = sw_surface;
-
-	/* consume a serial, and do not reveal it to the client, for the purpose
-	 * of ensuring this value is unique. todo: simpler solution */
-	struct swaylock_bg_client *bg_client = sw_surface->client ?
-		sw_surface->client : sw_surface->state->server.main_client;
-	assert(bg_client);
-	assert(bg_client->client == client);
-	surf->last_used_plugin_serial = bg_client->serial++;
-
 	/* now, create the object that was asked for */
 	struct wl_resource *layer_surface_resource = wl_resource_create(client,
 		&zwlr_layer_surface_v1_interface, wl_resource_get_version(resource), id);
@@ -1739,12 +2421,6 @@ void wlr_layer_shell_get_layer_surface(struct wl_client *client,
 
 	surf->layer_surface = layer_surface_resource;
 
-	/* Notify client immediately of surface fractional scale, if possible and it is available */
-	if (sw_surface->last_fractional_scale > 0 && surf->fractional_scale) {
-		wp_fractional_scale_v1_send_preferred_scale(surf->fractional_scale,
-			sw_surface->last_fractional_scale);
-	}
-
 	// todo: when plugin surface commits, proceed?
 }
 
@@ -1769,11 +2445,410 @@ static void bind_wlr_layer_shell(struct wl_client *client, void *data, uint32_t
 	wl_resource_set_implementation(resource, &zwlr_layer_shell_v1_impl, state, NULL);
 }
 
+void send_plugin_configure(struct forward_surface *surface, uint32_t serial,
+		uint32_t width, uint32_t height) {
+	if (surface->layer_surface) {
+		zwlr_layer_surface_v1_send_configure(surface->layer_surface,
+			serial, width, height);
+	} else if (surface->xdg_toplevel) {
+		/* the toplevel is shown fullscreen on the lock surface */
+		struct wl_array states;
+		wl_array_init(&states);
+		uint32_t *toplevel_states = wl_array_add(&states, 2 * sizeof(uint32_t));
+		if (toplevel_states) {
+			toplevel_states[0] = XDG_TOPLEVEL_STATE_FULLSCREEN;
+			toplevel_states[1] = XDG_TOPLEVEL_STATE_ACTIVATED;
+		}
+		xdg_toplevel_send_configure(surface->xdg_toplevel, width, height, &states);
+		wl_array_release(&states);
+		xdg_surface_send_configure(surface->xdg_surface, serial);
+	}
+}
+
+void send_plugin_closed(struct forward_surface *surface) {
+	if (surface->layer_surface) {
+		zwlr_layer_surface_v1_send_closed(surface->layer_surface);
+	} else if (surface->xdg_toplevel) {
+		xdg_toplevel_send_close(surface->xdg_toplevel);
+	}
+}
+
+static void xdg_toplevel_handle_resource_destroy(struct wl_resource *resource) {
+	struct forward_surface *surf = wl_resource_get_user_data(resource);
+	if (surf) {
+		/* destroying the role object unmaps the surface */
+		surf->xdg_toplevel = NULL;
+		unassign_plugin_surface(surf);
+	}
+}
+static void xdg_toplevel_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+static void xdg_toplevel_set_parent(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *parent) {
+	/* ignore this, there is only one toplevel per output */
+}
+static void xdg_toplevel_set_title(struct wl_client *client,
+		struct wl_resource *resource, const char *title) {
+	/* not important */
+}
+static void xdg_toplevel_set_app_id(struct wl_client *client,
+		struct wl_resource *resource, const char *app_id) {
+	/* not important */
+}
+static void xdg_toplevel_show_window_menu(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *seat,
+		uint32_t serial, int32_t x, int32_t y) {
+	/* ignore this, no input will be sent anyway */
+}
+static void xdg_toplevel_move(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *seat, uint32_t serial) {
+	/* ignore this, no input will be sent anyway */
+}
+static void xdg_toplevel_resize(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *seat,
+		uint32_t serial, uint32_t edges) {
+	/* ignore this, no input will be sent anyway */
+}
+static void xdg_toplevel_set_max_size(struct wl_client *client,
+		struct wl_resource *resource, int32_t width, int32_t height) {
+	/* ignore this, will always fill the output */
+}
+static void xdg_toplevel_set_min_size(struct wl_client *client,
+		struct wl_resource *resource, int32_t width, int32_t height) {
+	/* ignore this, will always fill the output */
+}
+static void xdg_toplevel_set_maximized(struct wl_client *client,
+		struct wl_resource *resource) {
+	/* ignore this, will always be fullscreen */
+}
+static void xdg_toplevel_unset_maximized(struct wl_client *client,
+		struct wl_resource *resource) {
+	/* ignore this, will always be fullscreen */
+}
+static void xdg_toplevel_set_fullscreen(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *output) {
+	/* ignore this; the output was chosen when the toplevel was created */
+}
+static void xdg_toplevel_unset_fullscreen(struct wl_client *client,
+		struct wl_resource *resource) {
+	/* ignore this, will always be fullscreen */
+}
+static void xdg_toplevel_set_minimized(struct wl_client *client,
+		struct wl_resource *resource) {
+	/* ignore this, will always be fullscreen */
+}
+
+static const struct xdg_toplevel_interface xdg_toplevel_impl = {
+	.destroy = xdg_toplevel_destroy,
+	.set_parent = xdg_toplevel_set_parent,
+	.set_title = xdg_toplevel_set_title,
+	.set_app_id = xdg_toplevel_set_app_id,
+	.show_window_menu = xdg_toplevel_show_window_menu,
+	.move = xdg_toplevel_move,
+	.resize = xdg_toplevel_resize,
+	.set_max_size = xdg_toplevel_set_max_size,
+	.set_min_size = xdg_toplevel_set_min_size,
+	.set_maximized = xdg_toplevel_set_maximized,
+	.unset_maximized = xdg_toplevel_unset_maximized,
+	.set_fullscreen = xdg_toplevel_set_fullscreen,
+	.unset_fullscreen = xdg_toplevel_unset_fullscreen,
+	.set_minimized = xdg_toplevel_set_minimized,
+};
+
+static void xdg_surface_handle_resource_destroy(struct wl_resource *resource) {
+	struct forward_surface *surf = wl_resource_get_user_data(resource);
+	if (surf) {
+		surf->xdg_surface = NULL;
+	}
+}
+static void xdg_surface_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	struct forward_surface *surf = wl_resource_get_user_data(resource);
+	if (surf && surf->xdg_toplevel) {
+		wl_resource_post_error(resource, XDG_SURFACE_ERROR_DEFUNCT_ROLE_OBJECT,
+			"xdg_surface destroyed before its xdg_toplevel");
+		return;
+	}
+	wl_resource_destroy(resource);
+}
+static void xdg_surface_get_toplevel(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id) {
+	struct forward_surface *surf = wl_resource_get_user_data(resource);
+	if (!surf) {
+		wl_resource_post_error(resource, XDG_SURFACE_ERROR_DEFUNCT_ROLE_OBJECT,
+			"the wl_surface of the xdg_surface was destroyed");
+		return;
+	}
+	if (surf->xdg_toplevel || surf->sway_surface) {
+		wl_resource_post_error(resource, XDG_SURFACE_ERROR_ALREADY_CONSTRUCTED,
+			"xdg_surface already has a role object");
+		return;
+	}
+	struct swaylock_state *state = wl_container_of(surf->state, state, forward);
+
+	/* Each toplevel fills an entire lock surface; clients started for a
+	 * single output get that output, and the main client gets the first
+	 * output which has no plugin surface yet. */
+	struct swaylock_surface *sw_surface = NULL;
+	if (state->server.main_client && client == state->server.main_client->client) {
+		struct swaylock_surface *iter;
+		wl_list_for_each(iter, &state->surfaces, link) {
+			if (!iter->plugin_surface && iter->nested_server_output) {
+				sw_surface = iter;
+				break;
+			}
+		}
+	} else {
+		sw_surface = client_unique_output(state, client);
+	}
+	if (!sw_surface) {
+		wl_client_post_implementation_error(client, "Failed to find a free output for the xdg_toplevel");
+		return;
+	}
+	if (!assign_plugin_surface(client, surf, sw_surface, "xdg_toplevel")) {
+		return;
+	}
+
+	struct wl_resource *toplevel_resource = wl_resource_create(client,
+		&xdg_toplevel_interface, wl_resource_get_version(resource), id);
+	if (toplevel_resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(toplevel_resource, &xdg_toplevel_impl,
+		surf, xdg_toplevel_handle_resource_destroy);
+	surf->xdg_toplevel = toplevel_resource;
+
+	/* the initial configure is sent on the first commit, as for layer surfaces */
+	if (wl_resource_get_version(toplevel_resource) >= XDG_TOPLEVEL_CONFIGURE_BOUNDS_SINCE_VERSION) {
+		xdg_toplevel_send_configure_bounds(toplevel_resource,
+			sw_surface->width, sw_surface->height);
+	}
+	if (wl_resource_get_version(toplevel_resource) >= XDG_TOPLEVEL_WM_CAPABILITIES_SINCE_VERSION) {
+		/* no window menu, maximize, fullscreen toggling, or minimize */
+		struct wl_array capabilities;
+		wl_array_init(&capabilities);
+		xdg_toplevel_send_wm_capabilities(toplevel_resource, &capabilities);
+		wl_array_release(&capabilities);
+	}
+}
+static void xdg_surface_get_popup(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id, struct wl_resource *parent,
+		struct wl_resource *positioner) {
+	/* a lock screen background has no use for popups */
+	wl_client_post_implementation_error(client, "xdg_popup is not supported");
+}
+static void xdg_surface_set_window_geometry(struct wl_client *client,
+		struct wl_resource *resource, int32_t x, int32_t y,
+		int32_t width, int32_t height) {
+	/* ignore this, the entire buffer is shown on the lock surface */
+}
+static void xdg_surface_ack_configure(struct wl_client *client,
+		struct wl_resource *resource, uint32_t serial) {
+	struct forward_surface *surf = wl_resource_get_user_data(resource);
+	if (!surf || !surf->sway_surface) {
+		/* the toplevel was never mapped, or its output is gone */
+		return;
+	}
+	ack_plugin_configure(client, surf->sway_surface, serial);
+}
+
+static const struct xdg_surface_interface xdg_surface_impl = {
+	.destroy = xdg_surface_destroy,
+	.get_toplevel = xdg_surface_get_toplevel,
+	.get_popup = xdg_surface_get_popup,
+	.set_window_geometry = xdg_surface_set_window_geometry,
+	.ack_configure = xdg_surface_ack_configure,
+};
+
+static void xdg_positioner_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+static void xdg_positioner_set_size(struct wl_client *client,
+		struct wl_resource *resource, int32_t width, int32_t height) {
+	/* ignore this, positioners are only used for popups */
+}
+static void xdg_positioner_set_anchor_rect(struct wl_client *client,
+		struct wl_resource *resource, int32_t x, int32_t y,
+		int32_t width, int32_t height) {
+	/* ignore this, positioners are only used for popups */
+}
+static void xdg_positioner_set_anchor(struct wl_client *client,
+		struct wl_resource *resource, uint32_t anchor) {
+	/* ignore this, positioners are only used for popups */
+}
+static void xdg_positioner_set_gravity(struct wl_client *client,
+		struct wl_resource *resource, uint32_t gravity) {
+	/* ignore this, positioners are only used for popups */
+}
+static void xdg_positioner_set_constraint_adjustment(struct wl_client *client,
+		struct wl_resource *resource, uint32_t constraint_adjustment) {
+	/* ignore this, positioners are only used for popups */
+}
+static void xdg_positioner_set_offset(struct wl_client *client,
+		struct wl_resource *resource, int32_t x, int32_t y) {
+	/* ignore this, positioners are only used for popups */
+}
+static void xdg_positioner_set_reactive(struct wl_client *client,
+		struct wl_resource *resource) {
+	/* ignore this, positioners are only used for popups */
+}
+static void xdg_positioner_set_parent_size(struct wl_client *client,
+		struct wl_resource *resource, int32_t width, int32_t height) {
+	/* ignore this, positioners are only used for popups */
+}
+static void xdg_positioner_set_parent_configure(struct wl_client *client,
+		struct wl_resource *resource, uint32_t serial) {
+	/* ignore this, positioners are only used for popups */
+}
+
+static const struct xdg_positioner_interface xdg_positioner_impl = {
+	.destroy = xdg_positioner_destroy,
+	.set_size = xdg_positioner_set_size,
+	.set_anchor_rect = xdg_positioner_set_anchor_rect,
+	.set_anchor = xdg_positioner_set_anchor,
+	.set_gravity = xdg_positioner_set_gravity,
+	.set_constraint_adjustment = xdg_positioner_set_constraint_adjustment,
+	.set_offset = xdg_positioner_set_offset,
+	.set_reactive = xdg_positioner_set_reactive,
+	.set_parent_size = xdg_positioner_set_parent_size,
+	.set_parent_configure = xdg_positioner_set_parent_configure,
+};
+
+static void xdg_wm_base_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+static void xdg_wm_base_create_positioner(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id) {
+	struct wl_resource *positioner = wl_resource_create(client,
+		&xdg_positioner_interface, wl_resource_get_version(resource), id);
+	if (positioner == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(positioner, &xdg_positioner_impl, NULL, NULL);
+}
+static void xdg_wm_base_get_xdg_surface(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id, struct wl_resource *surface) {
+	struct forward_surface *surf = wl_resource_get_user_data(surface);
+	if (surf->xdg_surface || surf->layer_surface || surf->sway_surface ||
+			surf->subsurface) {
+		wl_resource_post_error(resource, XDG_WM_BASE_ERROR_ROLE,
+			"wl_surface already has a role");
+		return;
+	}
+	if (surf->committed.attachment || surf->pending.attachment) {
+		wl_resource_post_error(resource, XDG_WM_BASE_ERROR_INVALID_SURFACE_STATE,
+			"wl_surface already has a buffer attached");
+		return;
+	}
+
+	struct wl_resource *xdg_surface_resource = wl_resource_create(client,
+		&xdg_surface_interface, wl_resource_get_version(resource), id);
+	if (xdg_surface_resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(xdg_surface_resource, &xdg_surface_impl,
+		surf, xdg_surface_handle_resource_destroy);
+	surf->xdg_surface = xdg_surface_resource;
+}
+static void xdg_wm_base_pong(struct wl_client *client,
+		struct wl_resource *resource, uint32_t serial) {
+	/* no pings are sent */
+}
+
+static const struct xdg_wm_base_interface xdg_wm_base_impl = {
+	.destroy = xdg_wm_base_destroy,
+	.create_positioner = xdg_wm_base_create_positioner,
+	.get_xdg_surface = xdg_wm_base_get_xdg_surface,
+	.pong = xdg_wm_base_pong,
+};
+
+static void bind_xdg_wm_base(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+	struct wl_resource *resource =
+		wl_resource_create(client, &xdg_wm_base_interface, version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &xdg_wm_base_impl, NULL, NULL);
+}
+
+/* Scale an 8 bit color channel, premultiplied by an 8 bit alpha, to 32 bits */
+static uint32_t premultiplied_channel_u32(uint32_t channel, uint32_t alpha) {
+	return (uint32_t)(((uint64_t)channel * alpha * UINT32_MAX) / (255 * 255));
+}
+
+/* Return a buffer that shows the background color when scaled to any size by
+ * the viewport; created once per surface, since the color does not change. */
+static struct wl_buffer *get_fallback_buffer(struct swaylock_surface *surface) {
+	if (surface->fallback_buffer) {
+		return surface->fallback_buffer;
+	}
+
+	uint32_t color = surface->state->args.colors.background;
+	if (surface->state->single_pixel_buffer_manager) {
+		uint32_t alpha = color & 0xff;
+		surface->fallback_buffer = wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+			surface->state->single_pixel_buffer_manager,
+			premultiplied_channel_u32((color >> 24) & 0xff, alpha),
+			premultiplied_channel_u32((color >> 16) & 0xff, alpha),
+			premultiplied_channel_u32((color >> 8) & 0xff, alpha),
+			premultiplied_channel_u32(0xff, alpha));
+		return surface->fallback_buffer;
+	}
+
+	if (!create_buffer(surface->state->shm, &surface->fallback_shm, 1, 1,
+			WL_SHM_FORMAT_ARGB8888)) {
+		swaylock_log(LOG_ERROR,
+			     "Failed to create new buffer for frame background.");
+		return NULL;
+	}
+	cairo_set_source_u32(surface->fallback_shm.cairo, color);
+	cairo_set_operator(surface->fallback_shm.cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(surface->fallback_shm.cairo);
+	cairo_surface_flush(surface->fallback_shm.surface);
+	surface->fallback_buffer = surface->fallback_shm.buffer;
+	return surface->fallback_buffer;
+}
+
 static void render_fallback_surface(struct swaylock_surface *surface) {
-	// create a new buffer each time; this is a fallback path, so efficiency
-	// is much less important than correctness. That being said, if wp_viewporter
-	// were always available, one could instead make a single-pixel buffer in advance
+	if (surface->syncobj_surface) {
+		/* left by a plugin; the fallback buffers have no sync points */
+		wp_linux_drm_syncobj_surface_v1_destroy(surface->syncobj_surface);
+		surface->syncobj_surface = NULL;
+	}
+	/* replace the plugin's opaque region; the fallback fills the whole
+	 * surface with the background color */
+	set_opaque_region(surface,
+		(surface->state->args.colors.background & 0xff) == 0xff);
+	if (surface->viewport) {
+		struct wl_buffer *buffer = get_fallback_buffer(surface);
+		if (!buffer) {
+			return;
+		}
+		/* Reset any state a plugin left on the surface; the compositor keeps
+		 * its own copy of the 1x1 buffer, so it can be reattached while busy */
+		wp_viewport_set_source(surface->viewport, wl_fixed_from_int(-1),
+			wl_fixed_from_int(-1), wl_fixed_from_int(-1), wl_fixed_from_int(-1));
+		wp_viewport_set_destination(surface->viewport, surface->width, surface->height);
+		wl_surface_set_buffer_scale(surface->surface, 1);
+		wl_surface_set_buffer_transform(surface->surface, WL_OUTPUT_TRANSFORM_NORMAL);
+		wl_surface_attach(surface->surface, buffer, 0, 0);
+		wl_surface_damage_buffer(surface->surface, 0, 0, INT32_MAX, INT32_MAX);
+		wl_surface_commit(surface->surface);
+
+		surface->has_buffer = true;
+		return;
+	}
 
+	// Without wp_viewporter, the buffer must match the surface size; create a
+	// new buffer each time, as this is a rarely used path.
 	struct pool_buffer buffer;
 	if (!create_buffer(surface->state->shm, &buffer, surface->width, surface->height,
 			WL_SHM_FORMAT_ARGB8888)) {
@@ -2091,8 +3166,8 @@ static bool run_plugin_command(struct swaylock_state *state,
 	// count time in a suspended state; the callback will only mark the client
 	// as broken/not responding if it spends 10 seconds with the system active
 	// not doing anything
-	bg_client->client_connect_timer = loop_add_timer(state->eventloop,
-		TIMEOUT_CONNECT, client_connection_timeout, bg_client);
+	bg_client->client_connect_timer = loop_add_timer_slack(state->eventloop,
+		TIMEOUT_CONNECT, TIMEOUT_SLACK, client_connection_timeout, bg_client);
 
 	bg_client->client_destroy_listener.notify = client_destroyed;
 	bg_client->client_resource_create_listener.notify = client_resource_create;
@@ -2141,6 +3216,12 @@ static void term_in(int fd, short mask, void *data) {
 	state.run_display = false;
 }
 
+static void stats_in(int fd, short mask, void *data) {
+	char buf[16];
+	(void)read(fd, buf, sizeof(buf));
+	loop_print_stats(state.eventloop);
+}
+
 static void lock_in(int fd, short mask, void *data) {
 	/* On receipt of SIGUSR2, end the grace period */
 	if (state.grace_timer) {
@@ -2270,8 +3351,10 @@ int main(int argc, char **argv) {
 		.plugin_command = NULL,
 		.grace_time = 0.0f,
 		.grace_pointer_hysteresis = 10.0f,
+		.max_damage_rects = 32,
 	};
 	wl_list_init(&state.images);
+	wl_list_init(&state.fps_limits);
 	set_default_colors(&state.args.colors);
 
 	char *config_path = NULL;
@@ -2341,6 +3424,38 @@ int main(int argc, char **argv) {
 		swaylock_log(LOG_ERROR, "Failed to make pipe end nonblocking");
 		return EXIT_FAILURE;
 	}
+	if (state.args.nested_thread) {
+		if (pipe(nested_wake_fds) != 0 || pipe(nested_notify_fds) != 0) {
+			swaylock_log(LOG_ERROR, "Failed to pipe");
+			return EXIT_FAILURE;
+		}
+		for (int i = 0; i < 2; i++) {
+			if (!set_cloexec(nested_wake_fds[i]) || !set_cloexec(nested_notify_fds[i])) {
+				swaylock_log(LOG_ERROR, "Failed to make pipes close-on-exec");
+				return EXIT_FAILURE;
+			}
+			if (fcntl(nested_wake_fds[i], F_SETFL, O_NONBLOCK) == -1 ||
+					fcntl(nested_notify_fds[i], F_SETFL, O_NONBLOCK) == -1) {
+				swaylock_log(LOG_ERROR, "Failed to make pipe end nonblocking");
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	if (state.args.loop_stats) {
+		if (pipe(sigstats_fds) != 0) {
+			swaylock_log(LOG_ERROR, "Failed to pipe");
+			return EXIT_FAILURE;
+		}
+		if (!set_cloexec(sigstats_fds[0]) || !set_cloexec(sigstats_fds[1])) {
+			swaylock_log(LOG_ERROR, "Failed to make pipes close-on-exec");
+			return EXIT_FAILURE;
+		}
+		if (fcntl(sigstats_fds[0], F_SETFL, O_NONBLOCK) == -1 ||
+				fcntl(sigstats_fds[1], F_SETFL, O_NONBLOCK) == -1) {
+			swaylock_log(LOG_ERROR, "Failed to make pipe end nonblocking");
+			return EXIT_FAILURE;
+		}
+	}
 
 	// temp: make all backgrounds use some sort of plugin command
 	if (!state.args.plugin_command) {
@@ -2374,6 +3489,9 @@ int main(int argc, char **argv) {
 	}
 
 	state.eventloop = loop_create();
+	if (state.args.loop_stats) {
+		loop_enable_stats(state.eventloop);
+	}
 
 	wl_list_init(&state.surfaces);
 	state.xkb.context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
@@ -2386,15 +3504,26 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
+	if (state.args.nested_thread) {
+		state.input_queue = wl_display_create_queue(state.display);
+		if (!state.input_queue) {
+			swaylock_log(LOG_ERROR, "Failed to create input event queue");
+			return EXIT_FAILURE;
+		}
+	}
+
 	struct wl_registry *registry = wl_display_get_registry(state.display);
 	wl_registry_add_listener(registry, &registry_listener, &state);
 	state.forward.upstream_display = state.display;
+	state.forward.max_damage_rects = state.args.max_damage_rects;
+	state.forward.shadow_buffers = state.args.shadow_buffers;
+	state.forward.mailbox = state.args.mailbox;
+	state.forward.eventloop = state.eventloop;
 	state.forward.upstream_registry = registry;
-	wl_list_init(&state.forward.feedback_instances);
+	init_forward_state(&state.forward);
 	wl_list_init(&state.stale_wl_output_resources);
 	wl_list_init(&state.stale_xdg_output_resources);
 	wl_list_init(&state.server.clients);
-	wl_list_init(&state.forward.color_feedback_resources);
 
 	// Create the downstream display now, so that per-output plugin commands
 	// launched on upstream output receipt have something to connect to.
@@ -2460,21 +3589,21 @@ int main(int argc, char **argv) {
 	/* fill in dmabuf modifier list if empty and upstream provided dmabuf-feedback */
 	if (state.forward.linux_dmabuf && zwp_linux_dmabuf_v1_get_version(state.forward.linux_dmabuf) >= 4) {
 		size_t npairs = 0;
-		for (size_t i = 0; i < state.forward.current.tranches_len; i++) {
-			npairs += state.forward.current.tranches[i].indices.size;
+		for (size_t i = 0; i < state.forward.default_feedback.current.tranches_len; i++) {
+			npairs += state.forward.default_feedback.current.tranches[i].indices.size;
 		}
 		free(state.forward.dmabuf_formats);
 		state.forward.dmabuf_formats = calloc(npairs, sizeof(struct dmabuf_modifier_pair));
 
-		void *table = mmap(NULL, state.forward.current.table_fd_size, PROT_READ, MAP_PRIVATE,  state.forward.current.table_fd, 0);
+		void *table = mmap(NULL, state.forward.default_feedback.current.table_fd_size, PROT_READ, MAP_PRIVATE,  state.forward.default_feedback.current.table_fd, 0);
 		if (table == MAP_FAILED) {
 			swaylock_log(LOG_ERROR, "Failed to map dmabuf feedback table");
 			return 1;
 		}
 		struct feedback_pair *table_data = table;
 		size_t j = 0;
-		for (size_t i = 0; i < state.forward.current.tranches_len; i++) {
-			const struct wl_array *indices = &state.forward.current.tranches[i].indices;
+		for (size_t i = 0; i < state.forward.default_feedback.current.tranches_len; i++) {
+			const struct wl_array *indices = &state.forward.default_feedback.current.tranches[i].indices;
 			for (size_t k = 0; k < indices->size / 2; k++) {
 				uint16_t index = ((uint16_t*)indices->data)[k];
 				state.forward.dmabuf_formats[j].format = table_data[index].format;
@@ -2484,18 +3613,29 @@ int main(int argc, char **argv) {
 			}
 		}
 		state.forward.dmabuf_formats_len = j;
-		munmap(table, state.forward.current.table_fd_size);
+		munmap(table, state.forward.default_feedback.current.table_fd_size);
 		// todo: sort & deduplicate table?
 	}
 
+	resolve_drm_render_node(&state.forward);
+
 	// Blind forwarding interfaces. TODO: cache data until needed, so
 	// as to avoid creating unused buffers or surfaces on the compositor.
-	// Also TODO: forwarding linux-dmabuf and (only the device part) of wl-drm
+	/* the nested version matches upstream, as wl_surface::offset and the
+	 * preferred buffer scale and transform are forwarded */
 	state.server.compositor = wl_global_create(state.server.display,
-		&wl_compositor_interface, 4, &state.forward, bind_wl_compositor);
+		&wl_compositor_interface, wl_compositor_get_version(state.compositor),
+		&state.forward, bind_wl_compositor);
+	/* --mirror only copies the plugin's lock surfaces to other outputs */
+	bool mirror = state.args.mirror && !state.args.plugin_per_output;
+	if (!mirror) {
+		state.server.subcompositor = wl_global_create(state.server.display,
+			&wl_subcompositor_interface, 1, &state.forward, bind_subcompositor);
+	}
 	state.server.shm = wl_global_create(state.server.display,
 		&wl_shm_interface, 1, &state.forward, bind_wl_shm);
-	if (state.forward.drm) {
+	if ((state.forward.drm || state.forward.linux_dmabuf) && state.forward.drm_render_node) {
+		/* legacy EGL clients; prime buffers are made with linux-dmabuf if possible */
 		state.server.drm = wl_global_create(state.server.display,
 			&wl_drm_interface, 2, &state.forward, bind_drm);
 	}
@@ -2512,6 +3652,8 @@ int main(int argc, char **argv) {
 	// wayland-client and wayland-server
 	state.server.wlr_layer_shell = wl_global_create(state.server.display,
 		&zwlr_layer_shell_v1_interface, 5, &state, bind_wlr_layer_shell);
+	state.server.xdg_wm_base = wl_global_create(state.server.display,
+		&xdg_wm_base_interface, 7, NULL, bind_xdg_wm_base);
 	state.server.xdg_output_manager = wl_global_create(state.server.display,
 		&zxdg_output_manager_v1_interface, 2, NULL, bind_xdg_output_manager);
 	if (state.forward.fractional_scale) {
@@ -2522,6 +3664,43 @@ int main(int argc, char **argv) {
 		state.server.wp_viewporter = wl_global_create(state.server.display,
 			&wp_viewporter_interface, 1, &state.forward, bind_viewporter);
 	}
+	// Always offered, as the buffers can be emulated with shm
+	state.server.wp_single_pixel_buffer_manager = wl_global_create(state.server.display,
+		&wp_single_pixel_buffer_manager_v1_interface, 1, &state.forward,
+		bind_single_pixel_buffer_manager);
+	if (state.forward.presentation && state.forward.presentation_clock_id_done) {
+		state.server.wp_presentation = wl_global_create(state.server.display,
+			&wp_presentation_interface, state.forward.presentation_version,
+			&state.forward, bind_presentation);
+	}
+	if (state.forward.fifo_manager) {
+		state.server.wp_fifo_manager = wl_global_create(state.server.display,
+			&wp_fifo_manager_v1_interface, 1, &state.forward, bind_fifo_manager);
+	}
+	if (state.forward.commit_timing_manager) {
+		state.server.wp_commit_timing_manager = wl_global_create(state.server.display,
+			&wp_commit_timing_manager_v1_interface, 1, &state.forward,
+			bind_commit_timing_manager);
+	}
+#if HAVE_LIBDRM
+	if (state.forward.syncobj_manager && state.forward.linux_dmabuf && !mirror &&
+			state.forward.drm_render_node) {
+		/* only dmabufs can be used with explicit synchronization; with
+		 * --mirror, one release point could not cover every output.
+		 * Plugin timelines are checked on the render node before they
+		 * are passed on. */
+		state.forward.drm_fd = open(state.forward.drm_render_node,
+			O_RDWR | O_CLOEXEC);
+		if (state.forward.drm_fd == -1) {
+			swaylock_log_errno(LOG_ERROR, "Failed to open %s, not offering "
+				"explicit synchronization", state.forward.drm_render_node);
+		} else {
+			state.server.wp_linux_drm_syncobj_manager = wl_global_create(state.server.display,
+				&wp_linux_drm_syncobj_manager_v1_interface, 1, &state.forward,
+				bind_syncobj_manager);
+		}
+	}
+#endif
 	if (state.forward.color_management) {
 		assert(state.forward.color_management_done);
 		state.server.wp_color_manager = wl_global_create(state.server.display,
@@ -2536,16 +3715,37 @@ int main(int argc, char **argv) {
 	}
 	state.server.loop = wl_display_get_event_loop(state.server.display);
 
+	// Input from the compositor and replies from the password checker are
+	// handled before (possibly heavy) plugin traffic
 	loop_add_fd(state.eventloop, wl_display_get_fd(state.display), POLLIN,
 		display_in, NULL);
+	loop_set_fd_priority(state.eventloop, wl_display_get_fd(state.display),
+		LOOP_PRIORITY_HIGH);
+	loop_set_fd_unlocked(state.eventloop, wl_display_get_fd(state.display));
 
 	loop_add_fd(state.eventloop, get_comm_reply_fd(), POLLIN, comm_in, NULL);
-
-	loop_add_fd(state.eventloop, wl_event_loop_get_fd(state.server.loop),
-		POLLIN, dispatch_nested, NULL);
+	loop_set_fd_priority(state.eventloop, get_comm_reply_fd(),
+		LOOP_PRIORITY_HIGH);
+
+	if (state.args.nested_thread) {
+		loop_add_fd(state.eventloop, nested_notify_fds[0], POLLIN,
+			nested_notify_in, NULL);
+		loop_set_fd_priority(state.eventloop, nested_notify_fds[0],
+			LOOP_PRIORITY_HIGH);
+		loop_set_fd_unlocked(state.eventloop, nested_notify_fds[0]);
+	} else {
+		loop_add_fd(state.eventloop, wl_event_loop_get_fd(state.server.loop),
+			POLLIN, dispatch_nested, NULL);
+		loop_set_fd_priority(state.eventloop,
+			wl_event_loop_get_fd(state.server.loop), LOOP_PRIORITY_LOW);
+	}
 
 	loop_add_fd(state.eventloop, sigusr_fds[0], POLLIN, term_in, NULL);
+	loop_set_fd_priority(state.eventloop, sigusr_fds[0], LOOP_PRIORITY_HIGH);
 	loop_add_fd(state.eventloop, sigusr2_fds[0], POLLIN, lock_in, NULL);
+	if (state.args.loop_stats) {
+		loop_add_fd(state.eventloop, sigstats_fds[0], POLLIN, stats_in, NULL);
+	}
 
 	sa.sa_handler = do_sigusr;
 	sigemptyset(&sa.sa_mask);
@@ -2557,6 +3757,13 @@ int main(int argc, char **argv) {
 	sa.sa_flags = SA_RESTART;
 	sigaction(SIGUSR2, &sa, NULL);
 
+	if (state.args.loop_stats) {
+		sa.sa_handler = do_sigstats;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGRTMIN, &sa, NULL);
+	}
+
 	// Ignore SIGCHLD, to make child processes be automatically reaped.
 	// (This setting is not inherited to child processes.)
 	struct sigaction sa2;
@@ -2568,6 +3775,15 @@ int main(int argc, char **argv) {
 	state.sleep_comm_r = -1;
 	state.sleep_comm_w = -1;
 
+	if (state.args.nested_thread) {
+		state.run_display = true;
+		setup_forwarding_queue(&state);
+		if (!start_nested_thread(&state)) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	pthread_mutex_lock(&nested_lock);
 	// Create outputs (possibly starting plugin commands for them)
 	struct swaylock_surface *surface;
 	wl_list_for_each(surface, &state.surfaces, link) {
@@ -2580,19 +3796,16 @@ int main(int argc, char **argv) {
 			setup_clientless_mode(&state);
 		}
 	}
+	pthread_mutex_unlock(&nested_lock);
 
 	// Wait until the compositor locks the screen (or cancels), dispatching
 	// plugin connections to draw lock surfaces, as compositors may wait to
 	// decide until the lock surfaces are all ready.
 	state.run_display = true;
 	while (!state.locked && state.run_display) {
-		errno = 0;
-		if (wl_display_flush(state.display) == -1 && errno != EAGAIN) {
+		if (!dispatch_upstream_pending() || !flush_all()) {
 			break;
 		}
-		if (state.server.display) {
-			wl_display_flush_clients(state.server.display);
-		}
 
 		loop_poll(state.eventloop);
 	}
@@ -2607,34 +3820,43 @@ int main(int argc, char **argv) {
 		state.args.ready_fd = -1;
 	}
 	if (state.args.daemonize) {
+		// Only the calling thread survives fork()
+		bool restart_thread = nested_thread_running;
+		stop_nested_thread(&state);
 		daemonize();
+		if (restart_thread && !start_nested_thread(&state)) {
+			return EXIT_FAILURE;
+		}
 	}
+	pthread_mutex_lock(&nested_lock);
 	if (state.args.grace_time > 0.) {
 		float delay_ms = ceilf(state.args.grace_time * 1000.f);
 		int delay = delay_ms >= (float)INT_MAX ? INT_MAX : (int)delay_ms;
 
 		/* Failure of this process just cancels the grace period */
 		if (start_sleep_watcher(&state.sleep_comm_r, &state.sleep_comm_w) == 0) {
+			/* No slack: firing late would extend the unlock window */
 			state.grace_timer = loop_add_timer(state.eventloop, delay, grace_timeout, &state);
 			loop_add_fd(state.eventloop, state.sleep_comm_r, POLLIN, sleep_in, &state);
 		}
 	}
+	pthread_mutex_unlock(&nested_lock);
 
 	while (state.run_display) {
-		errno = 0;
-		if (wl_display_flush(state.display) == -1 && errno != EAGAIN) {
+		if (!dispatch_upstream_pending() || !flush_all()) {
 			break;
 		}
-		if (state.server.display) {
-			wl_display_flush_clients(state.server.display);
-		}
 
 		loop_poll(state.eventloop);
 	}
 
+	stop_nested_thread(&state);
+
 	ext_session_lock_v1_unlock_and_destroy(state.ext_session_lock_v1);
 	wl_display_roundtrip(state.display);
 
+	loop_print_stats(state.eventloop);
+
 	free(state.args.font);
 	cairo_destroy(state.test_cairo);
 	cairo_surface_destroy(state.test_surface);
@@ -64,8 +64,8 @@ static void schedule_input_idle(struct swaylock_state *state) {
 	if (state->input_idle_timer) {
 		loop_remove_timer(state->eventloop, state->input_idle_timer);
 	}
-	state->input_idle_timer = loop_add_timer(
-		state->eventloop, 1500, set_input_idle, state);
+	state->input_idle_timer = loop_add_timer_slack(
+		state->eventloop, 1500, 250, set_input_idle, state);
 }
 
 static void cancel_input_idle(struct swaylock_state *state) {
@@ -79,8 +79,8 @@ void schedule_auth_idle(struct swaylock_state *state) {
 	if (state->auth_idle_timer) {
 		loop_remove_timer(state->eventloop, state->auth_idle_timer);
 	}
-	state->auth_idle_timer = loop_add_timer(
-		state->eventloop, 3000, set_auth_idle, state);
+	state->auth_idle_timer = loop_add_timer_slack(
+		state->eventloop, 3000, 500, set_auth_idle, state);
 }
 
 static void clear_password(void *data) {
@@ -96,8 +96,8 @@ static void schedule_password_clear(struct swaylock_state *state) {
 	if (state->clear_password_timer) {
 		loop_remove_timer(state->eventloop, state->clear_password_timer);
 	}
-	state->clear_password_timer = loop_add_timer(
-			state->eventloop, 10000, clear_password, state);
+	state->clear_password_timer = loop_add_timer_slack(
+			state->eventloop, 10000, 1000, clear_password, state);
 }
 
 static void cancel_password_clear(struct swaylock_state *state) {
@@ -11,7 +11,7 @@
 #include <wayland-client.h>
 #include "pool-buffer.h"
 
-static int anonymous_shm_open(void) {
+int anonymous_shm_open(void) {
 	int retries = 100;
 
 	do {
@@ -0,0 +1,126 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "log.h"
+#include "region.h"
+
+void region_init(struct region *region) {
+	region->rects = NULL;
+	region->len = 0;
+	region->capacity = 0;
+}
+
+void region_finish(struct region *region) {
+	free(region->rects);
+	region_init(region);
+}
+
+void region_clear(struct region *region) {
+	region->len = 0;
+}
+
+static uint64_t rect_area(const struct region_rect *r) {
+	return (uint64_t)r->width * (uint64_t)r->height;
+}
+
+static struct region_rect rect_bounds(const struct region_rect *a,
+		const struct region_rect *b) {
+	int64_t x1 = a->x < b->x ? a->x : b->x;
+	int64_t y1 = a->y < b->y ? a->y : b->y;
+	int64_t ax2 = (int64_t)a->x + a->width, bx2 = (int64_t)b->x + b->width;
+	int64_t ay2 = (int64_t)a->y + a->height, by2 = (int64_t)b->y + b->height;
+	int64_t x2 = ax2 > bx2 ? ax2 : bx2;
+	int64_t y2 = ay2 > by2 ? ay2 : by2;
+	return (struct region_rect){
+		.x = x1, .y = y1, .width = x2 - x1, .height = y2 - y1,
+	};
+}
+
+static uint64_t overlap_area(const struct region_rect *a,
+		const struct region_rect *b) {
+	int64_t x1 = a->x > b->x ? a->x : b->x;
+	int64_t y1 = a->y > b->y ? a->y : b->y;
+	int64_t ax2 = (int64_t)a->x + a->width, bx2 = (int64_t)b->x + b->width;
+	int64_t ay2 = (int64_t)a->y + a->height, by2 = (int64_t)b->y + b->height;
+	int64_t x2 = ax2 < bx2 ? ax2 : bx2;
+	int64_t y2 = ay2 < by2 ? ay2 : by2;
+	if (x2 <= x1 || y2 <= y1) {
+		return 0;
+	}
+	return (uint64_t)(x2 - x1) * (uint64_t)(y2 - y1);
+}
+
+/* Merge if the bounding box covers no more uncovered area than the overlap;
+ * this includes containment and rectangles that tile a larger one. All
+ * coordinates are in [0, INT32_MAX], so the areas cannot overflow. */
+static bool should_merge(const struct region_rect *a,
+		const struct region_rect *b) {
+	struct region_rect bounds = rect_bounds(a, b);
+	uint64_t overlap = overlap_area(a, b);
+	uint64_t covered = rect_area(a) + rect_area(b) - overlap;
+	return rect_area(&bounds) - covered <= overlap;
+}
+
+void region_add(struct region *region, int32_t x, int32_t y,
+		int32_t width, int32_t height, size_t max_rects) {
+	if (width <= 0 || height <= 0) {
+		return;
+	}
+	int64_t x1 = x > 0 ? x : 0, y1 = y > 0 ? y : 0;
+	int64_t x2 = (int64_t)x + width, y2 = (int64_t)y + height;
+	if (x2 > INT32_MAX) {
+		x2 = INT32_MAX;
+	}
+	if (y2 > INT32_MAX) {
+		y2 = INT32_MAX;
+	}
+	if (x2 <= x1 || y2 <= y1) {
+		return;
+	}
+	struct region_rect rect = {
+		.x = x1, .y = y1, .width = x2 - x1, .height = y2 - y1,
+	};
+
+	/* Merging can make the new rectangle mergeable with ones already
+	 * checked, so restart after each merge */
+	bool merged = true;
+	while (merged) {
+		merged = false;
+		for (size_t i = 0; i < region->len; i++) {
+			if (should_merge(&region->rects[i], &rect)) {
+				rect = rect_bounds(&region->rects[i], &rect);
+				region->rects[i] = region->rects[--region->len];
+				merged = true;
+				break;
+			}
+		}
+	}
+
+	if (region->len + 1 > max_rects) {
+		for (size_t i = 0; i < region->len; i++) {
+			rect = rect_bounds(&region->rects[i], &rect);
+		}
+		region->len = 0;
+	}
+
+	if (region->len == region->capacity) {
+		size_t new_capacity = region->capacity > 0 ? 2 * region->capacity : 8;
+		struct region_rect *new_rects = realloc(region->rects,
+			sizeof(struct region_rect) * new_capacity);
+		if (!new_rects) {
+			swaylock_log(LOG_ERROR, "Unable to allocate memory for region");
+			if (region->capacity == 0) {
+				return;
+			}
+			/* still cover the added area */
+			for (size_t i = 0; i < region->len; i++) {
+				rect = rect_bounds(&region->rects[i], &rect);
+			}
+			region->len = 0;
+		} else {
+			region->rects = new_rects;
+			region->capacity = new_capacity;
+		}
+	}
+	region->rects[region->len++] = rect;
+}
@@ -0,0 +1,72 @@
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "slab.h"
+
+struct slab_chunk {
+	struct slab_chunk *next;
+	/* objects follow, suitably aligned */
+	alignas(max_align_t) unsigned char data[];
+};
+
+void slab_init(struct slab *slab, size_t object_size, size_t objects_per_chunk) {
+	size_t align = alignof(max_align_t);
+	if (object_size < sizeof(void *)) {
+		object_size = sizeof(void *);
+	}
+	slab->object_size = (object_size + align - 1) / align * align;
+	slab->objects_per_chunk = objects_per_chunk > 0 ? objects_per_chunk : 1;
+	slab->free_list = NULL;
+	slab->chunks = NULL;
+	slab->chunk_count = 0;
+}
+
+void slab_finish(struct slab *slab) {
+	struct slab_chunk *chunk = slab->chunks;
+	while (chunk) {
+		struct slab_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	slab->chunks = NULL;
+	slab->free_list = NULL;
+}
+
+static bool slab_grow(struct slab *slab) {
+	struct slab_chunk *chunk = malloc(sizeof(struct slab_chunk) +
+		slab->object_size * slab->objects_per_chunk);
+	if (!chunk) {
+		return false;
+	}
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+	slab->chunk_count++;
+
+	/* Thread the new objects onto the free list, lowest address first */
+	for (size_t i = slab->objects_per_chunk; i-- > 0;) {
+		void *object = chunk->data + i * slab->object_size;
+		*(void **)object = slab->free_list;
+		slab->free_list = object;
+	}
+	return true;
+}
+
+void *slab_alloc(struct slab *slab) {
+	if (!slab->free_list && !slab_grow(slab)) {
+		return NULL;
+	}
+	void *object = slab->free_list;
+	slab->free_list = *(void **)object;
+	memset(object, 0, slab->object_size);
+	return object;
+}
+
+void slab_free(struct slab *slab, void *object) {
+	if (!object) {
+		return;
+	}
+	*(void **)object = slab->free_list;
+	slab->free_list = object;
+}